@@ -0,0 +1,228 @@
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "bitvector.h"
+
+// The largest bitvector of the sweep is 2^BENCH_MAX_SHIFT bit. The default of 2^32 bit takes 512 MiB per bitvector,
+// define a larger value like -DBENCH_MAX_SHIFT=36 on machines with enough memory for the multi-gigabyte sizes.
+#ifndef BENCH_MAX_SHIFT
+#define BENCH_MAX_SHIFT 32
+#endif
+#define BENCH_MIN_SHIFT 12              // 4096 bit, which stays in the L1 cache with all helper structures.
+#define BENCH_CONSTRUCT_MAX_SHIFT 30    // The ASCII input of the constructor takes a byte per bit.
+#define BENCH_QUERIES (1 << 16)         // Query positions generated per benchmark and answered per iteration.
+#define BENCH_CLUSTER_BITS 8192         // The mean length of a run of ones plus the run of zeros after it.
+
+/**
+ * The bitvectors of the sweep. Positions are either uniformly random with the given density, or clustered into runs
+ * of ones whose lengths and gaps follow a geometric distribution with the same density on average.
+ */
+enum distribution { UNIFORM = 0, CLUSTERED = 1 };
+
+/**
+ * Generates the packed words of a bitvector. Uniform words combine 16 random words along the binary digits of the
+ * density, so every bit is set with a probability of density rounded to 1/65536, at 16 random numbers per word
+ * instead of 64.
+ * @param bits The length in bit.
+ * @param permille The density of ones in tenths of a percent.
+ * @param dist The distribution of the ones.
+ * @return The words, bit i is bit i % 64 of word i / 64.
+ */
+static indexArray<uint64> generateWords(uint64 bits, int64_t permille, distribution dist) {
+    std::mt19937_64 random(bits ^ (uint64) permille << 40 ^ (uint64) dist << 56);
+    indexArray<uint64> words((bits + 63) >> 6);
+    double density = (double) permille / 1000;
+    if (dist == UNIFORM) {
+        auto threshold = (uint64) std::llround(density * 65536);
+        for (auto& word : words) {
+            uint64 result = 0;
+            for (int digit = 0; digit < 16; ++digit) {
+                result = (threshold >> digit) & 1 ? result | random() : result & random();
+            }
+            word = threshold >= 65536 ? ~0ULL : result;
+        }
+    } else {
+        std::geometric_distribution<uint64> ones(1.0 / std::max(1.0, density * BENCH_CLUSTER_BITS));
+        std::geometric_distribution<uint64> zeros(1.0 / std::max(1.0, (1 - density) * BENCH_CLUSTER_BITS));
+        for (uint64 position = zeros(random); position < bits;) {
+            uint64 end = std::min(bits, position + 1 + ones(random));
+            for (; position < end; ++position) words[position >> 6] |= 1ULL << (position & 63);
+            position += 1 + zeros(random);
+        }
+    }
+    if (bits & 63) words.back() &= (1ULL << (bits & 63)) - 1;
+    return words;
+}
+
+/**
+ * Returns the bitvector with its helper structures for the given parameters. Building the large ones takes much
+ * longer than the benchmark itself, so the last one is kept for the following benchmarks with the same parameters.
+ * @param shift The length is 2^shift bit.
+ * @param permille The density of ones in tenths of a percent.
+ * @param dist The distribution of the ones.
+ * @return The bitvector.
+ */
+static const bitvector& cachedBitvector(int64_t shift, int64_t permille, distribution dist) {
+    static std::tuple<int64_t, int64_t, distribution> key { -1, -1, UNIFORM };
+    static std::unique_ptr<bitvector> cached;
+    if (key != std::make_tuple(shift, permille, dist)) {
+        // Free the last one first, only one large bitvector fits into memory at a time.
+        cached.reset();
+        cached = std::make_unique<bitvector>(generateWords(1ULL << shift, permille, dist), 1ULL << shift);
+        cached->buildHelpers();
+        key = { shift, permille, dist };
+    }
+    return *cached;
+}
+
+/**
+ * Generates the query arguments: random or increasing positions, or numbers of ones or zeros for select.
+ * @param limit All arguments are less than this, at least 1.
+ * @param sequential Whether the arguments increase in equal steps instead of being random.
+ * @param first The smallest argument.
+ * @return BENCH_QUERIES arguments.
+ */
+static std::vector<uint64> generateQueries(uint64 limit, bool sequential, uint64 first) {
+    std::vector<uint64> queries(BENCH_QUERIES);
+    std::mt19937_64 random(limit);
+    uint64 range = limit > first ? limit - first : 1;
+    for (uint64 i = 0; i < queries.size(); ++i) {
+        queries[i] = first + (sequential ? (i * std::max<uint64>(1, range / BENCH_QUERIES)) % range : random() % range);
+    }
+    return queries;
+}
+
+/**
+ * Sets the counters every query benchmark reports: the time per query and the space of the bitvector per bit.
+ * @param state The benchmark state.
+ * @param vect The bitvector.
+ * @param bits Its length.
+ */
+static void reportQueries(benchmark::State& state, const bitvector& vect, uint64 bits) {
+    state.SetItemsProcessed((int64_t) state.iterations() * BENCH_QUERIES);
+    state.counters["ns/query"] = benchmark::Counter((double) state.iterations() * BENCH_QUERIES,
+                                                    benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+    state.counters["bits/bit"] = (double) vect.size() / (double) bits;
+}
+
+// Arguments of every query benchmark: the size shift, the density in permille, the distribution and whether the
+// queries are sequential.
+static void benchAccess(benchmark::State& state) {
+    const bitvector& vect = cachedBitvector(state.range(0), state.range(1), (distribution) state.range(2));
+    std::vector<uint64> positions = generateQueries(1ULL << state.range(0), state.range(3), 0);
+    for (auto _ : state) {
+        for (uint64 position : positions) benchmark::DoNotOptimize(vect.access(position));
+    }
+    reportQueries(state, vect, 1ULL << state.range(0));
+}
+
+template<uint8_t BIT_VALUE>
+static void benchRank(benchmark::State& state) {
+    const bitvector& vect = cachedBitvector(state.range(0), state.range(1), (distribution) state.range(2));
+    std::vector<uint64> positions = generateQueries(1ULL << state.range(0), state.range(3), 0);
+    for (auto _ : state) {
+        for (uint64 position : positions) benchmark::DoNotOptimize(vect.rank(position, BIT_VALUE));
+    }
+    reportQueries(state, vect, 1ULL << state.range(0));
+}
+
+template<uint8_t BIT_VALUE>
+static void benchSelect(benchmark::State& state) {
+    uint64 bits = 1ULL << state.range(0);
+    const bitvector& vect = cachedBitvector(state.range(0), state.range(1), (distribution) state.range(2));
+    uint64 total = vect.rank(bits, BIT_VALUE);
+    if (total == 0) {
+        state.SkipWithError("no bits of this value");
+        return;
+    }
+    std::vector<uint64> nums = generateQueries(total + 1, state.range(3), 1);
+    for (auto _ : state) {
+        for (uint64 num : nums) benchmark::DoNotOptimize(vect.select(num, BIT_VALUE));
+    }
+    reportQueries(state, vect, bits);
+}
+
+/**
+ * The constructor from the ASCII line, as it is read from an input file.
+ */
+static void benchConstruct(benchmark::State& state) {
+    uint64 bits = 1ULL << state.range(0);
+    indexArray<uint64> words = generateWords(bits, state.range(1), (distribution) state.range(2));
+    std::string ascii(bits, '0');
+    for (uint64 i = 0; i < bits; ++i) ascii[i] = (char) ('0' + ((words[i >> 6] >> (i & 63)) & 1));
+    for (auto _ : state) {
+        bitvector vect(ascii);
+        benchmark::DoNotOptimize(vect);
+    }
+    state.SetBytesProcessed((int64_t) (state.iterations() * bits));
+}
+
+/**
+ * Building the rank metadata and select samples, without the constructor.
+ */
+static void benchBuildHelpers(benchmark::State& state) {
+    uint64 bits = 1ULL << state.range(0);
+    indexArray<uint64> words = generateWords(bits, state.range(1), (distribution) state.range(2));
+    uint64 space = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        bitvector vect(std::span<const uint64>(words), bits);
+        state.ResumeTiming();
+        vect.buildHelpers();
+        space = vect.size();
+    }
+    state.SetBytesProcessed((int64_t) (state.iterations() * bits / 8));
+    state.counters["bits/bit"] = (double) space / (double) bits;
+}
+
+/**
+ * The sweep: sizes from L1-resident to BENCH_MAX_SHIFT in steps of 16x, densities from 0.1% to 99.9%, uniform and
+ * clustered ones, and for queries, random and sequential positions.
+ */
+static void buildSweep(benchmark::internal::Benchmark* bench) {
+    bench->ArgNames({ "log2bits", "permille", "clustered" });
+    for (int64_t shift = BENCH_MIN_SHIFT + 4; shift <= std::min(BENCH_MAX_SHIFT, BENCH_CONSTRUCT_MAX_SHIFT); shift += 4) {
+        for (int64_t permille : { 1, 500, 999 }) {
+            for (int64_t dist : { UNIFORM, CLUSTERED }) bench->Args({ shift, permille, dist });
+        }
+    }
+    bench->Unit(benchmark::kMillisecond);
+}
+
+// The query benchmarks are registered grouped by bitvector, not by query type, so every bitvector is only built once.
+static void registerQueryBenchmarks() {
+    std::vector<std::vector<int64_t>> sweep;
+    for (int64_t shift = BENCH_MIN_SHIFT; shift <= BENCH_MAX_SHIFT; shift += 4) {
+        for (int64_t permille : { 1, 10, 100, 500, 900, 990, 999 }) {
+            for (int64_t dist : { UNIFORM, CLUSTERED }) {
+                for (int64_t sequential : { 0, 1 }) sweep.push_back({ shift, permille, dist, sequential });
+            }
+        }
+    }
+    for (const auto& args : sweep) {
+        std::vector<std::string> names { "log2bits", "permille", "clustered", "sequential" };
+        benchmark::RegisterBenchmark("access", benchAccess)->Args(args)->ArgNames(names);
+        benchmark::RegisterBenchmark("rank0", benchRank<0>)->Args(args)->ArgNames(names);
+        benchmark::RegisterBenchmark("rank1", benchRank<1>)->Args(args)->ArgNames(names);
+        benchmark::RegisterBenchmark("select0", benchSelect<0>)->Args(args)->ArgNames(names);
+        benchmark::RegisterBenchmark("select1", benchSelect<1>)->Args(args)->ArgNames(names);
+    }
+}
+
+BENCHMARK(benchConstruct)->Apply(buildSweep);
+BENCHMARK(benchBuildHelpers)->Apply(buildSweep);
+
+int main(int argc, char** argv) {
+    registerQueryBenchmarks();
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
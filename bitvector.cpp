@@ -1,42 +1,292 @@
 #include "bitvector.h"
+#include "instrumentation.h"
+#include "kernels.h"
+#include "numa.h"
 
+#include <algorithm>
 #include <bit>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <istream>
+#include <span>
+#include <thread>
+
+// The record of a block in the interleaved layout, see interleavedLayout.
+#define RECORD_WORDS 10
+#define RECORD_DATA 2                   // Index of the first word of the block inside its record.
+
+// How the bitvector is stored: the plain layout, Elias-Fano over the ones or the zeros (see buildSparse),
+// or compressed with RRR (see buildCompressed).
+#define BACKEND_PLAIN 0
+#define BACKEND_SPARSE_ONES 1
+#define BACKEND_SPARSE_ZEROS 2
+#define BACKEND_RRR 3
+
+/**
+ * Returns the ones in a superblock of the standard or small layout before the given block, from its metadata.
+ * The position of the counter is known at compile time for a constant block, then this is one or two shifts.
+ * For the first block, this is always 0.
+ * @param metadata The metadata words of the superblock.
+ * @param block The block number inside the superblock.
+ * @return The ones before the block.
+ */
+template<typename LAYOUT>
+inline uint64 basic_bitvector<LAYOUT>::blockCounter(const uint64* metadata, uint64 block) {
+    uint64 position = COUNTER_POSITIONS[block];
+    uint64 bits = METADATA_WORDS == 1 || position >= 64 ? metadata[0] >> (position - 64)
+                                                        : (metadata[1] >> position) | ((metadata[0] << 1) << (63 - position));
+    return bits & ((1ULL << COUNTER_WIDTHS[block]) - 1);
+}
+
+/**
+ * Adds the counter of a block to the metadata of a superblock, the counterpart to blockCounter.
+ * @param metadata The metadata words of the superblock.
+ * @param block The block number inside the superblock, at least 1.
+ * @param ones The ones in the superblock before the block.
+ */
+template<typename LAYOUT>
+inline void basic_bitvector<LAYOUT>::packBlockCounter(uint64* metadata, uint64 block, uint64 ones) {
+    uint64 position = COUNTER_POSITIONS[block];
+    if (METADATA_WORDS == 1 || position >= 64) {
+        metadata[0] |= ones << (position - 64);
+    } else {
+        metadata[1] |= ones << position;
+        metadata[0] |= (ones >> 1) >> (63 - position);
+    }
+}
+
+/**
+ * Returns where the index-th 64-bit word of the bitvector is stored, wherever the layout keeps it.
+ * @param index The word index.
+ * @return The address of the word.
+ */
+template<typename LAYOUT>
+inline const uint64* basic_bitvector<LAYOUT>::wordPointer(uint64 index) const {
+    if constexpr (LAYOUT::interleaved) return vector.data() + (index >> 3) * RECORD_WORDS + RECORD_DATA + (index & 7);
+    else return vector.data() + index;
+}
+
+/**
+ * Returns the index-th 64-bit word of the bitvector.
+ * @param index The word index.
+ * @return The word.
+ */
+template<typename LAYOUT>
+inline uint64 basic_bitvector<LAYOUT>::word(uint64 index) const {
+    return *wordPointer(index);
+}
+
+/**
+ * Creates an empty bitvector without any bits, to be filled with load(path).
+ */
+template<typename LAYOUT>
+basic_bitvector<LAYOUT>::basic_bitvector() : L0SingleBlockData(0), oneCount(0), zeroCount(0), lastOnePos(0), lastZeroPos(0),
+                         selectSampleShift_0(LAYOUT::selectSampleShift),
+                         selectSampleShift_1(LAYOUT::selectSampleShift), wordCount(0), backend(BACKEND_PLAIN) {}
 
 /**
  * Creates a new bitvector. Initializes all values to prevent unwanted errors and warnings,
  * and reads the bitvector from a string to a vector\<uint64>.<br/>
  * To reduce shift operations, the bits inside a 64-bit word are stored from right to left, so
  * in reverse order.<br/>
- * This string may end with window's line break remnant of \\r.
+ * The bitvector ends at the first line break of the string, so the string can go on after it, like the rest of an input
+ * file. The line may end with window's line break remnant of \\r, any other characters than '0' and '1' at the end
+ * are ignored as well. All characters before must be '0' or '1', they are not validated.<br/>
+ * The string is only read, so it can be a view directly into a memory mapped input file. It is packed in slices
+ * using the fastest vectorized kernel the CPU supports, and the line break is searched in every slice right before
+ * it is packed, so every character is loaded once. After each slice, consumed is called with the part of the
+ * string that will not be read again. This way, the caller can release memory early. Together, the slices are the line
+ * without its line break.<br/>
+ * The vector is reserved once for the length estimateLineLength(...) finds in a few reads, so it is neither grown nor
+ * copied. Only if the line turns out longer, it is reserved for the whole string and shrunk to the line at the end.
  * @param str The string.
+ * @param consumed Optional callback for every finished slice of the line.
  */
-bitvector::bitvector(std::string& str) {
+template<typename LAYOUT>
+basic_bitvector<LAYOUT>::basic_bitvector(std::string_view str, const std::function<void(std::string_view)>& consumed) {
     // Initialize Values
     L0SingleBlockData = 0;
     zeroCount = 0;
     oneCount = 0;
     lastOnePos = 0;
     lastZeroPos = 0;
+    selectSampleShift_0 = LAYOUT::selectSampleShift;
+    selectSampleShift_1 = LAYOUT::selectSampleShift;
+    backend = BACKEND_PLAIN;
+
+    uint64 reserved = estimateLineLength(str);
+    reserveFor(reserved);
+    uint64 length = 0;
+    // Slices are a multiple of 512 characters, so every slice starts at the beginning of a block.
+    for (size_t sliceStart = 0; sliceStart < str.length(); sliceStart += CONSTRUCTION_SLICE_SIZE) {
+        std::string_view slice = str.substr(sliceStart, CONSTRUCTION_SLICE_SIZE);
+        auto lineBreak = (const char*) std::memchr(slice.data(), '\n', slice.size());
+        if (lineBreak) slice = slice.substr(0, lineBreak - slice.data());
+        // Because of windows \r\n line break stuff, drop everything that is not a '0' or '1' at the end. Only the end of
+        // the line has any, which may also be the end of a slice.
+        std::string_view bits = slice;
+        while (!bits.empty() && (bits.back() > '1' || bits.back() < '0')) bits.remove_suffix(1);
+        length = sliceStart + bits.size();
+        if (length > reserved) {
+            reserved = str.length();
+            reserveFor(reserved);
+        }
+        resizeFor(length);
+        packSlice(bits, sliceStart);
+        if (consumed) consumed(slice);
+        if (lineBreak) break;
+    }
+    resizeFor(length);
+    vector.shrink_to_fit();
+}
+
+/**
+ * Creates a new bitvector from the next line of a stream, like the constructor from a string. The line is read and
+ * packed in slices of CONSTRUCTION_SLICE_SIZE characters, so only one slice of the ASCII line is in memory at a time.
+ * Afterwards, the stream is positioned after the line break, and the rest of the stream can be read as usual.<br/>
+ * If the stream can tell how much is left, the vector is allocated once for that many characters. Otherwise, like for
+ * pipes, it grows with the line and is shrunk to its size at the end. Either way, the peak memory is close to the
+ * packed vector, not the ASCII line. Descriptors can be streamed with an std::ifstream on /dev/fd/N.
+ * @param in The stream.
+ */
+template<typename LAYOUT>
+basic_bitvector<LAYOUT>::basic_bitvector(std::istream& in) : basic_bitvector() {
+    // Every character left is an upper bound for the length of the line.
+    uint64 reserved = 0;
+    std::streampos start = in.tellg();
+    if (start != std::streampos(-1) && in.seekg(0, std::ios::end)) {
+        std::streampos end = in.tellg();
+        in.seekg(start);
+        if (end != std::streampos(-1) && end > start) reserved = (uint64) (end - start);
+    }
+    in.clear();
+    resizeFor(reserved);
+
+    std::vector<char> buffer(CONSTRUCTION_SLICE_SIZE + 1);
+    uint64 length = 0;
+    while (true) {
+        // Reads until the line break, which is left in the stream, or until the slice is full.
+        in.get(buffer.data(), (std::streamsize) buffer.size(), '\n');
+        auto read = (size_t) in.gcount();
+        if (read == 0 && in.fail() && !in.eof()) in.clear();    // An empty slice right before the line break.
+        bool last = read < CONSTRUCTION_SLICE_SIZE || in.peek() == '\n' || in.eof();
+        // Because of windows \r\n line break stuff, drop everything that is not a '0' or '1' at the end.
+        if (last) while (read > 0 && (buffer[read - 1] > '1' || buffer[read - 1] < '0')) --read;
+
+        if (length + read > reserved) {
+            reserved = std::max<uint64>(length + read, reserved * 2);
+            resizeFor(reserved);
+        }
+        packSlice(std::string_view(buffer.data(), read), length);
+        length += read;
+        if (last) break;
+    }
+    if (in.peek() == '\n') in.ignore();
+    in.clear(in.rdstate() & ~std::ios::failbit);
 
-    // div by 64 + 1 for rounding
-    vector = std::vector<uint64>((str.length() >> 6) + 1);
-    char innerIndex = 0;
-    uint64 outerIndex = 0;
-    uint64 currentConstruction = 0;
-    for (const char& c : str) {
-        if (c > '1' || c < '0') continue;  // Because of windows \r\n line break stuff, this condition is only false for '0' and '1'
+    // Trim the vector to the actual length. The words after it are 0 already.
+    resizeFor(length);
+    vector.shrink_to_fit();
+}
+
+/**
+ * Creates a new bitvector from words that are packed already, in the same order as the string constructor packs them:
+ * bit i is bit i % 64 of word i / 64. In the standard layout, the words are taken over without a copy, they are only
+ * padded to whole blocks. Words in a std::vector are copied by the span constructor, as
+ * their memory is not aligned to huge pages.<br/>
+ * Missing words are treated as 0, words after the length are dropped, and so are the bits of the last word after it.
+ * @param words The packed words.
+ * @param length The number of bits.
+ */
+template<typename LAYOUT>
+basic_bitvector<LAYOUT>::basic_bitvector(indexArray<uint64>&& words, uint64 length) : basic_bitvector() {
+    if constexpr (LAYOUT::interleaved) {
+        *this = basic_bitvector(std::span<const uint64>(words), length);
+    } else {
+        vector = std::move(words);
+        resizeFor(length);
+        clearTail(length);
+    }
+}
 
-        currentConstruction |= ((uint64) (c - '0')) << innerIndex;
+/**
+ * Creates a new bitvector from a copy of words that are packed already, like the constructor that takes them over.
+ * @param words The packed words.
+ * @param length The number of bits.
+ */
+template<typename LAYOUT>
+basic_bitvector<LAYOUT>::basic_bitvector(std::span<const uint64> words, uint64 length) : basic_bitvector() {
+    resizeFor(length);
+    uint64 used = std::min<uint64>(words.size(), (length + 63) >> 6);
+    if constexpr (LAYOUT::interleaved) {
+        // Every block of 8 words goes into the data words of its own record.
+        for (uint64 block = 0; block < used; block += 8) {
+            std::copy_n(words.data() + block, std::min<uint64>(8, used - block),
+                        vector.data() + (block >> 3) * RECORD_WORDS + RECORD_DATA);
+        }
+    } else {
+        std::copy_n(words.data(), used, vector.data());
+    }
+    clearTail(length);
+}
+
+/**
+ * Sets all bits after the given length to 0, like the string constructor leaves them. In the interleaved layout, only
+ * the word that contains the length can have any, the words after it are never copied.
+ * @param length The number of bits.
+ */
+template<typename LAYOUT>
+void basic_bitvector<LAYOUT>::clearTail(uint64 length) {
+    uint64 index = length >> 6;
+    if constexpr (LAYOUT::interleaved) index = (index >> 3) * RECORD_WORDS + RECORD_DATA + (index & 7);
+    else std::fill(vector.begin() + (std::ptrdiff_t) index + 1, vector.end(), 0);
+    vector[index] &= (1ULL << (length & 63)) - 1;
+}
+
+/**
+ * Sets the number of words for a bitvector of the given length and resizes the vector to fit. New words are 0.
+ * In the interleaved layout, these are whole records, in the standard layout whole blocks, so the popcount kernels
+ * can always load all 8 words of a block.
+ * @param length The number of bits.
+ */
+template<typename LAYOUT>
+void basic_bitvector<LAYOUT>::resizeFor(uint64 length) {
+    // div by 64 + 1 for rounding. The last word is always partial, or entirely unused.
+    wordCount = (length >> 6) + 1;
+    uint64 words = LAYOUT::interleaved ? ((wordCount + 7) >> 3) * RECORD_WORDS : ((wordCount + 7) >> 3) << 3;
+    // Reserving first keeps growing vectors from doubling their capacity.
+    vector.reserve(words);
+    vector.resize(words);
+}
+
+/**
+ * Reserves the vector for a bitvector of at most the given length, without writing to it, so a vector that grows slice
+ * by slice with resizeFor(...) is never copied.
+ * @param length The largest length in bit.
+ */
+template<typename LAYOUT>
+void basic_bitvector<LAYOUT>::reserveFor(uint64 length) {
+    uint64 words = (length >> 6) + 1;
+    vector.reserve(LAYOUT::interleaved ? ((words + 7) >> 3) * RECORD_WORDS : ((words + 7) >> 3) << 3);
+}
 
-        ++innerIndex;
-        if (innerIndex >= 64) {
-            innerIndex = 0;
-            vector[outerIndex++] = currentConstruction;
-            currentConstruction = 0;
+/**
+ * Packs a slice of the ASCII bitvector into the vector, which must be large enough already.
+ * @param slice The characters, '0' and '1' only.
+ * @param sliceStart The position of the first character, a multiple of 512.
+ */
+template<typename LAYOUT>
+void basic_bitvector<LAYOUT>::packSlice(std::string_view slice, uint64 sliceStart) {
+    if constexpr (LAYOUT::interleaved) {
+        // Every block is packed into the data words of its own record.
+        for (size_t block = 0; block < slice.length(); block += BLOCK_SIZE) {
+            packAsciiBits(slice.data() + block, std::min<size_t>(BLOCK_SIZE, slice.length() - block),
+                          vector.data() + ((sliceStart + block) >> 9) * RECORD_WORDS + RECORD_DATA);
         }
+    } else {
+        packAsciiBits(slice.data(), slice.length(), vector.data() + (sliceStart >> 6));
     }
-    // Add last edited too
-    vector[outerIndex] = currentConstruction;
 }
 
 /**
@@ -45,10 +295,15 @@ bitvector::bitvector(std::string& str) {
  * @param ptr The position.
  * @return The bit value at that position.
  */
-uint16_t bitvector::access(uint64& ptr) {
+template<typename LAYOUT>
+uint16_t basic_bitvector<LAYOUT>::access(uint64 ptr) const {
+    if (backend != BACKEND_PLAIN) [[unlikely]] {
+        INSTRUMENT_COUNT(ACCESS_BACKEND);
+        return backend == BACKEND_RRR ? compressed.access(ptr) : sparse.contains(ptr) == (backend == BACKEND_SPARSE_ONES);
+    }
     // 64 bit per entry, stored backwards
     // Get 64 bit segment in the vector, then shift by ptr % 64, and get the resulting first bit with &1
-    return (vector[ptr >> 6] >> (ptr & ((1 << 6) - 1))) & 1;
+    return (word(ptr >> 6) >> (ptr & ((1 << 6) - 1))) & 1;
 }
 
 /**
@@ -59,9 +314,10 @@ uint16_t bitvector::access(uint64& ptr) {
  * @param bitValue The value of the bit, 0 or 1.
  * @return The amount of bits with the value 0 or 1 provided in bitValue that occurred before ptr.
  */
-uint64 bitvector::rank(uint64 ptr, uint8_t& bitValue) {
+template<typename LAYOUT>
+uint64 basic_bitvector<LAYOUT>::rank(uint64 ptr, uint8_t bitValue) const {
     if (ptr <= 0) return 0;
-    if (ptr > (vector.size() << 6) - 1) ptr = (vector.size() << 6) - 1;
+    if (ptr > (wordCount << 6) - 1) ptr = (wordCount << 6) - 1;
     if (bitValue == 1) return rank_1(ptr);
     else return ptr - rank_1(ptr);    // Number of total bits minus number of 1s. This works because bits are either 0 or 1.
 }
@@ -74,228 +330,358 @@ uint64 bitvector::rank(uint64 ptr, uint8_t& bitValue) {
  * <br/>
  * Using some clever parsing of the super block index and block index from the provided position, we can extract the amount
  * of 1s before the relevant 512-bit block from the superblock's metadata. We then iterate over how many 64-bit words inside
- * the 512-bit block come before the one the position is in, count the 1s using popcount and add it to the sum.<br/>
- * Then, we overlay a mask (1 << X)-1 on the relevant 64-bit word to cover only the bits 'before' the position with, scrapping
- * all 1s we do not want to count. Then, we simply count the remaining ones. Adding everything together results in the proper rank.
+ * the 512-bit block come before the one the position is in, and the bits before the position in its own word, and count
+ * the 1s among them. This is done by the popcount kernel, which masks away everything from the position on and counts the
+ * entire block in a few vector instructions instead of one popcount per word. Adding everything together results in the proper rank.
+ * <br/>
+ * In the interleaved layout, the ones before the block and before the word are both in the counter words of the block's
+ * record, so only a single word is counted.
  * @param ptr The position.
  * @return The amount of 1s before the position.
  */
-uint64 bitvector::rank_1(uint64& ptr) {
-    // Cut the 13 bit but then multiply by 2. Like this to erase the last bit
-    uint64 superblockIndex = (ptr >> 12) << 1;
-    uint64 metadata1 = superBlocks[superblockIndex];
-    uint64 metadata2 = superBlocks[superblockIndex + 1];
-    // Get identifying bits for the 512-segment, which are 2^10 to 2^13 (excl.)
-    auto blockId = (uint8_t) ((ptr >> 9) & 0b111);
-    // Now, get metadata from overhead
-    uint64 preOnesCount = (metadata1 >> 20) + (ptr > L0BLOCK_SIZE ? L0SingleBlockData : 0);
-
-    if (blockId == 1) {
-        preOnesCount += ((metadata1 >> 8) & 0xFFF);
-    } else if (blockId == 2) {
-        preOnesCount += ((metadata1 & 0xFF) << 4) | (metadata2 >> 60);
-    } else if (blockId > 2) {
-        preOnesCount += ((metadata2 >> ((blockId - 3) * 12)) & 0xFFF);
+template<typename LAYOUT>
+uint64 basic_bitvector<LAYOUT>::rank_1(uint64 ptr) const {
+    if (backend != BACKEND_PLAIN) [[unlikely]] {
+        INSTRUMENT_COUNT(RANK_BACKEND);
+        if (backend == BACKEND_RRR) return compressed.rank(ptr);
+        return backend == BACKEND_SPARSE_ONES ? sparse.rank(ptr) : ptr - sparse.rank(ptr);
     }
+    if constexpr (LAYOUT::interleaved) {
+        const uint64* record = vector.data() + (ptr >> 9) * RECORD_WORDS;
+        uint8_t which64BitWord = (ptr >> 6) & 0x7;
+        uint64 preOnesCount = record[0] + (which64BitWord == 0 ? 0 : (record[1] >> ((which64BitWord - 1) * 9)) & 0x1FF);
+        uint64 wordCoverageMask = (1ULL << (ptr & 0x3F)) - 1;
+        return preOnesCount + std::popcount(record[RECORD_DATA + which64BitWord] & wordCoverageMask);
+    } else {
+        // Each superblock has 128 or 64 bit of metadata, so 2 entries or 1.
+        const uint64* metadata = superBlocks.data() + (ptr >> SUPERBLOCK_SHIFT) * METADATA_WORDS;
+        // Get identifying bits for the 512-segment inside the superblock
+        uint64 blockId = (ptr >> 9) & (BLOCKS_IN_SUPERBLOCK - 1);
+        // Now, get metadata from overhead. Small bitvectors have no second L0 block, the check is gone at compile time.
+        uint64 preOnesCount = (metadata[0] >> ONES_SHIFT) + (!LAYOUT::small && ptr > L0BLOCK_SIZE ? L0SingleBlockData : 0);
+        preOnesCount += blockCounter(metadata, blockId);
+
+        // Begin index in the vector of the 512 block. Important to clear the last 3 bit to 0, hence the shifts
+        uint64 beginBlockIndex = (ptr >> 9) << 3;
+        return preOnesCount + popcountBlockPrefix(vector.data() + beginBlockIndex, ptr & 0x1FF);
+    }
+}
 
-    uint16_t blockSum = 0;
-    // Begin index in the vector of the 512 block. Important to clear the last 3 bit to 0, hence the shifts
-    uint64 beginBlockIndex = (ptr >> 9) << 3;
-    uint8_t which64BitWord = (ptr >> 6) & 0x7;
+/**
+ * Requests the cache lines that a rank at the given position reads, without waiting for them. These are the superblock
+ * metadata and the block up to the word of the position, or the record of the block in the interleaved layout.
+ * @param ptr The position, which is reduced like in rank(...).
+ */
+template<typename LAYOUT>
+inline void basic_bitvector<LAYOUT>::prefetchRank(uint64 ptr) const {
+    ptr = std::min(ptr, (wordCount << 6) - 1);
+    if constexpr (LAYOUT::interleaved) {
+        const uint64* record = vector.data() + (ptr >> 9) * RECORD_WORDS;
+        __builtin_prefetch(record);
+        __builtin_prefetch(record + RECORD_WORDS - 1);
+    } else {
+        __builtin_prefetch(superBlocks.data() + (ptr >> SUPERBLOCK_SHIFT) * METADATA_WORDS);
+        __builtin_prefetch(vector.data() + ((ptr >> 9) << 3));
+        __builtin_prefetch(vector.data() + (ptr >> 6));
+    }
+}
 
-    // 64-bit words in this 512-bit block before the segment our pos is in
-    for (uint8_t k = 0; k < which64BitWord; ++k) {
-        blockSum += std::popcount(vector[beginBlockIndex + k]);
+/**
+ * Answers many access queries at once. Each query on its own mostly waits for its word to arrive from memory. Here, the
+ * words of the next PREFETCH_DISTANCE queries are already requested while the current one is answered, so the waiting
+ * overlaps. The results are the same as calling access(...) for every position.
+ * @param positions The positions.
+ * @param n The number of positions.
+ * @param out The bit value at every position.
+ */
+template<typename LAYOUT>
+void basic_bitvector<LAYOUT>::access_batch(const uint64* positions, size_t n, uint64* out) const {
+    if (backend != BACKEND_PLAIN) [[unlikely]] {
+        for (size_t i = 0; i < n; ++i) out[i] = access(positions[i]);
+        return;
+    }
+    for (size_t i = 0; i < std::min<size_t>(n, PREFETCH_DISTANCE); ++i) __builtin_prefetch(wordPointer(positions[i] >> 6));
+    for (size_t i = 0; i < n; ++i) {
+        if (i + PREFETCH_DISTANCE < n) __builtin_prefetch(wordPointer(positions[i + PREFETCH_DISTANCE] >> 6));
+        out[i] = access(positions[i]);
     }
+}
 
-    uint64 wordCoverageMask = (1ULL << (ptr & 0x3F)) - 1;    // Get a mask for the 64-bit word
-    blockSum += std::popcount(vector[beginBlockIndex + which64BitWord] & wordCoverageMask);
+/**
+ * Answers many rank queries for the same bit value at once, like access_batch. The results are the same as calling
+ * rank(...) for every position.
+ * @param positions The positions.
+ * @param n The number of positions.
+ * @param bitValue The value of the bit, 0 or 1.
+ * @param out The rank of every position.
+ */
+template<typename LAYOUT>
+void basic_bitvector<LAYOUT>::rank_batch(const uint64* positions, size_t n, uint8_t bitValue, uint64* out) const {
+    if (backend != BACKEND_PLAIN) [[unlikely]] {
+        for (size_t i = 0; i < n; ++i) out[i] = rank(positions[i], bitValue);
+        return;
+    }
+    for (size_t i = 0; i < std::min<size_t>(n, PREFETCH_DISTANCE); ++i) prefetchRank(positions[i]);
+    for (size_t i = 0; i < n; ++i) {
+        if (i + PREFETCH_DISTANCE < n) prefetchRank(positions[i + PREFETCH_DISTANCE]);
+        out[i] = rank(positions[i], bitValue);
+    }
+}
 
-    return preOnesCount + blockSum;
+/**
+ * Answers rank(...) for two positions at once, like the ends of a range. There is no dependency between both, so their
+ * cache misses overlap without any prefetching. Sharing the metadata of positions in the same block, or prefetching the
+ * second position, measured slower in the wavelet matrix than two independent ranks.
+ * @param first The first position.
+ * @param second The second position.
+ * @param bitValue 1 or 0.
+ * @return The ranks of both positions.
+ */
+template<typename LAYOUT>
+std::pair<uint64, uint64> basic_bitvector<LAYOUT>::rank_pair(uint64 first, uint64 second, uint8_t bitValue) const {
+    return { rank(first, bitValue), rank(second, bitValue) };
 }
 
 /**
  * Gets the rank from the metadata of the superblock that ptr is in.
  * This will not get the accurate rank, but rather a minimum rank. Used when the exact rank isn't needed,
  * but just an estimate, for example in the select search.
- * @param ptr The absolut index.
- * @return The rank of the super block the ptr is in.
+ * @param superblock The super block number.
+ * @return The rank of the super block.
  */
-uint64 bitvector::superRank(uint64& ptr) {
-    uint64 metadata1 = superBlocks[ptr << 1];
-    return ((ptr > L0BLOCK_SIZE) ? L0SingleBlockData : 0) + (metadata1 >> 20);
+template<typename LAYOUT>
+uint64 basic_bitvector<LAYOUT>::superRank(uint64 superblock) const {
+    if constexpr (LAYOUT::interleaved) {
+        return vector[superblock * RECORD_WORDS];
+    } else {
+        uint64 metadata1 = superBlocks[superblock * METADATA_WORDS];
+        return ((!LAYOUT::small && superblock > L0BLOCK_SIZE) ? L0SingleBlockData : 0) + (metadata1 >> ONES_SHIFT);
+    }
 }
 
 /**
- * Select returns the position of the ith 1 or 0. For obvious reasons, select(0, byteValue) returns 0.
- * @param i The ith 1 or 0 to get the position for.
- * @param byteValue 1 or 0.
+ * Select returns the position of the num-th 1 or 0. For obvious reasons, select(0, bitValue) returns 0.
+ * @param num The num-th 1 or 0 to get the position for.
+ * @param bitValue 1 or 0.
  * @return The position of the ith 1 or 0.
  */
-uint64 bitvector::select(uint64& i, uint8_t byteValue) {
-    return byteValue == 1 ? select_1(i) : select_0(i);
+template<typename LAYOUT>
+uint64 basic_bitvector<LAYOUT>::select(uint64 num, uint8_t bitValue) const {
+    return bitValue == 1 ? select_1(num) : select_0(num);
 }
 
+// Every select sample takes 3 words, or 5 32-bit words in the small layout. The first is the absolute position of every
+// 2^shift-th one or zero, with the sample shift of its bit value, the others hold 8 16-bit offsets from there to every
+// 2^(shift - 3)-th one or zero after it. If the 8 offsets do not fit into 16 bit, the sample is spilled: the highest bit
+// of the position is set and the second word is an index into the spill list instead, with the absolute positions of every
+// 2^(shift - 5)-th one or zero after the sample. Small positions have no free bit, there the first offset,
+// which is always 0 otherwise, is set to 1 and the third word is the index.
+// After the last sample, there is one more sample holding the position of the last one or zero.
+#define SELECT_SUBSAMPLE_SHIFT 3        // 2^3 offsets per sample
+#define SELECT_SAMPLE_OFFSETS_PER_WORD (sizeof(sampleWord) / 2)
+#define SELECT_SAMPLE_WORDS (1 + (1 << SELECT_SUBSAMPLE_SHIFT) / SELECT_SAMPLE_OFFSETS_PER_WORD)
+#define SELECT_SPILL_SHIFT 5            // 2^5 absolute positions per spilled sample
+#define SELECT_SPILL_FLAG (LAYOUT::small ? 0 : 1ULL << 63)
+#define SELECT_SPILL_INDEX (LAYOUT::small ? 2 : 1)
+#define SELECT_OFFSET_LIMIT (1ULL << 16)
+#define SELECT_LINEAR_SUPERBLOCKS 4     // Superblocks between both hints that are walked instead of searched.
+
 /**
- * Calculates the position of the num-th 0.
- * @param num The number of 0.
- * @return Its position.
+ * Terminates the program after a select query for a bit value whose select samples were not built, see buildOptions.
+ * Answering it from the superblock metadata alone would silently take time linear in the vector size.
+ * @param bitValue 1 or 0.
  */
-uint64 bitvector::select_0(uint64& num) {
-    // If it's the last number, return cached position.
-    if (num == zeroCount) return lastZeroPos;
-
-    uint64 superblockIndex;
-    // Each superblock has 128 bit of metadata, so 2 entries. start and end represent the actual superblock,
-    // while the later superblock index represents the index in the vector, so essentially 2*superblock, or superblock >> 1.
+[[noreturn]] static void missingSelectSamples(uint8_t bitValue) {
+    std::cerr << "select " << (int) bitValue << " needs the select samples for " << (bitValue == 1 ? "ones" : "zeros")
+              << ", which were not built." << std::endl;
+    std::abort();
+}
 
-    // First, check if either there is only one super block or the second super block already has too many 0s.
-    if (superBlocks.size() <= 2 || num <= ((1 << 12) - (superBlocks[2] >> 20))) {
-        superblockIndex = 0;
-    } else if (num > (((superBlocks.size() - 2) << 11) - (superBlocks[superBlocks.size() - 2] >> 20))) {
-        // Alternatively, check if it's the last block by seeing if the last superblock has still too few 0s.
-        superblockIndex = superBlocks.size() - 2;
-    } else {
-        // The relevant super block is somewhere in the middle. Using the 0-cache, try establishing some loose boundaries
-        // and perform a binary search.
-        uint64 start, end;
-        start = num >> 13;
-        if (start >= selectCache_0.size()) {
-            end = (superBlocks.size() >> 1) - 1;
-        } else {
-            // Start and end are exclusive in edge cases. By asserting that it's not the first or last
-            // Super block, we can widen the search area just enough.
-            end = selectCache_0[start] + 1;
-            start = start == 0 ? 0 : selectCache_0[start - 1] - 1;
-        }
-        // Select Iterative returns the super block number, so multiply it by two to get the index.
-        superblockIndex = (select_0_iterative(num, start, end) << 1); // Get super block before that. Guaranteed to be >= 0, since the case "is first block" is covered above.
-    }
-
-    // Inside the superblock, extract the metadata
-    uint64 metadata1 = superBlocks[superblockIndex];
-    uint64 metadata2 = superBlocks[superblockIndex + 1];
-
-    // Since metadata stores only the amount of 1s, the following sections have a lot of totalBits - oneBits to
-    // accurately calculate the amount of 0-bits without needing to store them.
-
-    // Number of 0s = Number of Bits - Number of 1s, since bits are either 1 or 0.
-    // To calculate total amount of bits, shift superblock by 1 to balance the *2 and shift by 12 to go from superblock to bit scale
-    uint64 remaining = num - ((superblockIndex << 11) - (metadata1 >> 20));
-    if ((superblockIndex << 11) > L0BLOCK_SIZE) remaining -= L0BLOCK_SIZE - L0SingleBlockData; // Also account for the second L0 block
-
-    auto previousMetadataValue = 0ULL;
-    auto currentMetadataValue = (BLOCK_SIZE - ((metadata1 >> 8) & 0xFFF));
-    uint8_t blockIndex = 0;
-    uint16_t blockTotalBitsTillHere = BLOCK_SIZE;
-
-    // Next, we go through all the blocks inside the super block and see if at the end of that block, there would be more
-    // 0s than what we're looking for. If so, we know that the num-th 0 is inside that block, since before it was too few.
-
-    // Here, we use a do-while(false) to make the control flow a tad more efficient.
-    // As soon as one of the break conditions is true, we subtract the metadata from the previous block and go to
-    // after the loop, without the need to evaluate anything after.
-    // This avoids the usage of go-to and some unnecessary if-evaluations. The only other way to get this with ifs is
-    // multiple encapsulated ifs inside one another, which is not readable or nice.
-    do {
-        if (currentMetadataValue >= remaining) {
-            remaining -= previousMetadataValue;
-            break;
-        }
-        blockTotalBitsTillHere += BLOCK_SIZE;
-        previousMetadataValue = currentMetadataValue;
-        ++blockIndex;
+/**
+ * Returns whether select queries for a bit value can be answered, which needs its select samples in the plain backend.
+ * Callers that must not terminate, like the query server, check their select queries with this first.
+ * @param bitValue 1 or 0.
+ * @return Whether the select samples for the bit value were built or are not needed.
+ */
+template<typename LAYOUT>
+bool basic_bitvector<LAYOUT>::hasSelectSamples(uint8_t bitValue) const {
+    return backend != BACKEND_PLAIN || !(bitValue == 1 ? selectSamples_1 : selectSamples_0).empty();
+}
 
-        currentMetadataValue = blockTotalBitsTillHere - (((metadata1 & 0xFF) << 4) | (metadata2 >> 60));
-        if (currentMetadataValue >= remaining) {
-            remaining -= previousMetadataValue;
-            break;
-        }
-        blockTotalBitsTillHere += BLOCK_SIZE;
-        previousMetadataValue = currentMetadataValue;
-        ++blockIndex;
+/**
+ * Looks up the select samples for the (k + 1)-th one or zero, so k is 0-based. This is two reads from the samples
+ * and, in sparse regions, one from the spill list.
+ * @param samples The samples for ones or zeros.
+ * @param spill The spill list for ones or zeros.
+ * @param shift The sample shift for ones or zeros.
+ * @param k The 0-based number of the one or zero.
+ * @return The positions of the closest sampled one or zero at or before it, and the closest sampled one after it.
+ */
+template<typename LAYOUT>
+std::pair<uint64, uint64> basic_bitvector<LAYOUT>::selectSample(const indexArray<sampleWord>& samples, const indexArray<sampleWord>& spill, uint64 shift, uint64 k) const {
+    const sampleWord* entry = samples.data() + (k >> shift) * SELECT_SAMPLE_WORDS;
+    auto offset = [entry](uint64 i) -> uint64 {
+        return (entry[1 + i / SELECT_SAMPLE_OFFSETS_PER_WORD] >> ((i % SELECT_SAMPLE_OFFSETS_PER_WORD) << 4)) & 0xFFFF;
+    };
+    uint64 position = entry[0] & ~SELECT_SPILL_FLAG;
+    uint64 nextSample = entry[SELECT_SAMPLE_WORDS] & ~SELECT_SPILL_FLAG;
+
+    if (LAYOUT::small ? offset(0) != 0 : (entry[0] & SELECT_SPILL_FLAG) != 0) [[unlikely]] {
+        INSTRUMENT_COUNT(SELECT_SPILLED);
+        uint64 index = (k >> (shift - SELECT_SPILL_SHIFT)) & ((1 << SELECT_SPILL_SHIFT) - 1);
+        const sampleWord* positions = spill.data() + entry[SELECT_SPILL_INDEX];
+        return { positions[index], index + 1 < (1 << SELECT_SPILL_SHIFT) ? positions[index + 1] : nextSample };
+    }
 
-        currentMetadataValue = blockTotalBitsTillHere - (metadata2 & 0xFFF);
-        if (currentMetadataValue >= remaining) {
-            remaining -= previousMetadataValue;
-            break;
-        }
-        blockTotalBitsTillHere += BLOCK_SIZE;
-        previousMetadataValue = currentMetadataValue;
-        ++blockIndex;
+    INSTRUMENT_COUNT(SELECT_SAMPLED);
+    uint64 index = (k >> (shift - SELECT_SUBSAMPLE_SHIFT)) & ((1 << SELECT_SUBSAMPLE_SHIFT) - 1);
+    return { position + offset(index), index + 1 < (1 << SELECT_SUBSAMPLE_SHIFT) ? position + offset(index + 1) : nextSample };
+}
 
-        currentMetadataValue = blockTotalBitsTillHere - ((metadata2 >> (12)) & 0xFFF);
-        if (currentMetadataValue >= remaining) {
-            remaining -= previousMetadataValue;
-            break;
-        }
-        blockTotalBitsTillHere += BLOCK_SIZE;
-        previousMetadataValue = currentMetadataValue;
-        ++blockIndex;
+/**
+ * Calculates the position of the num-th 0.<br/>
+ * The select samples give the position of a 0 at most 2^(selectSampleShift_0 - 3) zeros before the num-th 0, and one after it.
+ * Those are usually in the same or in neighbouring superblocks, so the superblock of the num-th 0 is found with a short walk.
+ * There is no binary search over the entire vector.
+ * @param num The number of 0.
+ * @return Its position.
+ */
+template<typename LAYOUT>
+uint64 basic_bitvector<LAYOUT>::select_0(uint64 num) const {
+    // If it's the last number, return cached position. Numbers past the last 0 have no position, return the last one as well.
+    if (backend != BACKEND_PLAIN) [[unlikely]] {
+        INSTRUMENT_COUNT(SELECT_BACKEND);
+        if (num >= zeroCount) return lastZeroPos;
+        if (num == 0) return 0;
+        if (backend == BACKEND_RRR) return compressed.select_0(num);
+        return backend == BACKEND_SPARSE_ZEROS ? sparse.select(num - 1) : sparse.selectMissing(num - 1);
+    }
+    if (selectSamples_0.empty()) [[unlikely]] missingSelectSamples(0);
+    if (num >= zeroCount) {
+        INSTRUMENT_COUNT(SELECT_PAST_LAST);
+        return lastZeroPos;
+    }
+    if (num == 0) {
+        INSTRUMENT_COUNT(SELECT_ZERO_NUM);
+        return 0;
+    }
+    auto [low, high] = selectSample(selectSamples_0, selectSpill_0, selectSampleShift_0, num - 1);
+    return select_0_from(low >> SUPERBLOCK_SHIFT, high >> SUPERBLOCK_SHIFT, num);
+}
 
-        currentMetadataValue = blockTotalBitsTillHere - ((metadata2 >> (24)) & 0xFFF);
-        if (currentMetadataValue >= remaining) {
-            remaining -= previousMetadataValue;
-            break;
-        }
-        blockTotalBitsTillHere += BLOCK_SIZE;
-        previousMetadataValue = currentMetadataValue;
-        ++blockIndex;
+/**
+ * Finds the superblock of the num-th 0 between two superblocks and calculates its position. The superblocks between
+ * them are walked one after another if there are only a few, otherwise the range is halved until there are only a few left.
+ * This only happens in the spilled samples of sparse regions.
+ * @param first The first superblock number that may contain the num-th 0.
+ * @param last The last superblock number that may contain the num-th 0.
+ * @param num The number of 0.
+ * @return Its position.
+ */
+template<typename LAYOUT>
+uint64 basic_bitvector<LAYOUT>::select_0_from(uint64 first, uint64 last, uint64 num) const {
+    INSTRUMENT_ADD(SELECT_WINDOW_SUPERBLOCKS, last - first);
+    while (last - first > SELECT_LINEAR_SUPERBLOCKS) {
+        INSTRUMENT_COUNT(SELECT_SEARCH_PROBES);
+        uint64 middle = (first + last + 1) >> 1;
+        if ((middle << SUPERBLOCK_SHIFT) - superRank(middle) < num) first = middle;
+        else last = middle - 1;
+    }
+    while (first < last && ((first + 1) << SUPERBLOCK_SHIFT) - superRank(first + 1) < num) {
+        INSTRUMENT_COUNT(SELECT_LINEAR_STEPS);
+        ++first;
+    }
+    return select_0_in_superblock(first, num);
+}
 
-        currentMetadataValue = blockTotalBitsTillHere - ((metadata2 >> (36)) & 0xFFF);
-        if (currentMetadataValue >= remaining) {
-            remaining -= previousMetadataValue;
-            break;
-        }
-        blockTotalBitsTillHere += BLOCK_SIZE;
-        previousMetadataValue = currentMetadataValue;
-        ++blockIndex;
+/**
+ * Calculates the position of the num-th 0 when it is known to be in the given superblock.
+ * @param superblock The superblock number.
+ * @param num The number of 0, at least 1.
+ * @return Its position.
+ */
+template<typename LAYOUT>
+uint64 basic_bitvector<LAYOUT>::select_0_in_superblock(uint64 superblock, uint64 num) const {
+    uint64 remaining;
+    uint64 wordIndex = select_0_block(superblock, num, remaining);
+    return select_0_words(wordIndex, remaining);
+}
 
-        currentMetadataValue = blockTotalBitsTillHere - ((metadata2 >> (48)) & 0xFFF);
-        if (currentMetadataValue >= remaining) {
-            remaining -= previousMetadataValue;
-            break;
+/**
+ * First half of select_0_in_superblock. Finds the block of the num-th 0 with the superblock metadata.
+ * @param superblock The superblock number.
+ * @param num The number of 0, at least 1.
+ * @param remaining Set to the number of the 0, counted from the returned word.
+ * @return The index of the word to start the search in, the first word of the block.
+ */
+template<typename LAYOUT>
+uint64 basic_bitvector<LAYOUT>::select_0_block(uint64 superblock, uint64 num, uint64& remaining) const {
+    if constexpr (LAYOUT::interleaved) {
+        // The superblock is a single block. Find the word with the counters, the zeros before word i are i * 64 minus the ones.
+        const uint64* record = vector.data() + superblock * RECORD_WORDS;
+        remaining = num - ((superblock << SUPERBLOCK_SHIFT) - record[0]);
+        uint8_t index = 0;
+        uint64 zerosBefore = 0;
+        for (; index < 7; ++index) {
+            uint64 zerosBeforeNext = ((index + 1) << 6) - ((record[1] >> (index * 9)) & 0x1FF);
+            if (zerosBeforeNext >= remaining) break;
+            zerosBefore = zerosBeforeNext;
         }
-        remaining -= currentMetadataValue;
-        ++blockIndex;
+        // The counters already give the word, so the search starts right there.
+        remaining -= zerosBefore;
+        return (superblock << 3) + index;
+    } else {
+        const uint64* metadata = superBlocks.data() + superblock * METADATA_WORDS;
 
-        // Last one is irrelevant as we know it has to be there (Ger.: Ausschlussverfahren)
-    } while (false);
+        // Since metadata stores only the amount of 1s, the following sections have a lot of totalBits - oneBits to
+        // accurately calculate the amount of 0-bits without needing to store them.
 
+        // Number of 0s = Number of Bits - Number of 1s, since bits are either 1 or 0.
+        remaining = num - ((superblock << SUPERBLOCK_SHIFT) - (metadata[0] >> ONES_SHIFT));
+        if (!LAYOUT::small && (superblock << SUPERBLOCK_SHIFT) > L0BLOCK_SIZE) remaining -= L0BLOCK_SIZE - L0SingleBlockData; // Also account for the second L0 block
 
-    // Now, go through a maximum of 8 64-bit words
+        // Next, we go through all the blocks inside the super block and see if at the end of that block, there would be more
+        // 0s than what we're looking for. If so, we know that the num-th 0 is inside that block, since before it was too few.
+        // The comparisons are unrolled at compile time, one per counter, and the && stops at the first block that is large enough.
+        // Last one is irrelevant as we know it has to be there (Ger.: Ausschlussverfahren)
+        uint64 blockIndex = 0, zerosBefore = 0;
+        [&]<uint64... BLOCK>(std::integer_sequence<uint64, BLOCK...>) {
+            (... && [&](uint64 zeros) { return zeros < remaining && (zerosBefore = zeros, ++blockIndex, true); }
+                    (((BLOCK + 1) << 9) - blockCounter(metadata, BLOCK + 1)));
+        }(std::make_integer_sequence<uint64, BLOCKS_IN_SUPERBLOCK - 1>{});
+        remaining -= zerosBefore;
+
+        // Calculate where the 64-bit word we're looking for is in the bitvector vector.
+        return (superblock << (SUPERBLOCK_SHIFT - 6)) + (blockIndex << 3);
+    }
+}
 
-    // First we calculate where the 64-bit word we're looking for is in the bitvector vector, and define the final position
-    // as the position at the beginning of the block we're in.
-    auto wordIndex = (superblockIndex << 5) + (blockIndex << 3);
+/**
+ * Second half of select_0_in_superblock. Goes through a maximum of 8 64-bit words to find the remaining-th 0.
+ * @param wordIndex The index of the word to start with.
+ * @param remaining The number of the 0, counted from that word, at least 1.
+ * @return Its position.
+ */
+template<typename LAYOUT>
+uint64 basic_bitvector<LAYOUT>::select_0_words(uint64 wordIndex, uint64 remaining) const {
+    // Define the final position as the position at the beginning of the word we start with.
     auto finalPosition = wordIndex << 6;
     uint8_t zerosInWord;
 
     // Loop over a maximum of 8 64-bit words.
     for (uint8_t index = 0; index < 8; ++index) {
         // Invert the word to count zeros using popcount.
-        auto bitword = ~vector[wordIndex + index];
+        INSTRUMENT_COUNT(SELECT_WORD_SCANS);
+        auto bitword = ~word(wordIndex + index);
         zerosInWord = std::popcount(bitword);
         if (remaining > zerosInWord) {
             remaining -= zerosInWord;
             continue;
         }
 
-        // Get position of the one in the word.
-        // Unfortunately, I am doing a lot of testing on Windows and my Macbook, and my Macbook does not support
-        // the trick with pdep and trailing zero count because of its processor architecture.
-        // To make this happen anyway, we'll need to do the old classic way
-
-        // This should be 0 if the loop is never run, but -1 otherwise because of the too early increment.
-        // If the loop will trigger, the last statement will evaluate to 1, so bitIndex will become -1,
-        // compensating for the first increment as planned. If not, 0.
-        uint8_t bitIndex = 0 - (remaining > 0);
-
-        while (remaining > 0) {
-            remaining -= bitword & 1;
-            bitword >>= 1;
-            ++bitIndex;
-        }
+        // Get position of the one in the word. This uses pdep and trailing zero count where the CPU supports it,
+        // and a broadword select otherwise, for example on my Macbook. Either way, there is no loop over the bits.
+        uint8_t bitIndex = selectInWord(bitword, remaining - 1);
 
         // Now construct the final index from all the pieces, index should be shifted to cover the bits from 2^7 to 2^9,
         // The index of the word inside the block.
@@ -309,331 +695,1467 @@ uint64 bitvector::select_0(uint64& num) {
 }
 
 /**
- * Helper function to perform the binary search for zeros. Takes in the position, the super block number (not index!)
- * of the start and end of the search area.
- * @param num The num-th zero.
- * @param start The start super block number.
- * @param end The end super block number.
- * @return The super block number of where the num-th zero is.
+ * Calculates the position of the num-th 1. Very analogue to select_0.
+ * @param num The number of 1.
+ * @return Its position.
  */
-uint64 bitvector::select_0_iterative(uint64& num, uint64 start, uint64 end) {
-    unsigned long long middle;
-
-    // Find the first super block where the number of zeros exceeds num.
-    while (end > start) {
-        middle = (start + end) >> 1;
-        if (((middle << 12) - superRank(middle)) < num) {
-            start = middle + 1;
-        } else {
-            end = middle;
-        }
+template<typename LAYOUT>
+uint64 basic_bitvector<LAYOUT>::select_1(uint64 num) const {
+    // If it's the last number, return cached position. Numbers past the last 1 have no position, return the last one as well.
+    if (backend != BACKEND_PLAIN) [[unlikely]] {
+        INSTRUMENT_COUNT(SELECT_BACKEND);
+        if (num >= oneCount) return lastOnePos;
+        if (num == 0) return 0;
+        if (backend == BACKEND_RRR) return compressed.select_1(num);
+        return backend == BACKEND_SPARSE_ONES ? sparse.select(num - 1) : sparse.selectMissing(num - 1);
+    }
+    if (selectSamples_1.empty()) [[unlikely]] missingSelectSamples(1);
+    if (num >= oneCount) {
+        INSTRUMENT_COUNT(SELECT_PAST_LAST);
+        return lastOnePos;
+    }
+    if (num == 0) {
+        INSTRUMENT_COUNT(SELECT_ZERO_NUM);
+        return 0;
     }
-    // start is the first super block where in the metadata it says 1s >= num. The superblock where it happens
-    // is the one we want, so the super block before it.
-    // Because of from where it's called, the start value here is >= 1.
-    return start - 1;
+    auto [low, high] = selectSample(selectSamples_1, selectSpill_1, selectSampleShift_1, num - 1);
+    return select_1_from(low >> SUPERBLOCK_SHIFT, high >> SUPERBLOCK_SHIFT, num);
 }
 
 /**
- * Calculates the position of the num-th 1.
+ * Finds the superblock of the num-th 1 between two superblocks and calculates its position, like select_0_from.
+ * @param first The first superblock number that may contain the num-th 1.
+ * @param last The last superblock number that may contain the num-th 1.
  * @param num The number of 1.
  * @return Its position.
  */
-uint64 bitvector::select_1(uint64& num) {
-    // If it's the last number, return cached position.
-    if (num == oneCount) return lastOnePos;
+template<typename LAYOUT>
+uint64 basic_bitvector<LAYOUT>::select_1_from(uint64 first, uint64 last, uint64 num) const {
+    INSTRUMENT_ADD(SELECT_WINDOW_SUPERBLOCKS, last - first);
+    while (last - first > SELECT_LINEAR_SUPERBLOCKS) {
+        INSTRUMENT_COUNT(SELECT_SEARCH_PROBES);
+        uint64 middle = (first + last + 1) >> 1;
+        if (superRank(middle) < num) first = middle;
+        else last = middle - 1;
+    }
+    while (first < last && superRank(first + 1) < num) {
+        INSTRUMENT_COUNT(SELECT_LINEAR_STEPS);
+        ++first;
+    }
+    return select_1_in_superblock(first, num);
+}
 
-    uint64 superblockIndex;
-    // Each superblock has 128 bit of metadata, so 2 entries. start and end represent the actual superblock,
-    // while the later superblock index represents the index in the vector, so essentially 2*superblock, or superblock >> 1.
+/**
+ * Calculates the position of the num-th 1 when it is known to be in the given superblock.
+ * @param superblock The superblock number.
+ * @param num The number of 1, at least 1.
+ * @return Its position.
+ */
+template<typename LAYOUT>
+uint64 basic_bitvector<LAYOUT>::select_1_in_superblock(uint64 superblock, uint64 num) const {
+    uint64 remaining;
+    uint64 wordIndex = select_1_block(superblock, num, remaining);
+    return select_1_words(wordIndex, remaining);
+}
 
-    // Very analogue to select_0, check if either there is only one super block or the second super block already has too many 1s.
-    if (superBlocks.size() <= 2 || num <= (superBlocks[2] >> 20)) {
-        superblockIndex = 0;
-    } else if (num > (superBlocks[superBlocks.size() - 2] >> 20)) {
-        // Then check if it's the last super block instead.
-        superblockIndex = superBlocks.size() - 2;
-    } else {
-        // If also not, perform a binary search after setting the search area with a comfortable margin.
-        uint64 start, end;
-        start = num >> 13;
-        if (start + 1 >= selectCache_1.size()) {
-            end = (superBlocks.size() >> 1) - 1;
-        } else {
-            // Start and end are exclusive in edge cases. By asserting that it's not the first or last
-            // Super block, we can widen the search area just enough.
-            end = selectCache_1[start] + 1;
-            start = start == 0 ? 0 : selectCache_1[start - 1] - 1;
-        }
-        // Get super block before that. Guaranteed to be >= 0, since the case "is first block" is covered above.
-        superblockIndex = (select_1_iterative(num, start, end) << 1);
-    }
-
-    // Inside the superblock, get the metadata and how many 1s are remaining now.
-    // Here, we do not need to invert any values, so this will be a bit nicer to look at.
-    uint64 metadata1 = superBlocks[superblockIndex];
-    uint64 metadata2 = superBlocks[superblockIndex + 1];
-    uint64 remaining = num - (metadata1 >> 20);
-    if ((superblockIndex << 11) > L0BLOCK_SIZE) remaining -= L0SingleBlockData; // Also account for the second L0 block
-
-    auto previousMetadataValue = 0ULL;
-    auto currentMetadataValue = ((metadata1 >> 8) & 0xFFF);
-    uint8_t blockIndex = 0;
-
-    // Here, we again use a do-while(false) to make the control flow a tad more efficient.
-    // This avoids the usage of go-to and some unnecessary if-evaluations. The only other way to get this with ifs is
-    // multiple encapsulated ifs inside one another, which is not readable or nice.
-    do {
-        if (currentMetadataValue >= remaining) {
-            remaining -= previousMetadataValue;
-            break;
+/**
+ * First half of select_1_in_superblock. Finds the block of the num-th 1 with the superblock metadata.
+ * @param superblock The superblock number.
+ * @param num The number of 1, at least 1.
+ * @param remaining Set to the number of the 1, counted from the returned word.
+ * @return The index of the word to start the search in, the first word of the block.
+ */
+template<typename LAYOUT>
+uint64 basic_bitvector<LAYOUT>::select_1_block(uint64 superblock, uint64 num, uint64& remaining) const {
+    if constexpr (LAYOUT::interleaved) {
+        // The superblock is a single block. Find the word with the counters, like select_0_in_superblock.
+        const uint64* record = vector.data() + superblock * RECORD_WORDS;
+        remaining = num - record[0];
+        uint8_t index = 0;
+        uint64 onesBefore = 0;
+        for (; index < 7; ++index) {
+            uint64 onesBeforeNext = (record[1] >> (index * 9)) & 0x1FF;
+            if (onesBeforeNext >= remaining) break;
+            onesBefore = onesBeforeNext;
         }
-        previousMetadataValue = currentMetadataValue;
-        ++blockIndex;
+        // The counters already give the word, so the search starts right there.
+        remaining -= onesBefore;
+        return (superblock << 3) + index;
+    } else {
+        // Inside the superblock, get the metadata and how many 1s are remaining now.
+        // Here, we do not need to invert any values, so this will be a bit nicer to look at.
+        const uint64* metadata = superBlocks.data() + superblock * METADATA_WORDS;
+        remaining = num - (metadata[0] >> ONES_SHIFT);
+        if (!LAYOUT::small && (superblock << SUPERBLOCK_SHIFT) > L0BLOCK_SIZE) remaining -= L0SingleBlockData; // Also account for the second L0 block
+
+        // Unrolled like in select_0_block, the last block has no counter.
+        uint64 blockIndex = 0, onesBefore = 0;
+        [&]<uint64... BLOCK>(std::integer_sequence<uint64, BLOCK...>) {
+            (... && [&](uint64 ones) { return ones < remaining && (onesBefore = ones, ++blockIndex, true); }
+                    (blockCounter(metadata, BLOCK + 1)));
+        }(std::make_integer_sequence<uint64, BLOCKS_IN_SUPERBLOCK - 1>{});
+        remaining -= onesBefore;
+
+        // Calculate where the 64-bit word we're looking for is in the bitvector vector.
+        return (superblock << (SUPERBLOCK_SHIFT - 6)) + (blockIndex << 3);
+    }
+}
 
-        currentMetadataValue = ((metadata1 & 0xFF) << 4) | (metadata2 >> 60);
-        if (currentMetadataValue >= remaining) {
-            remaining -= previousMetadataValue;
-            break;
-        }
-        previousMetadataValue = currentMetadataValue;
-        ++blockIndex;
+/**
+ * Second half of select_1_in_superblock. Goes through a maximum of 8 64-bit words to find the remaining-th 1.
+ * @param wordIndex The index of the word to start with.
+ * @param remaining The number of the 1, counted from that word, at least 1.
+ * @return Its position.
+ */
+template<typename LAYOUT>
+uint64 basic_bitvector<LAYOUT>::select_1_words(uint64 wordIndex, uint64 remaining) const {
+    // Define the final position as the position at the beginning of the word we start with.
+    auto finalPosition = wordIndex << 6;
+    uint8_t onesInWord;
 
-        currentMetadataValue = (metadata2 & 0xFFF);
-        if (currentMetadataValue >= remaining) {
-            remaining -= previousMetadataValue;
-            break;
+    // Go through the 8 words or less
+    for (uint8_t index = 0; index < 8; ++index) {
+        INSTRUMENT_COUNT(SELECT_WORD_SCANS);
+        auto bitword = word(wordIndex + index);
+        onesInWord = std::popcount(bitword);
+        if (remaining > onesInWord) {
+            remaining -= onesInWord;
+            continue;
         }
-        previousMetadataValue = currentMetadataValue;
-        ++blockIndex;
 
-        currentMetadataValue = ((metadata2 >> (12)) & 0xFFF);
-        if (currentMetadataValue >= remaining) {
-            remaining -= previousMetadataValue;
-            break;
+        // Get position of the one in the word. This uses pdep and trailing zero count where the CPU supports it,
+        // and a broadword select otherwise, for example on my Macbook. Either way, there is no loop over the bits.
+        uint8_t bitIndex = selectInWord(bitword, remaining - 1);
+
+        // Now construct the final index from all the pieces
+        finalPosition += index << 6;
+        finalPosition += bitIndex;
+        break;
+    }
+
+    // Return the final position of the num-th 1.
+    return finalPosition;
+}
+
+// ------------------------------------------------------------------------------------------------------------------
+// Successors, predecessors and iteration
+//
+// Enumerating the ones with select(k, 1) for every k repeats the whole search, although consecutive ones are usually in
+// the same word. next1(...) and the other methods scan the words from the position instead, and skip to the next
+// superblock with a one or zero by its metadata, or with a single select where the samples exist. Positions without any
+// such bit are answered with the number of bits of the vector, including the unused bits of its last word, which are 0.
+// ------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Finds the first 1 at or after a position. The rest of the word and of its superblock are scanned, then the next
+ * superblock with a 1 is the one holding the (ones before the next superblock + 1)-th one.
+ * @param pos The position.
+ * @return The position of the 1, or the number of bits if there is none.
+ */
+template<typename LAYOUT>
+uint64 basic_bitvector<LAYOUT>::next1(uint64 pos) const {
+    uint64 end = wordCount << 6;
+    if (pos >= end) return end;
+    if (backend != BACKEND_PLAIN) [[unlikely]] {
+        uint64 before = rank_1(pos);
+        return before < oneCount ? select_1(before + 1) : end;
+    }
+
+    uint64 index = pos >> 6;
+    uint64 bits = word(index) & (~0ULL << (pos & 63));
+    uint64 superblockEnd = std::min(wordCount, ((index >> (SUPERBLOCK_SHIFT - 6)) + 1) << (SUPERBLOCK_SHIFT - 6));
+    while (bits == 0 && ++index < superblockEnd) bits = word(index);
+    if (bits != 0) return (index << 6) + std::countr_zero(bits);
+    if (index >= wordCount) return end;
+
+    uint64 superblock = index >> (SUPERBLOCK_SHIFT - 6);
+    uint64 before = superRank(superblock);
+    if (before >= oneCount) return end;
+    if (!selectSamples_1.empty()) return select_1(before + 1);
+    // Without samples, walk the metadata up to the superblock whose successor has more ones before it, or the last one.
+    uint64 superblocks = (wordCount + (1ULL << (SUPERBLOCK_SHIFT - 6)) - 1) >> (SUPERBLOCK_SHIFT - 6);
+    while (superblock + 1 < superblocks && superRank(superblock + 1) == before) ++superblock;
+    for (index = superblock << (SUPERBLOCK_SHIFT - 6); (bits = word(index)) == 0; ++index);
+    return (index << 6) + std::countr_zero(bits);
+}
+
+/**
+ * Finds the first 0 at or after a position, like next1(...) on the inverted words.
+ * @param pos The position.
+ * @return The position of the 0, or the number of bits if there is none.
+ */
+template<typename LAYOUT>
+uint64 basic_bitvector<LAYOUT>::next0(uint64 pos) const {
+    uint64 end = wordCount << 6;
+    if (pos >= end) return end;
+    if (backend != BACKEND_PLAIN) [[unlikely]] {
+        uint64 before = pos - rank_1(pos);
+        return before < zeroCount ? select_0(before + 1) : end;
+    }
+
+    uint64 index = pos >> 6;
+    uint64 bits = ~word(index) & (~0ULL << (pos & 63));
+    uint64 superblockEnd = std::min(wordCount, ((index >> (SUPERBLOCK_SHIFT - 6)) + 1) << (SUPERBLOCK_SHIFT - 6));
+    while (bits == 0 && ++index < superblockEnd) bits = ~word(index);
+    if (bits != 0) return (index << 6) + std::countr_zero(bits);
+    if (index >= wordCount) return end;
+
+    uint64 superblock = index >> (SUPERBLOCK_SHIFT - 6);
+    uint64 before = (superblock << SUPERBLOCK_SHIFT) - superRank(superblock);
+    if (before >= zeroCount) return end;
+    if (!selectSamples_0.empty()) return select_0(before + 1);
+    uint64 superblocks = (wordCount + (1ULL << (SUPERBLOCK_SHIFT - 6)) - 1) >> (SUPERBLOCK_SHIFT - 6);
+    while (superblock + 1 < superblocks && ((superblock + 1) << SUPERBLOCK_SHIFT) - superRank(superblock + 1) == before) ++superblock;
+    for (index = superblock << (SUPERBLOCK_SHIFT - 6); (bits = ~word(index)) == 0; ++index);
+    return (index << 6) + std::countr_zero(bits);
+}
+
+/**
+ * Finds the last 1 at or before a position. The word and its superblock are scanned backwards, then the last 1 before
+ * the superblock is the (ones before the superblock)-th one.
+ * @param pos The position, reduced to the last bit if it is larger.
+ * @return The position of the 1, or the number of bits if there is none.
+ */
+template<typename LAYOUT>
+uint64 basic_bitvector<LAYOUT>::prev1(uint64 pos) const {
+    uint64 end = wordCount << 6;
+    if (end == 0) return 0;
+    if (pos >= end) pos = end - 1;
+    if (backend != BACKEND_PLAIN) [[unlikely]] {
+        uint64 before = rank_1(pos) + access(pos);
+        return before > 0 ? select_1(before) : end;
+    }
+
+    uint64 index = pos >> 6;
+    uint64 bits = word(index) & (~0ULL >> (63 - (pos & 63)));
+    uint64 superblockStart = index & ~((1ULL << (SUPERBLOCK_SHIFT - 6)) - 1);
+    while (bits == 0 && index > superblockStart) bits = word(--index);
+    if (bits != 0) return (index << 6) + 63 - std::countl_zero(bits);
+
+    uint64 superblock = index >> (SUPERBLOCK_SHIFT - 6);
+    uint64 before = superRank(superblock);
+    if (before == 0) return end;
+    if (!selectSamples_1.empty()) return select_1(before);
+    // The first superblock has no ones before it, so the walk stops at the latest after it.
+    while (superRank(superblock - 1) == before) --superblock;
+    for (index = (superblock << (SUPERBLOCK_SHIFT - 6)) - 1; (bits = word(index)) == 0; --index);
+    return (index << 6) + 63 - std::countl_zero(bits);
+}
+
+/**
+ * Collects the next ones of a range for for_each_one(...). Every word is only read once: its ones are taken with trailing
+ * zero counts, clearing the lowest one each time, and next1(...) skips to the next word with a one.
+ * @param begin The position to start at. Set to the position after the last collected one.
+ * @param end The end of the range.
+ * @param out The array for the positions.
+ * @param n The size of the array.
+ * @return The number of collected positions, 0 once the range has no more ones.
+ */
+template<typename LAYOUT>
+size_t basic_bitvector<LAYOUT>::collectOnes(uint64& begin, uint64 end, uint64* out, size_t n) const {
+    end = std::min(end, wordCount << 6);
+    size_t found = 0;
+    if (backend == BACKEND_SPARSE_ONES) [[unlikely]] {
+        // The ones are consecutive positions of the sequence, so only the first one needs a rank.
+        uint64 before = begin < end ? sparse.rank(begin) : oneCount;
+        uint64 available = std::min<uint64>(n, oneCount - before);
+        sparse.selectRange(before, available, out);
+        while (found < available && out[found] < end) ++found;
+        begin = found < n ? end : out[found - 1] + 1;
+        return found;
+    }
+    if (backend != BACKEND_PLAIN) [[unlikely]] {
+        // Consecutive ones are consecutive selects, only the first one needs a rank.
+        uint64 before = begin < end ? rank_1(begin) : oneCount;
+        for (; found < n && before < oneCount; ++before) {
+            uint64 position = select_1(before + 1);
+            if (position >= end) break;
+            out[found++] = position;
+            begin = position + 1;
         }
-        previousMetadataValue = currentMetadataValue;
-        ++blockIndex;
+        if (found < n) begin = end;
+        return found;
+    }
 
-        currentMetadataValue = ((metadata2 >> (24)) & 0xFFF);
-        if (currentMetadataValue >= remaining) {
-            remaining -= previousMetadataValue;
-            break;
+    while (found < n && begin < end) {
+        begin = next1(begin);
+        if (begin >= end) break;
+        uint64 index = begin >> 6;
+        uint64 bits = word(index) & (~0ULL << (begin & 63));
+        if (((index + 1) << 6) > end) bits &= (1ULL << (end & 63)) - 1;
+        for (; bits != 0 && found < n; bits &= bits - 1) out[found++] = (index << 6) + std::countr_zero(bits);
+        begin = bits != 0 ? (index << 6) + std::countr_zero(bits) : (index + 1) << 6;
+    }
+    return found;
+}
+
+// ------------------------------------------------------------------------------------------------------------------
+// Batched select
+//
+// A single select is a chain of dependent reads: the sample, the superblock metadata for every step of the walk, and
+// the words of the block. Each of them usually waits for memory. select_batch keeps SELECT_BATCH_WIDTH selects in flight,
+// each as a small state machine. Every stage ends by requesting the memory its next stage needs, and instead of waiting,
+// the next select in flight takes a turn. By the time a select gets its next turn, its memory has usually arrived.
+// ------------------------------------------------------------------------------------------------------------------
+
+#define SELECT_BATCH_WIDTH 16           // Selects in flight at once.
+
+/**
+ * The state of one select in select_batch.
+ */
+template<typename LAYOUT>
+struct basic_bitvector<LAYOUT>::selectState {
+    // The stage that runs on the next turn, each one reading what the previous one requested.
+    enum : uint8_t { SAMPLE, PROBE, SUPERBLOCK, WORDS, DONE } stage = DONE;
+    size_t query = 0;
+    uint64 num = 0;
+    // The superblocks that may contain the num-th one or zero, and the one whose metadata was requested.
+    uint64 first = 0, last = 0, probe = 0;
+    // After the superblock stage, the word to start in and the number of the one or zero counted from there.
+    uint64 wordIndex = 0, remaining = 0;
+};
+
+/**
+ * Returns where the metadata of a superblock is stored. In the interleaved layout, that is the record of the block.
+ * @param superblock The superblock number.
+ * @return The address of the metadata.
+ */
+template<typename LAYOUT>
+inline const uint64* basic_bitvector<LAYOUT>::metadataPointer(uint64 superblock) const {
+    if constexpr (LAYOUT::interleaved) return vector.data() + superblock * RECORD_WORDS;
+    else return superBlocks.data() + superblock * METADATA_WORDS;
+}
+
+/**
+ * Answers many select queries for the same bit value at once, with up to SELECT_BATCH_WIDTH of them interleaved.
+ * The results are the same as calling select(...) for every number.
+ * @param nums The numbers of the ones or zeros.
+ * @param n The number of queries.
+ * @param bitValue 1 or 0.
+ * @param out The position of every num-th one or zero.
+ */
+template<typename LAYOUT>
+void basic_bitvector<LAYOUT>::select_batch(const uint64* nums, size_t n, uint8_t bitValue, uint64* out) const {
+    if (backend != BACKEND_PLAIN) [[unlikely]] {
+        for (size_t i = 0; i < n; ++i) out[i] = select(nums[i], bitValue);
+        return;
+    }
+    if ((bitValue == 1 ? selectSamples_1 : selectSamples_0).empty()) [[unlikely]] missingSelectSamples(bitValue == 1);
+    if (bitValue == 1) selectBatch<true>(nums, n, out);
+    else selectBatch<false>(nums, n, out);
+}
+
+/**
+ * The engine behind select_batch. Whenever a select finishes, its slot is refilled with the next query. Queries with an
+ * answer known in advance, 0 and the last one or zero, are answered right away without taking a slot.
+ * @tparam ONE Whether to select ones or zeros.
+ * @param nums The numbers of the ones or zeros.
+ * @param n The number of queries.
+ * @param out The position of every num-th one or zero.
+ */
+template<typename LAYOUT>
+template<bool ONE>
+void basic_bitvector<LAYOUT>::selectBatch(const uint64* nums, size_t n, uint64* out) const {
+    const uint64 count = ONE ? oneCount : zeroCount;
+    const uint64 lastPos = ONE ? lastOnePos : lastZeroPos;
+    const indexArray<sampleWord>& samples = ONE ? selectSamples_1 : selectSamples_0;
+    const uint64 shift = ONE ? selectSampleShift_1 : selectSampleShift_0;
+    size_t next = 0;
+
+    // Puts the next query that needs a search into the slot and requests its sample. False if there are none left.
+    auto start = [&](selectState& state) {
+        while (next < n) {
+            size_t query = next++;
+            uint64 num = nums[query];
+            if (num >= count || num == 0) {
+                out[query] = num == 0 && count > 0 ? 0 : lastPos;
+                continue;
+            }
+            state.stage = selectState::SAMPLE;
+            state.query = query;
+            state.num = num;
+            const sampleWord* entry = samples.data() + ((num - 1) >> shift) * SELECT_SAMPLE_WORDS;
+            __builtin_prefetch(entry);
+            __builtin_prefetch(entry + SELECT_SAMPLE_WORDS);
+            return true;
+        }
+        state.stage = selectState::DONE;
+        return false;
+    };
+
+    selectState slots[SELECT_BATCH_WIDTH];
+    size_t inFlight = 0;
+    for (auto& slot : slots) inFlight += start(slot);
+
+    while (inFlight > 0) {
+        for (auto& slot : slots) {
+            if (slot.stage == selectState::DONE) continue;
+            if (selectStep<ONE>(slot, out)) inFlight -= !start(slot);
         }
-        previousMetadataValue = currentMetadataValue;
-        ++blockIndex;
+    }
+}
 
-        currentMetadataValue = ((metadata2 >> (36)) & 0xFFF);
-        if (currentMetadataValue >= remaining) {
-            remaining -= previousMetadataValue;
+/**
+ * Runs the next stage of a select in select_batch. This is the same search as select_0 and select_1, cut into the pieces
+ * between two reads that may miss the cache.
+ * @tparam ONE Whether to select ones or zeros.
+ * @param state The select.
+ * @param out Where the answer is written when the select is finished.
+ * @return Whether the select is finished.
+ */
+template<typename LAYOUT>
+template<bool ONE>
+bool basic_bitvector<LAYOUT>::selectStep(selectState& state, uint64* out) const {
+    // The number of ones or zeros before a superblock.
+    auto countBefore = [this](uint64 superblock) {
+        return ONE ? superRank(superblock) : (superblock << SUPERBLOCK_SHIFT) - superRank(superblock);
+    };
+
+    switch (state.stage) {
+        case selectState::SAMPLE: {
+            // Spilled samples read the spill list here without a turn in between, they only exist in sparse regions.
+            auto [low, high] = ONE ? selectSample(selectSamples_1, selectSpill_1, selectSampleShift_1, state.num - 1)
+                                   : selectSample(selectSamples_0, selectSpill_0, selectSampleShift_0, state.num - 1);
+            state.first = low >> SUPERBLOCK_SHIFT;
+            state.last = high >> SUPERBLOCK_SHIFT;
             break;
         }
-        previousMetadataValue = currentMetadataValue;
-        ++blockIndex;
-
-        currentMetadataValue = ((metadata2 >> (48)) & 0xFFF);
-        if (currentMetadataValue >= remaining) {
-            remaining -= previousMetadataValue;
+        case selectState::PROBE:
+            // One step of the walk or of the halving in select_*_from.
+            if (state.last - state.first > SELECT_LINEAR_SUPERBLOCKS) {
+                if (countBefore(state.probe) < state.num) state.first = state.probe;
+                else state.last = state.probe - 1;
+            } else {
+                if (countBefore(state.probe) < state.num) state.first = state.probe;
+                else state.last = state.first;
+            }
             break;
+        case selectState::SUPERBLOCK: {
+            state.wordIndex = ONE ? select_1_block(state.first, state.num, state.remaining)
+                                  : select_0_block(state.first, state.num, state.remaining);
+            __builtin_prefetch(wordPointer(state.wordIndex));
+            __builtin_prefetch(wordPointer(std::min(state.wordIndex + 7, wordCount - 1)));
+            state.stage = selectState::WORDS;
+            return false;
         }
-        remaining -= currentMetadataValue;
-        ++blockIndex;
+        case selectState::WORDS:
+            out[state.query] = ONE ? select_1_words(state.wordIndex, state.remaining)
+                                   : select_0_words(state.wordIndex, state.remaining);
+            return true;
+        default:
+            return true;
+    }
 
-        // Last one is irrelevant as we know it has to be there (Ger.: Ausschlussverfahren)
-    } while (false);
+    // After the sample or a probe, request the metadata of the next superblock to look at.
+    if (state.last - state.first > SELECT_LINEAR_SUPERBLOCKS) {
+        state.probe = (state.first + state.last + 1) >> 1;
+        state.stage = selectState::PROBE;
+    } else if (state.first < state.last) {
+        state.probe = state.first + 1;
+        state.stage = selectState::PROBE;
+    } else {
+        state.probe = state.first;
+        state.stage = selectState::SUPERBLOCK;
+    }
+    __builtin_prefetch(metadataPointer(state.probe));
+    if constexpr (LAYOUT::interleaved) __builtin_prefetch(metadataPointer(state.probe) + RECORD_WORDS - 1);
+    return false;
+}
 
-    // Now, go through a maximum of 8 64-bit words
+// Per L0, we have 2^31 superblock indices. The 32nd bit is automatically the index of the L0 block.
+// This is more than enough to cover all 2^64 positions reachable using the 64-bit indices.
+#define WORDS_IN_BLOCK 8
+#define SUPERBLOCKS_PER_L0 0x7FFFFFFF // 2 ^ 31
+#define MIN_SUPERBLOCKS_PER_THREAD ((1 << 20) >> SUPERBLOCK_SHIFT) // 1 MBit, below that, starting a thread costs more than it saves.
 
-    // First we calculate where the 64-bit word we're looking for is in the bitvector vector, and define the final position
-    // as the position at the beginning of the block we're in.
-    auto wordIndex = (superblockIndex << 5) + (blockIndex << 3);
-    auto finalPosition = wordIndex << 6;
-    uint8_t onesInWord;
+/**
+ * A range of superblocks that is processed by one thread while building the helper structures.
+ */
+template<typename LAYOUT>
+struct basic_bitvector<LAYOUT>::helperChunk {
+    uint64 firstSuperblock, endSuperblock;
+    // Number of ones inside the chunk and before the chunk.
+    uint64 ones = 0, onesBefore = 0;
+    // Index + 1 of the last word in the chunk that contains a one or a zero, 0 if there is none.
+    uint64 lastOneWord = 0, lastZeroWord = 0;
+    // Where to write the positions of the sampled ones and zeros for the select samples.
+    uint64* onePoints = nullptr;
+    uint64* zeroPoints = nullptr;
+};
 
-    // Go through the 8 words or less
-    for (uint8_t index = 0; index < 8; ++index) {
-        auto bitword = vector[wordIndex + index];
-        onesInWord = std::popcount(bitword);
-        if (remaining > onesInWord) {
-            remaining -= onesInWord;
-            continue;
-        }
+/**
+ * This builds all helper data structure for the bitvector. Please call this method before performing any rank or select query.<br/>
+ * The superblocks are split into one chunk per thread, and the helpers are built in two parallel passes with a short
+ * sequential step in between:<br/>
+ * 1. Every thread counts the ones of its chunk and builds the superblock metadata, but with the number of ones before
+ * the superblock counted from the start of the chunk instead of the start of the vector. This is the only pass over the vector.<br/>
+ * 2. A prefix sum over the chunk totals yields the number of ones before every chunk, and with that, the total counts and
+ * the number of ones in the first L0 block. This is also when the number of select samples becomes known.<br/>
+ * 3. Every thread adds the ones before its chunk to its superblocks' metadata and finds the positions of every
+ * 2^(selectSampleShift_1 - 5)-th one and 2^(selectSampleShift_0 - 5)-th zero in its chunk. Each thread writes to its own range of entries, so no
+ * synchronization is needed besides joining the threads.<br/>
+ * 4. The select samples are put together from those positions. This only touches a few bits per thousand ones or zeros.<br/>
+ * <br/>
+ * Since the edges for blocks and super blocks are a multiple of 64, the order of the 1s and 0s in the words does not matter.
+ * Thus, the ones can be counted using popcount, which is significantly faster than iterating over the bits.<br/>
+ * The positions of the last one and zero are cached because the select queries can get a little bit fussy with certain
+ * edge cases when the position of the last 1 or 0 is requested. To evade this entirely, we just cache the values,
+ * which results in 128 bit additional overhead, which is okay compared to a bitvector size in the thousands or millions.
+ * @param options The number of threads to use and the select sample distance. Small bitvectors use fewer threads.
+ */
+template<typename LAYOUT>
+void basic_bitvector<LAYOUT>::buildHelpers(const buildOptions& options) {
+    uint64 superblockCount;
+    if constexpr (LAYOUT::interleaved) {
+        // Every record is a superblock, the counters are written in place.
+        superblockCount = vector.size() / RECORD_WORDS;
+    } else {
+        // 1 superblock covers 2^SUPERBLOCK_SHIFT bit, but needs METADATA_WORDS*64 bit. The last superblock is always partial, or entirely unused.
+        superblockCount = (wordCount >> (SUPERBLOCK_SHIFT - 6)) + 1;
+        superBlocks.assign(superblockCount * METADATA_WORDS, 0);
+    }
 
-        // Get position of the one in the word.
-        // Unfortunately, I am doing a lot of testing on Windows and my Macbook, and my Macbook does not support
-        // the trick with pdep and trailing zero count because of its processor architecture.
-        // To make this happen anyway, we'll need to do the old classic way
+    unsigned int threads = options.threads;
+    if (threads == 0) threads = std::max(1U, std::thread::hardware_concurrency());
+    threads = (unsigned int) std::clamp<uint64>(superblockCount / MIN_SUPERBLOCKS_PER_THREAD, 1, threads);
 
-        // This should be 0 if the loop is never run, but -1 otherwise because of the too early increment.
-        // If the loop will trigger, the last statement will evaluate to 1, so bitIndex will become -1,
-        // compensating for the first increment as planned. If not, 0.
-        uint8_t bitIndex = 0 - (remaining > 0);
+    std::vector<helperChunk> chunks(threads);
+    for (unsigned int c = 0; c < threads; ++c) {
+        chunks[c].firstSuperblock = superblockCount * c / threads;
+        chunks[c].endSuperblock = superblockCount * (c + 1) / threads;
+    }
 
-        while (remaining > 0) {
-            remaining -= bitword & 1;
-            bitword >>= 1;
-            ++bitIndex;
+    // Runs the given pass on every chunk, the first chunk on the calling thread.
+    auto runParallel = [this, &chunks](void (basic_bitvector::*pass)(helperChunk&)) {
+        std::vector<std::thread> workers;
+        workers.reserve(chunks.size() - 1);
+        for (size_t c = 1; c < chunks.size(); ++c) workers.emplace_back(pass, this, std::ref(chunks[c]));
+        (this->*pass)(chunks[0]);
+        for (auto& worker : workers) worker.join();
+    };
+
+    runParallel(&basic_bitvector::countChunk);
+
+    // Prefix sum over the chunks, and collect the global values.
+    uint64 ones = 0, lastOneWord = 0, lastZeroWord = 0;
+    for (auto& chunk : chunks) {
+        chunk.onesBefore = ones;
+        ones += chunk.ones;
+        lastOneWord = std::max(lastOneWord, chunk.lastOneWord);
+        lastZeroWord = std::max(lastZeroWord, chunk.lastZeroWord);
+    }
+    oneCount = ones;
+    zeroCount = (wordCount << 6) - ones;
+    // The Position at the start of the word + the position of the last 1. 63 - number of leading zeros. Same for the 0s.
+    lastOnePos = lastOneWord == 0 ? 0 : ((lastOneWord - 1) << 6) + (63 - __builtin_clzll(word(lastOneWord - 1)));
+    lastZeroPos = lastZeroWord == 0 ? 0 : ((lastZeroWord - 1) << 6) + (63 - __builtin_clzll(~word(lastZeroWord - 1)));
+
+    // If the vector reaches into the second L0 block, save the amount of 1s in the first one. At this point, the metadata
+    // still holds the ones counted from the start of the chunk. The interleaved layout stores 64-bit counters instead.
+    L0SingleBlockData = 0;
+    if (!LAYOUT::interleaved && !LAYOUT::small && superblockCount > SUPERBLOCKS_PER_L0) {
+        for (auto& chunk : chunks) {
+            if (chunk.endSuperblock > SUPERBLOCKS_PER_L0) {
+                L0SingleBlockData = chunk.onesBefore + (superBlocks[SUPERBLOCKS_PER_L0 * METADATA_WORDS] >> ONES_SHIFT);
+                break;
+            }
         }
+    }
 
-        // Now construct the final index from all the pieces
-        finalPosition += index << 6;
-        finalPosition += bitIndex;
-        break;
+    // Very sparse and very dense bitvectors keep only the positions of their rarer bit value.
+    backend = BACKEND_PLAIN;
+    sparse = eliasfano();
+    compressed = rrrvector();
+    if (options.sparse && std::min(oneCount, zeroCount) < ((wordCount << 6) >> SPARSE_DENSITY_SHIFT)) {
+        buildSparse(oneCount <= zeroCount ? 1 : 0);
+        return;
+    }
+    if (options.compressed) {
+        buildCompressed();
+        return;
     }
 
-    // Return the final position of the num-th 1.
-    return finalPosition;
+    // One point per 2^(shift - 5) ones or zeros, and a select sample for every 32 points. With a budget, the points are
+    // collected at the densest shift the plan may choose, see chooseSampleShifts.
+    selectSampleShift_0 = selectSampleShift_1 = options.selectSampleShift == 0 ? LAYOUT::selectSampleShift
+            : std::clamp<uint64>(options.selectSampleShift, MIN_SELECT_SAMPLE_SHIFT, MAX_SELECT_SAMPLE_SHIFT);
+    uint64 budget = (uint64) (std::max(0.0, options.selectBudget) * (double) (wordCount << 6));
+    if (options.selectBudget > 0) {
+        // Without any spilled samples, a shift needs (count >> shift) * SELECT_SAMPLE_WORDS words of the budget. Shifts below
+        // the default also need more points than a build without a budget, which are limited.
+        auto densestShift = [this, budget](uint64 count) {
+            uint64 shift = MIN_SELECT_SAMPLE_SHIFT;
+            while (shift < MAX_SELECT_SAMPLE_SHIFT && ((count >> shift) * SELECT_SAMPLE_WORDS * sizeof(sampleWord) * 8 > budget
+                                                       || (shift < LAYOUT::selectSampleShift
+                                                           && (count >> (shift - SELECT_SPILL_SHIFT)) * SELECT_PLAN_WORDS_PER_POINT > wordCount))) {
+                ++shift;
+            }
+            return shift;
+        };
+        selectSampleShift_0 = densestShift(zeroCount);
+        selectSampleShift_1 = densestShift(oneCount);
+    }
+    // Select samples that are not needed get no points either.
+    uint64 onePointShift = selectSampleShift_1 - SELECT_SPILL_SHIFT, zeroPointShift = selectSampleShift_0 - SELECT_SPILL_SHIFT;
+    bool buildOnes = options.helpers & HELPERS_SELECT_1, buildZeros = options.helpers & HELPERS_SELECT_0;
+    std::vector<uint64> onePoints(buildOnes ? (oneCount + (1ULL << onePointShift) - 1) >> onePointShift : 0);
+    std::vector<uint64> zeroPoints(buildZeros ? (zeroCount + (1ULL << zeroPointShift) - 1) >> zeroPointShift : 0);
+    for (auto& chunk : chunks) {
+        chunk.onePoints = buildOnes ? onePoints.data() : nullptr;
+        chunk.zeroPoints = buildZeros ? zeroPoints.data() : nullptr;
+    }
+
+    runParallel(&basic_bitvector::finishChunk);
+    if (options.selectBudget > 0) chooseSampleShifts(onePoints, zeroPoints, budget);
+
+    // Samples of an earlier build are released, so size() only counts what was built.
+    if (buildOnes) {
+        buildSelectSamples(1, onePoints);
+    } else {
+        indexArray<sampleWord>().swap(selectSamples_1);
+        indexArray<sampleWord>().swap(selectSpill_1);
+    }
+    if (buildZeros) {
+        buildSelectSamples(0, zeroPoints);
+    } else {
+        indexArray<sampleWord>().swap(selectSamples_0);
+        indexArray<sampleWord>().swap(selectSpill_0);
+    }
 }
 
 /**
- * Helper function to perform the binary search for ones. Takes in the position, the super block number (not index!)
- * of the start and end of the search area.
- * @param num The num-th one.
- * @param start The start super block number.
- * @param end The end super block number.
- * @return The super block number of where the num-th one is.
+ * First pass of buildHelpers. Counts the ones of every word in the chunk and writes the superblock metadata,
+ * where the number of ones before the superblock is relative to the start of the chunk.<br/>
+ * As in the metadata, the block counters contain the ones in the superblock up to and including the block. The last block
+ * needs no counter, its ones follow from the next superblock. The last superblock of the vector may end early, in which case
+ * the counters after its last block stay 0. The blocks of a superblock are counted by the popcount kernel in one call,
+ * and only the last block with a one or a zero is searched for its last such word at the end.<br/>
+ * In the interleaved layout, the counter words of every block's record are written instead. The word counters after the
+ * last word of the vector hold the ones of the entire block, so select never walks past the last word.
+ * @param chunk The chunk to process.
  */
-uint64 bitvector::select_1_iterative(uint64& num, uint64 start, uint64 end) {
-    uint64 middle;
+template<typename LAYOUT>
+void basic_bitvector<LAYOUT>::countChunk(helperChunk& chunk) {
+    const uint64 words = wordCount;
+    uint64 chunkOneCounter = 0;
+
+    if constexpr (LAYOUT::interleaved) {
+        for (uint64 block = chunk.firstSuperblock; block < chunk.endSuperblock; ++block) {
+            uint64* record = vector.data() + block * RECORD_WORDS;
+            uint64 wordIndex = block << 3;
+            uint64 blockEnd = std::min(wordIndex + WORDS_IN_BLOCK, words);
+            uint64 blockOneCounter = 0, wordCounters = 0;
+
+            for (uint8_t index = 0; index < WORDS_IN_BLOCK; ++index, ++wordIndex) {
+                if (index > 0) wordCounters |= blockOneCounter << ((index - 1) * 9);
+                if (wordIndex >= blockEnd) continue;
+                uint8_t onesInWord = std::popcount(record[RECORD_DATA + index]);
+                blockOneCounter += onesInWord;
+                chunk.lastOneWord = onesInWord > 0 ? wordIndex + 1 : chunk.lastOneWord;
+                chunk.lastZeroWord = onesInWord < 64 ? wordIndex + 1 : chunk.lastZeroWord;
+            }
 
-    // Find the first super block where the number of ones exceeds num.
-    while (end > start) {
-        middle = (start + end) >> 1;
-        if (superRank(middle) < num) {
-            start = middle + 1;
+            record[0] = chunkOneCounter;
+            record[1] = wordCounters;
+            chunkOneCounter += blockOneCounter;
+        }
+    } else {
+        uint16_t blockOnes[BLOCKS_IN_SUPERBLOCK];
+        // Index + 1 of the last block in the chunk that contains a one or a zero, 0 if there is none.
+        uint64 lastOneBlock = 0, lastZeroBlock = 0;
+
+        for (uint64 superblock = chunk.firstSuperblock; superblock < chunk.endSuperblock; ++superblock) {
+            uint64 metadata[2] = { chunkOneCounter << ONES_SHIFT, 0 };
+            uint64 superBlockOneCounter = 0;
+            uint64 wordIndex = superblock << (SUPERBLOCK_SHIFT - 6);
+            uint64 superblockEnd = std::min(wordIndex + (BLOCKS_IN_SUPERBLOCK * WORDS_IN_BLOCK), words);
+            auto blocks = (uint8_t) ((superblockEnd - wordIndex + WORDS_IN_BLOCK - 1) >> 3);
+            popcountBlocks(vector.data() + wordIndex, blocks, blockOnes);
+
+            for (uint8_t blockIndex = 0; blockIndex < blocks; ++blockIndex) {
+                uint64 block = superblock * BLOCKS_IN_SUPERBLOCK + blockIndex;
+                uint64 bitsInBlock = (std::min((block + 1) << 3, words) - (block << 3)) << 6;
+                superBlockOneCounter += blockOnes[blockIndex];
+                // Conditional moves, not branches. The padding words after the last word are neither ones nor zeros.
+                lastOneBlock = blockOnes[blockIndex] > 0 ? block + 1 : lastOneBlock;
+                lastZeroBlock = blockOnes[blockIndex] < bitsInBlock ? block + 1 : lastZeroBlock;
+
+                // Save the ones up to here to the current metadata, they are the ones before the next block.
+                if (blockIndex < BLOCKS_IN_SUPERBLOCK - 1) packBlockCounter(metadata, blockIndex + 1, superBlockOneCounter);
+            }
+
+            std::copy(metadata, metadata + METADATA_WORDS, superBlocks.begin() + (long) (superblock * METADATA_WORDS));
+            chunkOneCounter += superBlockOneCounter;
+        }
+
+        // The last word with a one or a zero is in the last block with one.
+        if (lastOneBlock > 0) {
+            for (uint64 wordIndex = (lastOneBlock - 1) << 3; wordIndex < std::min(lastOneBlock << 3, words); ++wordIndex) {
+                if (vector[wordIndex] != 0) chunk.lastOneWord = wordIndex + 1;
+            }
+        }
+        if (lastZeroBlock > 0) {
+            for (uint64 wordIndex = (lastZeroBlock - 1) << 3; wordIndex < std::min(lastZeroBlock << 3, words); ++wordIndex) {
+                if (vector[wordIndex] != ~0ULL) chunk.lastZeroWord = wordIndex + 1;
+            }
+        }
+    }
+    chunk.ones = chunkOneCounter;
+}
+
+/**
+ * Second pass of buildHelpers, after the ones before every chunk are known. Turns the number of ones before every superblock
+ * into the number of ones before it in its L0 block, and finds the positions of the sampled ones and zeros of the chunk.<br/>
+ * Superblock s contains the ones after the ones before s, and up to and including the ones before s + 1. Since the metadata
+ * of s is final at this point, those inside can be found with the regular select inside the superblock. Each chunk covers
+ * a continuous range of ones and zeros, so it writes a continuous range of points.<br/>
+ * In the interleaved layout, the ones before the block are simply made absolute.
+ * @param chunk The chunk to process.
+ */
+template<typename LAYOUT>
+void basic_bitvector<LAYOUT>::finishChunk(helperChunk& chunk) {
+    const uint64 bits = wordCount << 6;
+    const uint64 onePointShift = selectSampleShift_1 - SELECT_SPILL_SHIFT, zeroPointShift = selectSampleShift_0 - SELECT_SPILL_SHIFT;
+    const uint64 onePointDistance = 1ULL << onePointShift, zeroPointDistance = 1ULL << zeroPointShift;
+
+    for (uint64 superblock = chunk.firstSuperblock; superblock < chunk.endSuperblock; ++superblock) {
+        // The next superblock in this chunk is not yet updated, so it also still holds the ones relative to the chunk.
+        uint64 onesBefore, onesAfter;
+        if constexpr (LAYOUT::interleaved) {
+            onesBefore = chunk.onesBefore + vector[superblock * RECORD_WORDS];
+            onesAfter = chunk.onesBefore + (superblock + 1 < chunk.endSuperblock ? vector[(superblock + 1) * RECORD_WORDS] : chunk.ones);
+            vector[superblock * RECORD_WORDS] = onesBefore;
         } else {
-            end = middle;
+            uint64 metadata1 = superBlocks[superblock * METADATA_WORDS];
+            onesBefore = chunk.onesBefore + (metadata1 >> ONES_SHIFT);
+            onesAfter = chunk.onesBefore + (superblock + 1 < chunk.endSuperblock ? superBlocks[(superblock + 1) * METADATA_WORDS] >> ONES_SHIFT : chunk.ones);
+            uint64 L0Offset = !LAYOUT::small && superblock >= SUPERBLOCKS_PER_L0 ? L0SingleBlockData : 0;
+            superBlocks[superblock * METADATA_WORDS] = ((onesBefore - L0Offset) << ONES_SHIFT) | (metadata1 & ((1ULL << ONES_SHIFT) - 1));
+        }
+
+        // The 0-based numbers of the sampled ones, rounded up to the next sampled one. No points are collected
+        // for select samples that are not built.
+        for (uint64 k = (onesBefore + onePointDistance - 1) & ~(onePointDistance - 1); chunk.onePoints && k < onesAfter; k += onePointDistance) {
+            chunk.onePoints[k >> onePointShift] = select_1_in_superblock(superblock, k + 1);
+        }
+
+        uint64 zerosBefore = (superblock << SUPERBLOCK_SHIFT) - onesBefore;
+        uint64 zerosAfter = std::min((superblock + 1) << SUPERBLOCK_SHIFT, bits) - onesAfter;
+        for (uint64 k = (zerosBefore + zeroPointDistance - 1) & ~(zeroPointDistance - 1); chunk.zeroPoints && k < zerosAfter; k += zeroPointDistance) {
+            chunk.zeroPoints[k >> zeroPointShift] = select_0_in_superblock(superblock, k + 1);
         }
     }
-    // start is the first super block where in the metadata it says 1s >= num. The superblock where it happens
-    // is the one we want, so the super block before it.
-    // Because of from where it's called, the start value here is >= 1.
-    return start - 1;
 }
 
 /**
- * This builds all helper data structure for the bitvector. Please call this method before performing any rank or select query.<br/>
- * We loop through the vector one 64-bit word at a time. Since the edges for blocks and super blocks are a multiple of 64, the
- * order of the 1s and 0s in the words does not matter. Thus, the ones can be counted using popcount, which is significantly faster
- * than iterating over the bits.<br/>
- * Since we keep track of the last one and zero position, we need to update it about once per 64-bit word each. While this is not
- * really that great, it doesn't have much of an impact on performance, so we're good. These values are cached because the select
- * queries can get a little bit fussy with certain edge cases when the position of the last 1 or 0 is requested. To evade this entirely,
- * we just cache the values, which results in 128 bit additional overhead, which is okay compared to a bitvector size in the thousands
- * or millions.
- */
-void bitvector::buildHelpers() {
-
-    superBlocks = *new std::vector<uint64>(((vector.size() >> 6) << 1) + 2ULL);    // 1 superblock covers 4096 (2^12) bit, but needs 2*64 bit. So, multiply amount by 2.
-
-    // Per L0, we have 2^31 superblock indices. The 32nd bit is automatically the index of the L0 block.
-    // This is more than enough to cover all 2^64 positions reachable using the 64-bit indices.
-#define BLOCKS_IN_SUPERBLOCK 8
-#define WORDS_IN_BLOCK 8
-#define SUPERBLOCKS_PER_L0 0x7FFFFFFF // 2 ^ 31
+ * Last step of buildHelpers. Puts the select samples for ones or zeros together from the positions of every
+ * 2^(shift - 5)-th one or zero, with the sample shift of the bit value.<br/>
+ * If the 2^shift ones or zeros of a sample lie within 2^16 bit, every fourth position is stored as a 16-bit
+ * offset from the position of the sample. Otherwise, the sample is spilled and all 32 positions are stored in full.
+ * This is at most 2048 bit per 65536 bit of the vector, and only in sparse regions. Positions after the last one or zero
+ * are replaced by the position of the last one or zero, so the upper bound of a select never points past it.
+ * @param bitValue 1 or 0.
+ * @param points The positions of every 2^(shift - 5)-th one or zero.
+ */
+template<typename LAYOUT>
+void basic_bitvector<LAYOUT>::buildSelectSamples(uint8_t bitValue, const std::vector<uint64>& points) {
+    auto& samples = bitValue == 1 ? selectSamples_1 : selectSamples_0;
+    auto& spill = bitValue == 1 ? selectSpill_1 : selectSpill_0;
+    const uint64 lastPos = bitValue == 1 ? lastOnePos : lastZeroPos;
+    const uint64 pointsPerSample = 1ULL << SELECT_SPILL_SHIFT;
+    const uint64 pointsPerOffset = 1ULL << (SELECT_SPILL_SHIFT - SELECT_SUBSAMPLE_SHIFT);
+    auto point = [&points, lastPos](uint64 i) { return i < points.size() ? points[i] : lastPos; };
+
+    uint64 sampleCount = (points.size() + pointsPerSample - 1) >> SELECT_SPILL_SHIFT;
+    samples.assign((sampleCount + 1) * SELECT_SAMPLE_WORDS, 0);
+    spill.clear();
+
+    for (uint64 sample = 0; sample < sampleCount; ++sample) {
+        sampleWord* entry = samples.data() + sample * SELECT_SAMPLE_WORDS;
+        uint64 firstPoint = sample << SELECT_SPILL_SHIFT;
+        uint64 position = points[firstPoint];
+
+        if (point(firstPoint + pointsPerSample) - position < SELECT_OFFSET_LIMIT) {
+            entry[0] = (sampleWord) position;
+            for (uint64 i = 0; i < (1 << SELECT_SUBSAMPLE_SHIFT); ++i) {
+                entry[1 + i / SELECT_SAMPLE_OFFSETS_PER_WORD] |= (sampleWord) ((point(firstPoint + i * pointsPerOffset) - position)
+                        << ((i % SELECT_SAMPLE_OFFSETS_PER_WORD) << 4));
+            }
+        } else {
+            entry[0] = (sampleWord) (position | SELECT_SPILL_FLAG);
+            if (LAYOUT::small) entry[1] = 1;
+            entry[SELECT_SPILL_INDEX] = (sampleWord) spill.size();
+            for (uint64 i = 0; i < pointsPerSample; ++i) spill.push_back(point(firstPoint + i));
+        }
+    }
+    samples[sampleCount * SELECT_SAMPLE_WORDS] = (sampleWord) lastPos;
+    spill.shrink_to_fit();
+}
 
-    // Initialize lots of counters
-    uint8_t wordIndex = 0, blockIndex = 0, onesInBlock;
-    uint64 metadata1Builder = 0, metadata2Builder = 0;
-    uint64 L0BlockOneCounter = 0, superBlockOneCounter = 0, superblockIndex = 0;
-
-    // Initialize the next threshold value for saving the superblock to the select cache
-    uint64 nextSelectCacheThreshold_0 = EVERY_OTHER_1_POS, nextSelectCacheThreshold_1 = EVERY_OTHER_1_POS;
-    uint64 word;
-
-    for (uint64 vectorIndex = 0; vectorIndex < vector.size(); ++vectorIndex) {
-        // Read and process the next word first.
-        word = vector[vectorIndex];
-
-        ++wordIndex;
-        onesInBlock = std::popcount(word);
-        superBlockOneCounter += onesInBlock;
-        L0BlockOneCounter += onesInBlock;
-        oneCount += onesInBlock;
-        zeroCount += 64 - onesInBlock;
-
-        // Update the last 0 and 1 position when one occurs. We need to do this every time, since the last
-        // one or zero position is arbitrary.
-        if (onesInBlock > 0) {
-            // The Position at the start of the word + the position of the first 1. 63 - number of leading zeros.
-            lastOnePos = (vectorIndex << 6) + (63 - __builtin_clzll(word));
-        }
-        if (onesInBlock < 64) {
-            // same as above but inverted if at least one zero is in the word.
-            lastZeroPos = (vectorIndex << 6) + (63 - __builtin_clzll(~word));
-        }
-
-        if (oneCount >= nextSelectCacheThreshold_1) {
-            nextSelectCacheThreshold_1 += EVERY_OTHER_1_POS;
-            selectCache_1.emplace_back(superblockIndex >> 1);
-        }
-        if (zeroCount >= nextSelectCacheThreshold_0) {
-            nextSelectCacheThreshold_0 += EVERY_OTHER_1_POS;
-            selectCache_0.emplace_back(superblockIndex >> 1);
-        }
-
-        // Update superblock metadata and indices. Do this when finishing a block, superblock,
-        // or if this is the last loop iteration. If we do not save the last collected metadata,
-        // this can lead to several bugs with rank and select.
-        // This is also the reason we are not using an enhanced for-loop (for-each).
-        if (wordIndex == WORDS_IN_BLOCK || vectorIndex == vector.size() - 1) {
-            wordIndex = 0;
-            if (blockIndex == BLOCKS_IN_SUPERBLOCK - 1) {
-
-                // Push metadata
-                superBlocks[superblockIndex++] = metadata1Builder;
-                superBlocks[superblockIndex++] = metadata2Builder;
-
-                // If this happens to be the change from the first to the second L0 block, save
-                // the amount of 1s
-                if ((superblockIndex >> 1) == SUPERBLOCKS_PER_L0) {
-                    L0SingleBlockData = oneCount;
-                    L0BlockOneCounter = 0;
-                }
-
-                // Reset values:
-                metadata1Builder = L0BlockOneCounter << 20;  // Push all previous ones here. This is on purpose.
-                metadata2Builder = 0;
-                superBlockOneCounter = 0;
-                blockIndex = 0;
+/**
+ * Evaluates a sample shift for ones or zeros on the positions collected by finishChunk, without building the samples.
+ * A select walks the superblocks between the two hints it gets from the samples, and searches windows of more than
+ * SELECT_LINEAR_SUPERBLOCKS superblocks binary, which halves them with every probe.
+ * @param points The positions of every 2^(shift - 5)-th one or zero at the densest shift.
+ * @param stride 2^(candidate shift - densest shift), so every stride-th point is a point at the candidate shift.
+ * @param lastPos The position of the last one or zero.
+ * @return The space of the samples and spill lists in bit, and the most binary search probes of a select.
+ */
+template<typename LAYOUT>
+std::pair<uint64, uint64> basic_bitvector<LAYOUT>::planSelectSamples(const std::vector<uint64>& points, uint64 stride, uint64 lastPos) const {
+    const uint64 pointsPerSample = 1ULL << SELECT_SPILL_SHIFT;
+    const uint64 pointsPerOffset = 1ULL << (SELECT_SPILL_SHIFT - SELECT_SUBSAMPLE_SHIFT);
+    auto point = [&points, stride, lastPos](uint64 i) { return i * stride < points.size() ? points[i * stride] : lastPos; };
+    auto probes = [](uint64 low, uint64 high) {
+        uint64 count = 0;
+        for (uint64 window = (high >> SUPERBLOCK_SHIFT) - (low >> SUPERBLOCK_SHIFT); window > SELECT_LINEAR_SUPERBLOCKS; window >>= 1) ++count;
+        return count;
+    };
+
+    uint64 sampleCount = ((points.size() + stride - 1) / stride + pointsPerSample - 1) >> SELECT_SPILL_SHIFT;
+    uint64 spilled = 0, worst = 0;
+    for (uint64 sample = 0; sample < sampleCount; ++sample) {
+        uint64 firstPoint = sample << SELECT_SPILL_SHIFT;
+        // The hints of a spilled sample are all of its points, the others every pointsPerOffset-th.
+        uint64 step = point(firstPoint + pointsPerSample) - point(firstPoint) < SELECT_OFFSET_LIMIT ? pointsPerOffset : 1;
+        spilled += step == 1;
+        for (uint64 i = 0; i < pointsPerSample; i += step) {
+            worst = std::max(worst, probes(point(firstPoint + i), point(firstPoint + i + step)));
+        }
+    }
+    return { ((sampleCount + 1) * SELECT_SAMPLE_WORDS + spilled * pointsPerSample) * sizeof(sampleWord) * 8, worst };
+}
 
-            } else {
-                // Not a superblock, but instead a block. Save this to the current metadata.
-                if (blockIndex == 0) {
-                    metadata1Builder |= (superBlockOneCounter & 0xFFF) << 8;
-                } else if (blockIndex == 1) {
-                    metadata1Builder |= ((superBlockOneCounter >> 4) & 0xFF);
-                    metadata2Builder |= (superBlockOneCounter & 0xF) << 60;
-                } else {
-                    metadata2Builder |= (superBlockOneCounter & 0xFFF) << ((blockIndex - 2) * 12);
-                }
-                ++blockIndex;
+/**
+ * Chooses the sample shifts for ones and zeros within a select budget, on the positions collected by finishChunk at the
+ * densest shifts the budget allows. The space of a shift depends on the number of ones or zeros and on how many of its
+ * samples spill, its worst case on the widest gap between two hints, so both follow from the positions, see
+ * planSelectSamples.<br/>
+ * The shifts are the ones with the fewest probes in the worst case whose samples fit into the budget together, or the
+ * smallest samples with a warning if none fit. Space left in the budget then lowers the shifts further, down to the
+ * densest one, for shorter searches on average. At last, the points are thinned out to the chosen shifts.
+ * @param onePoints The positions of the ones, empty if their select samples are not built.
+ * @param zeroPoints The positions of the zeros, empty if their select samples are not built.
+ * @param budget The space of all select samples and spill lists in bit.
+ */
+template<typename LAYOUT>
+void basic_bitvector<LAYOUT>::chooseSampleShifts(std::vector<uint64>& onePoints, std::vector<uint64>& zeroPoints, uint64 budget) {
+    // The space and worst case of every shift from the densest one, for ones and zeros.
+    std::vector<std::pair<uint64, uint64>> plans[2];
+    std::vector<uint64>* points[2] = { &zeroPoints, &onePoints };
+    uint64* shifts[2] = { &selectSampleShift_0, &selectSampleShift_1 };
+    const uint64 lastPos[2] = { lastZeroPos, lastOnePos };
+    std::vector<uint64> limits;
+    for (int bitValue = 0; bitValue < 2; ++bitValue) {
+        if (points[bitValue]->empty()) continue;
+        for (uint64 shift = *shifts[bitValue]; shift <= MAX_SELECT_SAMPLE_SHIFT; ++shift) {
+            uint64 stride = 1ULL << (shift - *shifts[bitValue]);
+            plans[bitValue].push_back(planSelectSamples(*points[bitValue], stride, lastPos[bitValue]));
+            limits.push_back(plans[bitValue].back().second);
+            // A single sample covers all points, larger shifts only come out the same.
+            if (stride << SELECT_SPILL_SHIFT >= points[bitValue]->size()) break;
+        }
+    }
+    if (limits.empty()) return;
+    std::sort(limits.begin(), limits.end());
+
+    // The smallest plan of a bit value with at most the given probes, or the smallest one of all.
+    auto smallest = [&plans](int bitValue, uint64 limit) {
+        uint64 best = 0;
+        for (uint64 i = 1; i < plans[bitValue].size(); ++i) {
+            auto [bits, probes] = plans[bitValue][i];
+            bool fits = probes <= limit, bestFits = plans[bitValue][best].second <= limit;
+            if ((fits && !bestFits) || (fits == bestFits && bits < plans[bitValue][best].first)) best = i;
+        }
+        return best;
+    };
+    auto cost = [&plans](const uint64 (&chosen)[2]) {
+        uint64 bits = 0;
+        for (int bitValue = 0; bitValue < 2; ++bitValue) {
+            if (!plans[bitValue].empty()) bits += plans[bitValue][chosen[bitValue]].first;
+        }
+        return bits;
+    };
+    uint64 limit = UINT64_MAX, chosen[2] = { 0, 0 };
+    for (uint64 candidate : limits) {
+        uint64 plan[2] = { smallest(0, candidate), smallest(1, candidate) };
+        bool reached = true;
+        for (int bitValue = 0; bitValue < 2; ++bitValue) {
+            if (!plans[bitValue].empty() && plans[bitValue][plan[bitValue]].second > candidate) reached = false;
+        }
+        if (reached && cost(plan) <= budget) {
+            limit = candidate;
+            break;
+        }
+    }
+    for (int bitValue = 0; bitValue < 2; ++bitValue) chosen[bitValue] = smallest(bitValue, limit);
+    if (limit == UINT64_MAX) {
+        std::cerr << "The select samples need at least " << cost(chosen) << " bit, more than the select budget of " << budget
+                  << " bit. The smallest ones are built." << std::endl;
+    }
+
+    // Spend the rest of the budget on denser samples, one step at a time for both bit values, down to the densest shift.
+    for (bool lowered = true; lowered;) {
+        lowered = false;
+        for (int bitValue = 0; bitValue < 2; ++bitValue) {
+            if (chosen[bitValue] == 0) continue;
+            uint64 plan[2] = { chosen[0], chosen[1] };
+            --plan[bitValue];
+            if (plans[bitValue][plan[bitValue]].second <= limit && cost(plan) <= budget) {
+                chosen[bitValue] = plan[bitValue];
+                lowered = true;
             }
         }
     }
 
-    // If there is still space (there should be, but in edge cases we don't want to write on unknown memory),
-    // push the last unfinished metadata to the superblocks vector as well. This is important information on the
-    // blocks and the existance of a superblock there, as the superblocks should cover the entire vector.
-    if (superblockIndex < superBlocks.size()) {
-        superBlocks[superblockIndex++] = metadata1Builder;
-        superBlocks[superblockIndex++] = metadata2Builder;
+    for (int bitValue = 0; bitValue < 2; ++bitValue) {
+        if (plans[bitValue].empty()) continue;
+        std::vector<uint64>& thinned = *points[bitValue];
+        uint64 stride = 1ULL << chosen[bitValue];
+        for (uint64 i = 0; i * stride < thinned.size(); ++i) thinned[i] = thinned[i * stride];
+        thinned.resize((thinned.size() + stride - 1) / stride);
+        *shifts[bitValue] += chosen[bitValue];
     }
 }
 
+/**
+ * Last step of buildHelpers for bitvectors with very few ones or zeros. Stores the positions of the rarer bit value
+ * as Elias-Fano and releases the vector and all other helper structures, so only the counts and the last positions
+ * are kept from the normal build.<br/>
+ * At a density of 1/2^SPARSE_DENSITY_SHIFT, this takes about 2 + SPARSE_DENSITY_SHIFT bit per position, a fifth
+ * of the plain vector, and much less for sparser ones. Select of the rarer bit value needs no search anymore, while
+ * rank binary searches the positions inside a bucket.
+ * @param bitValue The rarer bit value, 1 or 0.
+ */
+template<typename LAYOUT>
+void basic_bitvector<LAYOUT>::buildSparse(uint8_t bitValue) {
+    backend = bitValue == 1 ? BACKEND_SPARSE_ONES : BACKEND_SPARSE_ZEROS;
+    sparse = eliasfano(wordCount << 6, bitValue == 1 ? oneCount : zeroCount);
+    for (uint64 index = 0; index < wordCount; ++index) {
+        uint64 bits = bitValue == 1 ? word(index) : ~word(index);
+        for (; bits != 0; bits &= bits - 1) sparse.push_back((index << 6) + std::countr_zero(bits));
+    }
+    sparse.finish();
+    releasePlain();
+}
+
+/**
+ * Last step of buildHelpers for compressed bitvectors. Compresses every word with RRR and releases the vector and all
+ * other helper structures, like buildSparse. Rank and select need no samples of the plain layout, the compressed
+ * bitvector has its own superblock metadata.
+ */
+template<typename LAYOUT>
+void basic_bitvector<LAYOUT>::buildCompressed() {
+    backend = BACKEND_RRR;
+    compressed = rrrvector(wordCount);
+    for (uint64 index = 0; index < wordCount; ++index) compressed.push_back(word(index));
+    compressed.finish();
+    releasePlain();
+}
+
+/**
+ * Releases the plain vector and the helper structures of the plain layout, when another backend replaces them.
+ */
+template<typename LAYOUT>
+void basic_bitvector<LAYOUT>::releasePlain() {
+    L0SingleBlockData = 0;
+    indexArray<uint64>().swap(vector);
+    indexArray<uint64>().swap(superBlocks);
+    indexArray<sampleWord>().swap(selectSamples_0);
+    indexArray<sampleWord>().swap(selectSamples_1);
+    indexArray<sampleWord>().swap(selectSpill_0);
+    indexArray<sampleWord>().swap(selectSpill_1);
+}
+
 /**
  * This calculates how much bit in total the bitvector object is taking up.
  * This includes all lists, vectors, and static overhead.
  * @return The space usage in bit.
  */
-uint64 bitvector::size() {
-    // 5 * 64 bit through misc metadata: L0SingleBlockData, zeroCount, oneCount, last one and zero position
-    uint64 size = 320;
-
-    size += vector.capacity() * 64;
-    size += superBlocks.capacity() * 64;
-    size += selectCache_0.capacity() * 32;
-    size += selectCache_1.capacity() * 32;
+template<typename LAYOUT>
+uint64 basic_bitvector<LAYOUT>::size() const {
+    // 8 * 64 bit through misc metadata: L0SingleBlockData, zeroCount, oneCount, last one and zero position, the sample
+    // distances of zeros and ones, number of words, and 8 bit for the sparse mode
+    uint64 size = 520;
+
+    size += vector.reservedBytes() * 8;
+    size += superBlocks.reservedBytes() * 8;
+    size += selectSamples_0.reservedBytes() * 8;
+    size += selectSamples_1.reservedBytes() * 8;
+    size += selectSpill_0.reservedBytes() * 8;
+    size += selectSpill_1.reservedBytes() * 8;
+    size += sparse.size();
+    size += compressed.size();
 
     return size;
-}
\ No newline at end of file
+}
+// ------------------------------------------------------------------------------------------------------------------
+// Serialization
+//
+// Layout of an index file, all numbers in native byte order:
+// - Header, 64 byte: magic, format version, section count, and a checksum over everything after the header.
+// - Section table, one (offset, bytes) pair per section, padded to 64 byte.
+// - The sections, each starting at a 64-byte aligned offset and padded with zeros to a multiple of 64 byte.
+//   In this version: the scalar fields, vector, superBlocks, selectSamples_0, selectSamples_1, selectSpill_0, selectSpill_1,
+//   the Elias-Fano data and the RRR data. Sections that were not built are empty.
+// The alignment allows mapping the file and using the sections in place. The scalar fields include the storage layout,
+// an index can only be loaded by a bitvector with the same layout. Version 4 packs the block counters in order,
+// version 5 adds the sparse mode, version 6 the compressed one, version 7 a select sample shift per bit value.
+// ------------------------------------------------------------------------------------------------------------------
+
+#define INDEX_MAGIC "CSTULIP"
+#define INDEX_FORMAT_VERSION 7
+#define INDEX_SECTION_COUNT 9
+#define INDEX_SCALAR_COUNT 10
+#define INDEX_LAYOUT (LAYOUT::interleaved ? 1 : LAYOUT::small ? 2 : (SUPERBLOCK_SHIFT << 8) | COUNTER_BITS)
+#define INDEX_ALIGNMENT 64
+
+struct indexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sectionCount;
+    uint64 checksum;
+    uint64 reserved[5];
+};
+static_assert(sizeof(indexHeader) == INDEX_ALIGNMENT);
+
+struct indexSection {
+    uint64 offset, bytes;
+};
+
+/**
+ * A simple 64-bit checksum over a stream of 64-bit words. Four independent lanes of multiply and rotate,
+ * so the multiplications do not wait on each other and the checksum keeps up with reading from disk.
+ */
+class indexChecksum {
+public:
+    void add(const void* data, uint64 bytes) {
+        // The padding of a mapped index file can start anywhere, so the words are copied instead of loaded in place.
+        auto words = (const char*) data;
+        for (uint64 i = 0; i < (bytes >> 3); ++i, ++position) {
+            uint64 word;
+            std::memcpy(&word, words + (i << 3), sizeof(word));
+            uint64& lane = lanes[position & 3];
+            lane = std::rotl((lane ^ word) * 0x9E3779B97F4A7C15ULL, 31);
+        }
+    }
+    uint64 value() const {
+        return (lanes[0] ^ std::rotl(lanes[1], 16) ^ std::rotl(lanes[2], 32) ^ std::rotl(lanes[3], 48)) + position;
+    }
+private:
+    uint64 lanes[4] = { 1, 2, 3, 4 };
+    uint64 position = 0;
+};
+
+static uint64 alignIndexOffset(uint64 offset) {
+    return (offset + INDEX_ALIGNMENT - 1) & ~(uint64) (INDEX_ALIGNMENT - 1);
+}
+
+static bool headerMatches(const indexHeader& header) {
+    return std::memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 && header.version == INDEX_FORMAT_VERSION
+           && header.sectionCount == INDEX_SECTION_COUNT;
+}
+
+/**
+ * Checks that a section starts aligned after the end of the section before, fits into the file, and holds whole elements.
+ * @param section The section.
+ * @param position The end of the section before.
+ * @param elementSize The size of an element of the section.
+ * @param fileSize The size of the file.
+ * @return Whether the section is valid.
+ */
+static bool sectionFits(const indexSection& section, uint64 position, uint64 elementSize, uint64 fileSize) {
+    return section.offset >= position && section.offset % INDEX_ALIGNMENT == 0 && section.bytes % elementSize == 0
+           && section.bytes <= fileSize - std::min(fileSize, section.offset);
+}
+
+/**
+ * Writes the bitvector including all helper structures to a binary index file, which can be loaded again
+ * with load(path) instead of constructing the bitvector and building the helpers. Call this after buildHelpers.
+ * @param path The path of the index file. An existing file is overridden.
+ * @return Whether the file was written successfully.
+ */
+template<typename LAYOUT>
+bool basic_bitvector<LAYOUT>::save(const std::string& path) const {
+    const uint64 scalars[INDEX_SCALAR_COUNT] = { L0SingleBlockData, oneCount, zeroCount, lastOnePos, lastZeroPos, selectSampleShift_0,
+                                                wordCount, INDEX_LAYOUT, backend, selectSampleShift_1 };
+    const std::pair<const void*, uint64> data[INDEX_SECTION_COUNT] = {
+            { scalars, sizeof(scalars) },
+            { vector.data(), vector.size() * sizeof(uint64) },
+            { superBlocks.data(), superBlocks.size() * sizeof(uint64) },
+            { selectSamples_0.data(), selectSamples_0.size() * sizeof(sampleWord) },
+            { selectSamples_1.data(), selectSamples_1.size() * sizeof(sampleWord) },
+            { selectSpill_0.data(), selectSpill_0.size() * sizeof(sampleWord) },
+            { selectSpill_1.data(), selectSpill_1.size() * sizeof(sampleWord) },
+            { sparse.data().data(), sparse.data().size() * sizeof(uint64) },
+            { compressed.data().data(), compressed.data().size() * sizeof(uint64) },
+    };
+
+    // Section table, padded to the alignment, and then the sections one after another.
+    indexSection sections[INDEX_SECTION_COUNT];
+    uint64 offset = alignIndexOffset(sizeof(indexHeader) + sizeof(sections));
+    for (int i = 0; i < INDEX_SECTION_COUNT; ++i) {
+        sections[i] = indexSection { offset, data[i].second };
+        offset = alignIndexOffset(offset + data[i].second);
+    }
+
+    std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) return false;
+
+    static const char padding[INDEX_ALIGNMENT] = {};
+    indexChecksum checksum;
+    auto write = [&out, &checksum](const void* bytes, uint64 length) {
+        out.write((const char*) bytes, (std::streamsize) length);
+        checksum.add(bytes, length);
+    };
+
+    // The checksum is only known at the end, so the header is written twice.
+    indexHeader header {};
+    out.write((const char*) &header, sizeof(header));
+    write(sections, sizeof(sections));
+    write(padding, alignIndexOffset(sizeof(header) + sizeof(sections)) - sizeof(header) - sizeof(sections));
+    for (int i = 0; i < INDEX_SECTION_COUNT; ++i) {
+        write(data[i].first, data[i].second);
+        write(padding, alignIndexOffset(data[i].second) - data[i].second);
+    }
+
+    std::memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version = INDEX_FORMAT_VERSION;
+    header.sectionCount = INDEX_SECTION_COUNT;
+    header.checksum = checksum.value();
+    out.seekp(0);
+    out.write((const char*) &header, sizeof(header));
+    out.close();
+    return !out.fail();
+}
+
+/**
+ * Replaces the contents of this bitvector with an index file written by save(path). The helper structures are loaded
+ * as well, so buildHelpers must not be called afterwards.<br/>
+ * The file is rejected if the magic, version or section table do not match, if the checksum is wrong, or if the
+ * sizes of the helper structures do not fit the bitvector.
+ * In that case, this bitvector is left empty.
+ * @param path The path of the index file.
+ * @return Whether the index was loaded successfully.
+ */
+template<typename LAYOUT>
+bool basic_bitvector<LAYOUT>::load(const std::string& path) {
+    *this = basic_bitvector();
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    if (!in.is_open()) return false;
+
+    in.seekg(0, std::ios::end);
+    auto fileSize = (uint64) in.tellg();
+    in.seekg(0);
+
+    indexHeader header {};
+    indexSection sections[INDEX_SECTION_COUNT];
+    if (!in.read((char*) &header, sizeof(header)) || !headerMatches(header) || !in.read((char*) sections, sizeof(sections))) {
+        return false;
+    }
+
+    indexChecksum checksum;
+    checksum.add(sections, sizeof(sections));
+    uint64 position = sizeof(header) + sizeof(sections);
+
+    // Reads the next section into the given vector, including the padding in front of it.
+    auto readSection = [&](auto& target, const indexSection& section) {
+        using element = typename std::remove_reference_t<decltype(target)>::value_type;
+        if (!sectionFits(section, position, sizeof(element), fileSize)) return false;
+        char padding[INDEX_ALIGNMENT];
+        while (position < section.offset) {
+            uint64 length = std::min<uint64>(section.offset - position, INDEX_ALIGNMENT);
+            if (!in.read(padding, (std::streamsize) length)) return false;
+            checksum.add(padding, length);
+            position += length;
+        }
+        target.resize(section.bytes / sizeof(element));
+        if (!in.read((char*) target.data(), (std::streamsize) section.bytes)) return false;
+        checksum.add(target.data(), section.bytes);
+        position += section.bytes;
+        return true;
+    };
+
+    indexArray<uint64> scalars, sparseData, compressedData;
+    bool valid = readSection(scalars, sections[0])
+            && readSection(vector, sections[1])
+            && readSection(superBlocks, sections[2])
+            && readSection(selectSamples_0, sections[3])
+            && readSection(selectSamples_1, sections[4])
+            && readSection(selectSpill_0, sections[5])
+            && readSection(selectSpill_1, sections[6])
+            && readSection(sparseData, sections[7])
+            && readSection(compressedData, sections[8]);
+
+    // The padding after the last section is part of the checksum, too.
+    if (valid) {
+        char padding[INDEX_ALIGNMENT];
+        uint64 length = alignIndexOffset(position) - position;
+        valid = (bool) in.read(padding, (std::streamsize) length);
+        checksum.add(padding, length);
+    }
+
+    valid = valid && checksum.value() == header.checksum && adoptSections(scalars, std::move(sparseData), std::move(compressedData));
+    if (!valid) {
+        *this = basic_bitvector();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Replaces the contents of this bitvector with an index file written by save(path), like load(path), but without copying
+ * anything. The file is mapped read-only and shared, and all helper structures are used in place, so only the header and
+ * the section table are read right away, and all processes that map the same file share its pages in the page cache.
+ * Copies of this bitvector share the mapping, which is released with the last of them.<br/>
+ * The sizes of the sections are checked like in load(path), the checksum only if asked for, as that reads the whole file.
+ * Like after load(path), buildHelpers must not be called afterwards. Without mmap, the file is loaded instead.
+ * @param path The path of the index file.
+ * @param verify Whether to verify the checksum.
+ * @return Whether the index was mapped successfully.
+ */
+template<typename LAYOUT>
+bool basic_bitvector<LAYOUT>::map(const std::string& path, bool verify) {
+    *this = basic_bitvector();
+    auto file = std::make_shared<inputfile>();
+    if (!file->openShared(path.c_str())) return load(path);
+    std::string_view contents = file->contents();
+
+    indexHeader header {};
+    indexSection sections[INDEX_SECTION_COUNT];
+    if (contents.size() < sizeof(header) + sizeof(sections)) return false;
+    std::memcpy(&header, contents.data(), sizeof(header));
+    std::memcpy(sections, contents.data() + sizeof(header), sizeof(sections));
+    if (!headerMatches(header)) return false;
+    uint64 position = sizeof(header) + sizeof(sections);
+
+    // Points the given array to the next section.
+    auto mapSection = [&](auto& target, const indexSection& section) {
+        using element = typename std::remove_reference_t<decltype(target)>::value_type;
+        if (!sectionFits(section, position, sizeof(element), contents.size())) return false;
+        target.map((const element*) (contents.data() + section.offset), section.bytes / sizeof(element));
+        position = section.offset + section.bytes;
+        return true;
+    };
+
+    indexArray<uint64> scalars, sparseData, compressedData;
+    bool valid = mapSection(scalars, sections[0])
+            && mapSection(vector, sections[1])
+            && mapSection(superBlocks, sections[2])
+            && mapSection(selectSamples_0, sections[3])
+            && mapSection(selectSamples_1, sections[4])
+            && mapSection(selectSpill_0, sections[5])
+            && mapSection(selectSpill_1, sections[6])
+            && mapSection(sparseData, sections[7])
+            && mapSection(compressedData, sections[8]);
+    // The checksum only counts the whole words of every piece it is given, so it is given the same pieces as in load(path):
+    // the section table, and every section with the padding before it in pieces of at most INDEX_ALIGNMENT byte.
+    if (valid && verify) {
+        indexChecksum checksum;
+        checksum.add(sections, sizeof(sections));
+        uint64 end = sizeof(header) + sizeof(sections);
+        auto addPadding = [&](uint64 offset) {
+            for (; end < offset; end += std::min<uint64>(offset - end, INDEX_ALIGNMENT)) {
+                checksum.add(contents.data() + end, std::min<uint64>(offset - end, INDEX_ALIGNMENT));
+            }
+        };
+        for (const indexSection& section : sections) {
+            addPadding(section.offset);
+            checksum.add(contents.data() + section.offset, section.bytes);
+            end += section.bytes;
+        }
+        valid = alignIndexOffset(end) <= contents.size();
+        if (valid) addPadding(alignIndexOffset(end));
+        valid = valid && checksum.value() == header.checksum;
+    }
+
+    valid = valid && adoptSections(scalars, std::move(sparseData), std::move(compressedData));
+    if (!valid) {
+        *this = basic_bitvector();
+        return false;
+    }
+    mapping = std::move(file);
+    return true;
+}
+
+/**
+ * Checks the sections of an index file after load(path) or map(path) put them into the arrays, and takes over the
+ * scalar fields and the data of the backend.
+ * @param scalars The scalar fields.
+ * @param sparseData The Elias-Fano data.
+ * @param compressedData The RRR data.
+ * @return Whether the sections fit this layout and each other.
+ */
+template<typename LAYOUT>
+bool basic_bitvector<LAYOUT>::adoptSections(const indexArray<uint64>& scalars, indexArray<uint64>&& sparseData,
+                                            indexArray<uint64>&& compressedData) {
+    bool valid = scalars.size() == INDEX_SCALAR_COUNT && scalars[7] == INDEX_LAYOUT;
+    if (valid && scalars[8] != BACKEND_PLAIN) {
+        // Only the counts and the data of the backend, which checks its own size.
+        wordCount = scalars[6];
+        backend = (uint8_t) scalars[8];
+        valid = wordCount > 0 && backend <= BACKEND_RRR && vector.empty() && superBlocks.empty()
+                && selectSamples_0.empty() && selectSamples_1.empty() && selectSpill_0.empty() && selectSpill_1.empty();
+        if (backend == BACKEND_RRR) {
+            valid = valid && sparseData.empty() && compressed.assign(wordCount, std::move(compressedData));
+        } else {
+            valid = valid && compressedData.empty()
+                    && sparse.assign(wordCount << 6, backend == BACKEND_SPARSE_ONES ? scalars[1] : scalars[2], std::move(sparseData));
+        }
+    } else if (valid) {
+        wordCount = scalars[6];
+        valid = sparseData.empty() && compressedData.empty();
+        if constexpr (LAYOUT::interleaved) {
+            valid = valid && wordCount > 0 && vector.size() == ((wordCount + 7) >> 3) * RECORD_WORDS && superBlocks.empty();
+        } else {
+            valid = valid && wordCount > 0 && vector.size() == ((wordCount + 7) >> 3) << 3
+                    && superBlocks.size() == ((wordCount >> (SUPERBLOCK_SHIFT - 6)) + 1) * METADATA_WORDS;
+        }
+    }
+    if (valid) {
+        L0SingleBlockData = scalars[0];
+        oneCount = scalars[1];
+        zeroCount = scalars[2];
+        lastOnePos = scalars[3];
+        lastZeroPos = scalars[4];
+        selectSampleShift_0 = scalars[5];
+        selectSampleShift_1 = scalars[9];
+        // One sample per 2^shift ones or zeros and one more at the end, and 32 positions per spilled sample.
+        // Samples that were not built are empty.
+        auto samplesFit = [](const indexArray<sampleWord>& samples, const indexArray<sampleWord>& spill, uint64 shift, uint64 count) {
+            if (shift < MIN_SELECT_SAMPLE_SHIFT || shift > MAX_SELECT_SAMPLE_SHIFT) return false;
+            uint64 sampleCount = (count + (1ULL << shift) - 1) >> shift;
+            if (samples.empty()) return spill.empty();
+            return samples.size() == (sampleCount + 1) * SELECT_SAMPLE_WORDS && spill.size() % (1 << SELECT_SPILL_SHIFT) == 0;
+        };
+        valid = samplesFit(selectSamples_0, selectSpill_0, selectSampleShift_0, zeroCount)
+                && samplesFit(selectSamples_1, selectSpill_1, selectSampleShift_1, oneCount);
+    }
+    return valid;
+}
+
+/**
+ * Checks whether an index file was written by a bitvector with this layout, without loading it. Only the header and
+ * the scalar fields are read, the checksum and the sizes of the helper structures are only verified by load(path).
+ * @param path The path of the index file.
+ * @return Whether load(path) could accept the file with this layout.
+ */
+template<typename LAYOUT>
+bool basic_bitvector<LAYOUT>::indexMatches(const std::string& path) {
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    indexHeader header {};
+    indexSection sections[INDEX_SECTION_COUNT];
+    uint64 scalars[INDEX_SCALAR_COUNT];
+    if (!in.read((char*) &header, sizeof(header))
+        || !headerMatches(header)
+        || !in.read((char*) sections, sizeof(sections))
+        || sections[0].bytes != sizeof(scalars)
+        || !in.seekg((std::streamoff) sections[0].offset)
+        || !in.read((char*) scalars, sizeof(scalars))) {
+        return false;
+    }
+    return scalars[7] == INDEX_LAYOUT;
+}
+
+// ------------------------------------------------------------------------------------------------------------------
+// NUMA placement
+//
+// The copy of the bitvector for another NUMA node, see numaReplicas, is written by a thread pinned to that node, so the
+// kernel puts its pages there on first touch. Its arrays are copied element by element, mapped ones as well, while the
+// copy constructor would keep mapped arrays pointing into the index file.
+// ------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Copies an array into memory of its own, allocated and written by the calling thread.
+ * @param array The array.
+ * @return The copy.
+ */
+template<typename T>
+static indexArray<T> localCopy(const indexArray<T>& array) {
+    return indexArray<T>(array.data(), array.data() + array.size());
+}
+
+/**
+ * Returns an array that maps the memory of another one.
+ * @param array The array, which must outlive the result.
+ * @return The mapped array.
+ */
+template<typename T>
+static indexArray<T> sharedView(const indexArray<T>& array) {
+    indexArray<T> view;
+    view.map(array.data(), array.size());
+    return view;
+}
+
+/**
+ * Moves an array to the given NUMA nodes, if it has a mapping of its own. Smaller arrays share their pages with other
+ * allocations and stay where they are, they are few and mostly in the CPU cache anyway.
+ * @param array The array.
+ * @param nodes The ids of the nodes.
+ */
+template<typename T>
+static void moveArray(const indexArray<T>& array, const std::vector<unsigned int>& nodes) {
+    if (!array.isMapped() && array.reservedBytes() >= HUGE_PAGE_SIZE) moveToNodes(array.data(), array.reservedBytes(), nodes);
+}
+
+/**
+ * Creates a copy of this bitvector in memory written by the calling thread, for the NUMA node it is pinned to.
+ * With sharePlain, only the helper structures are copied, and the copy maps the vector, or the data of another backend,
+ * of this bitvector. This bitvector must outlive the copy then. In the interleaved layout, the rank counters are part of
+ * the vector, so only the select samples are copied.
+ * @param sharePlain Whether to share the vector instead of copying it.
+ * @return The copy.
+ */
+template<typename LAYOUT>
+basic_bitvector<LAYOUT> basic_bitvector<LAYOUT>::replicate(bool sharePlain) const {
+    basic_bitvector copy;
+    copy.L0SingleBlockData = L0SingleBlockData;
+    copy.oneCount = oneCount;
+    copy.zeroCount = zeroCount;
+    copy.lastOnePos = lastOnePos;
+    copy.lastZeroPos = lastZeroPos;
+    copy.selectSampleShift_0 = selectSampleShift_0;
+    copy.selectSampleShift_1 = selectSampleShift_1;
+    copy.wordCount = wordCount;
+    copy.backend = backend;
+    copy.vector = sharePlain ? sharedView(vector) : localCopy(vector);
+    copy.superBlocks = localCopy(superBlocks);
+    copy.selectSamples_0 = localCopy(selectSamples_0);
+    copy.selectSamples_1 = localCopy(selectSamples_1);
+    copy.selectSpill_0 = localCopy(selectSpill_0);
+    copy.selectSpill_1 = localCopy(selectSpill_1);
+    if (backend == BACKEND_RRR) {
+        copy.compressed.assign(wordCount, sharePlain ? sharedView(compressed.data()) : localCopy(compressed.data()));
+    } else if (backend != BACKEND_PLAIN) {
+        copy.sparse.assign(wordCount << 6, backend == BACKEND_SPARSE_ONES ? oneCount : zeroCount,
+                           sharePlain ? sharedView(sparse.data()) : localCopy(sparse.data()));
+    }
+    // Shared arrays of a mapped bitvector point into its index file.
+    copy.mapping = mapping;
+    return copy;
+}
+
+/**
+ * Moves the memory of this bitvector to NUMA nodes, see moveToNodes(...) in numa.cpp. Arrays of a mapped index file
+ * stay in the page cache.
+ * @param plainNodes The nodes of the vector, or of the data of another backend. With several, it is interleaved.
+ * @param helperNodes The nodes of the helper structures.
+ */
+template<typename LAYOUT>
+void basic_bitvector<LAYOUT>::moveToNodes(const std::vector<unsigned int>& plainNodes, const std::vector<unsigned int>& helperNodes) const {
+    moveArray(vector, plainNodes);
+    moveArray(sparse.data(), plainNodes);
+    moveArray(compressed.data(), plainNodes);
+    moveArray(superBlocks, helperNodes);
+    moveArray(selectSamples_0, helperNodes);
+    moveArray(selectSamples_1, helperNodes);
+    moveArray(selectSpill_0, helperNodes);
+    moveArray(selectSpill_1, helperNodes);
+}
+
+// The layouts that can be used. A bitvector with any other layout needs its own line here.
+template class basic_bitvector<standardLayout<>>;
+template class basic_bitvector<standardLayout<11, 16>>;
+template class basic_bitvector<standardLayout<10, 16>>;
+template class basic_bitvector<smallLayout<>>;
+template class basic_bitvector<interleavedLayout<>>;
@@ -1,50 +1,286 @@
 #ifndef BITVECTOR_BITVECTOR_H
 #define BITVECTOR_BITVECTOR_H
 
+#include <array>
+#include <bit>
 #include <cstdint>
 #include <cstdlib>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <span>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include "eliasfano.h"
+#include "indexarray.h"
+#include "inputfile.h"
+#include "rrrvector.h"
 
-#define EVERY_OTHER_1_POS 8192          // Save position of every ~8 thousandth One. Select-cache distance
+#define SELECT_SAMPLE_SHIFT 13          // Save position of every 2^13 = 8192th one and zero by default. Select sample distance
+#define MIN_SELECT_SAMPLE_SHIFT 5       // Every sample needs at least 2^5 ones or zeros for its 32 spill positions.
+#define MAX_SELECT_SAMPLE_SHIFT 32
+#define SELECT_PLAN_WORDS_PER_POINT 8   // Below the default shift, a select budget plans from at most one position per 8 words.
 #define BLOCK_SIZE 512                  // Block size in bit.
 #define L0BLOCK_SIZE 0xFFFFFFFFFFF      // 2^45 - 1, so 44 1s
+#define SMALL_VECTOR_BITS ((1ULL << 32) - BLOCK_SIZE) // Bitvectors shorter than this can use the small layout.
+#define CONSTRUCTION_SLICE_SIZE (1 << 22) // Characters packed before the constructor reports progress. Multiple of 64.
+#define PREFETCH_DISTANCE 16            // Batched queries whose memory is requested before the current one is answered.
+#define FOR_EACH_BATCH_SIZE 256         // Positions for_each_one collects before calling the function for them.
+
+#define SPARSE_DENSITY_SHIFT 5          // Bitvectors with less than 1/2^5 ones or zeros are stored as Elias-Fano by default.
+
+// The select samples buildHelpers builds, see buildOptions. The superblock metadata is always built. Rank needs it,
+// and select uses it to search between two samples.
+#define HELPERS_SELECT_0 1
+#define HELPERS_SELECT_1 2
+#define HELPERS_ALL (HELPERS_SELECT_0 | HELPERS_SELECT_1)
 
 // uint64_t is implementation defined long or long long, which shouldn't be the case
 // but for some reason it can be.
 typedef unsigned long long uint64;
 
 /**
- * The bitvector class, defining all public and private methods.
+ * Tuning knobs for buildHelpers. The defaults are what the program uses without any options.
+ */
+struct buildOptions {
+    // The number of threads, 0 for one per hardware thread.
+    unsigned int threads = 1;
+    // Log2 of the number of ones or zeros per select sample. Smaller values make select faster and use more memory.
+    // Clamped to MIN_SELECT_SAMPLE_SHIFT and MAX_SELECT_SAMPLE_SHIFT, 0 uses the default of the layout.
+    uint8_t selectSampleShift = 0;
+    // The space of the select samples and spill lists of both bit values as a fraction of the vector, 0 for none. With a
+    // budget, the sample shift of every bit value is chosen from its density, see chooseSampleShifts, instead of
+    // selectSampleShift.
+    double selectBudget = 0;
+    // Which select samples to build, HELPERS_SELECT_0 and HELPERS_SELECT_1. 0 builds a bitvector for rank and access only.
+    // A select query for a bit value without samples terminates the program.
+    uint8_t helpers = HELPERS_ALL;
+    // Whether bitvectors with less than 1/2^SPARSE_DENSITY_SHIFT ones or zeros are stored as Elias-Fano over the positions
+    // of the rarer bit value instead. This replaces the vector and all other helpers, and select samples are not needed.
+    bool sparse = true;
+    // Whether to compress the bitvector with RRR instead of the plain layout, unless it is stored as Elias-Fano.
+    // This replaces the vector and all other helpers as well, and makes every query slower.
+    bool compressed = false;
+};
+
+/**
+ * The standard layout of the assisting data structures. The bitvector is split into superblocks of 2^SUPERBLOCK_SHIFT bit,
+ * and those into blocks of 512 bit. Every superblock has 128 bit of metadata in a separate array: the ones before it
+ * in its L0 block in the highest bits, and below them, the ones in the superblock up to and including each of its blocks
+ * except the last one, COUNTER_BITS each.<br/>
+ * Smaller superblocks shorten the search for a block in select, but need more metadata: 3% of the bitvector size for
+ * 4096 bit, 6% for 2048 bit and 12.5% for 1024 bit. Counters of 16 bit are aligned and a little cheaper to decode.
+ * @tparam SUPERBLOCK_SHIFT Log2 of the superblock size in bit, 10 to 12.
+ * @tparam COUNTER_BITS The width of the block counters, at least SUPERBLOCK_SHIFT.
+ * @tparam SAMPLE_SHIFT The default select sample shift.
+ */
+template<uint8_t SUPERBLOCK_SHIFT = 12, uint8_t COUNTER_BITS = SUPERBLOCK_SHIFT, uint8_t SAMPLE_SHIFT = SELECT_SAMPLE_SHIFT>
+struct standardLayout {
+    static_assert(SUPERBLOCK_SHIFT >= 10 && SUPERBLOCK_SHIFT <= 12, "A superblock has 2 to 8 blocks.");
+    static_assert(COUNTER_BITS >= SUPERBLOCK_SHIFT, "A counter must hold the ones of all blocks but the last one.");
+    static_assert(((1 << (SUPERBLOCK_SHIFT - 9)) - 1) * COUNTER_BITS <= 84, "The counters must leave 44 bit for the ones before.");
+    static_assert(SAMPLE_SHIFT >= MIN_SELECT_SAMPLE_SHIFT && SAMPLE_SHIFT <= MAX_SELECT_SAMPLE_SHIFT);
+    static constexpr bool interleaved = false;
+    static constexpr bool small = false;
+    static constexpr uint64 superblockShift = SUPERBLOCK_SHIFT;
+    static constexpr uint64 counterBits = COUNTER_BITS;
+    static constexpr uint64 metadataWords = 2;
+    static constexpr uint8_t selectSampleShift = SAMPLE_SHIFT;
+};
+
+/**
+ * The layout for bitvectors shorter than SMALL_VECTOR_BITS. Every position and count fits into 32 bit, so there is no L0 block
+ * and no branch for it, and the select samples store 32-bit positions. A superblock covers 2048 bit and has a single word of
+ * metadata: the ones before it in the upper 32 bit, and below them the ones in the superblock up to and including its first
+ * three blocks, in counters that are only as wide as their largest value, 10, 11 and 11 bit. This is the same 3% of the
+ * bitvector size as the standard layout, but a rank or a step of the select search reads one word instead of two.
+ * @tparam SAMPLE_SHIFT The default select sample shift.
+ */
+template<uint8_t SAMPLE_SHIFT = SELECT_SAMPLE_SHIFT>
+struct smallLayout {
+    static_assert(SAMPLE_SHIFT >= MIN_SELECT_SAMPLE_SHIFT && SAMPLE_SHIFT <= MAX_SELECT_SAMPLE_SHIFT);
+    static constexpr bool interleaved = false;
+    static constexpr bool small = true;
+    static constexpr uint64 superblockShift = 11;
+    static constexpr uint64 counterBits = 0;
+    static constexpr uint64 metadataWords = 1;
+    static constexpr uint8_t selectSampleShift = SAMPLE_SHIFT;
+};
+
+/**
+ * The interleaved layout, rank9 style. Every 512-bit block is a superblock of its own, and its two counter words are stored
+ * right in front of its 8 words, so a rank touches a single 80-byte record, which is one cache line or two adjacent ones.
+ * The first counter word holds the ones before the block, the second one the ones in the block before words 1 to 7, 9 bit each.
+ * The assisting data structures take 25% of the bitvector size.
+ * @tparam SAMPLE_SHIFT The default select sample shift.
+ */
+template<uint8_t SAMPLE_SHIFT = SELECT_SAMPLE_SHIFT>
+struct interleavedLayout {
+    static_assert(SAMPLE_SHIFT >= MIN_SELECT_SAMPLE_SHIFT && SAMPLE_SHIFT <= MAX_SELECT_SAMPLE_SHIFT);
+    static constexpr bool interleaved = true;
+    static constexpr bool small = false;
+    static constexpr uint64 superblockShift = 9;
+    static constexpr uint64 counterBits = 9;
+    static constexpr uint64 metadataWords = 0;
+    static constexpr uint8_t selectSampleShift = SAMPLE_SHIFT;
+};
+
+/**
+ * The bitvector class, defining all public and private methods. The layout of the assisting data structures is
+ * a template parameter, standardLayout, smallLayout or interleavedLayout. The layouts that can be used are instantiated at the end of
+ * bitvector.cpp, and the program uses the one named bitvector below.
+ * @tparam LAYOUT The layout.
  */
-class bitvector {
+template<typename LAYOUT>
+class basic_bitvector {
 
     // Javadoc-style comments can be found on every method implementation.
 
 public:
-    explicit bitvector(std::string& str);
-    uint16_t access(uint64& ptr);
-    uint64 rank(uint64 ptr, uint8_t& bitValue);
-    uint64 select(uint64& ptr, uint8_t byteValue);
-    void buildHelpers();
-    uint64 size();
+    basic_bitvector();
+    explicit basic_bitvector(std::string_view str, const std::function<void(std::string_view)>& consumed = nullptr);
+    explicit basic_bitvector(std::istream& in);
+    basic_bitvector(indexArray<uint64>&& words, uint64 length);
+    basic_bitvector(std::span<const uint64> words, uint64 length);
+    // All queries are read-only and can be called from many threads at once after buildHelpers.
+    uint16_t access(uint64 ptr) const;
+    uint64 rank(uint64 ptr, uint8_t bitValue) const;
+    uint64 select(uint64 num, uint8_t bitValue) const;
+    void access_batch(const uint64* positions, size_t n, uint64* out) const;
+    void rank_batch(const uint64* positions, size_t n, uint8_t bitValue, uint64* out) const;
+    std::pair<uint64, uint64> rank_pair(uint64 first, uint64 second, uint8_t bitValue) const;
+    void select_batch(const uint64* nums, size_t n, uint8_t bitValue, uint64* out) const;
+    bool hasSelectSamples(uint8_t bitValue) const;
+    uint64 next1(uint64 pos) const;
+    uint64 next0(uint64 pos) const;
+    uint64 prev1(uint64 pos) const;
+    template<typename F> void for_each_one(uint64 begin, uint64 end, F&& f) const;
+    void buildHelpers(const buildOptions& options = {});
+    uint64 size() const;
+    bool save(const std::string& path) const;
+    bool load(const std::string& path);
+    bool map(const std::string& path, bool verify = false);
+    static bool indexMatches(const std::string& path);
+    basic_bitvector replicate(bool sharePlain) const;
+    void moveToNodes(const std::vector<unsigned int>& plainNodes, const std::vector<unsigned int>& helperNodes) const;
 private:
-    uint64 rank_1(uint64& ptr);
-    uint64 superRank(uint64& ptr);
-    uint64 select_0(uint64& num);
-    uint64 select_1(uint64& num);
-    uint64 select_0_iterative(uint64& num, uint64 start, uint64 end);
-    uint64 select_1_iterative(uint64& num, uint64 start, uint64 end);
+    // The constants of the layout. The metadata of a superblock is METADATA_WORDS words and starts with the ones before it,
+    // shifted up by ONES_SHIFT. Below them, block b has a counter with the ones in the superblock before it, for every
+    // block but the first. The counter widths and their bit positions, with the first word as the upper half of 128 bit,
+    // are computed here once. A width of 0 gives the first block a counter that always reads 0.
+    static constexpr uint64 SUPERBLOCK_SHIFT = LAYOUT::superblockShift;
+    static constexpr uint64 BLOCKS_IN_SUPERBLOCK = 1ULL << (SUPERBLOCK_SHIFT - 9);
+    static constexpr uint64 COUNTER_BITS = LAYOUT::counterBits;
+    static constexpr uint64 METADATA_WORDS = LAYOUT::metadataWords;
+    static constexpr std::array<uint8_t, 8> COUNTER_WIDTHS = [] {
+        std::array<uint8_t, 8> widths {};
+        // Without a fixed width, every counter is as wide as the ones of all blocks before it need.
+        for (uint64 block = 1; block < BLOCKS_IN_SUPERBLOCK; ++block) widths[block] = COUNTER_BITS != 0 ? COUNTER_BITS : std::bit_width(block << 9);
+        return widths;
+    }();
+    static constexpr uint64 COUNTER_TOTAL = [] {
+        uint64 total = 0;
+        for (uint8_t width : COUNTER_WIDTHS) total += width;
+        return total;
+    }();
+    static constexpr uint64 ONES_SHIFT = METADATA_WORDS == 1 || COUNTER_TOTAL > 64 ? COUNTER_TOTAL - 64 * (METADATA_WORDS - 1) : 0;
+    static constexpr std::array<uint8_t, 8> COUNTER_POSITIONS = [] {
+        std::array<uint8_t, 8> positions {};
+        uint64 position = 64 + ONES_SHIFT;
+        for (uint64 block = 0; block < 8; ++block) positions[block] = position -= COUNTER_WIDTHS[block];
+        return positions;
+    }();
+    static_assert(METADATA_WORDS != 1 || ONES_SHIFT <= 32, "The ones before a superblock need 32 bit.");
+    // Small bitvectors store the select samples with 32-bit positions.
+    typedef std::conditional_t<LAYOUT::small, uint32_t, uint64> sampleWord;
+
+    void resizeFor(uint64 length);
+    void reserveFor(uint64 length);
+    void packSlice(std::string_view slice, uint64 sliceStart);
+    void clearTail(uint64 length);
+    static uint64 blockCounter(const uint64* metadata, uint64 block);
+    static void packBlockCounter(uint64* metadata, uint64 block, uint64 ones);
+    const uint64* wordPointer(uint64 index) const;
+    uint64 word(uint64 index) const;
+    void prefetchRank(uint64 ptr) const;
+    uint64 rank_1(uint64 ptr) const;
+    uint64 superRank(uint64 superblock) const;
+    uint64 select_0(uint64 num) const;
+    uint64 select_1(uint64 num) const;
+    uint64 select_0_from(uint64 first, uint64 last, uint64 num) const;
+    uint64 select_1_from(uint64 first, uint64 last, uint64 num) const;
+    uint64 select_0_in_superblock(uint64 superblock, uint64 num) const;
+    uint64 select_1_in_superblock(uint64 superblock, uint64 num) const;
+    uint64 select_0_block(uint64 superblock, uint64 num, uint64& remaining) const;
+    uint64 select_1_block(uint64 superblock, uint64 num, uint64& remaining) const;
+    uint64 select_0_words(uint64 wordIndex, uint64 remaining) const;
+    uint64 select_1_words(uint64 wordIndex, uint64 remaining) const;
+    const uint64* metadataPointer(uint64 superblock) const;
+    struct selectState;
+    template<bool ONE> void selectBatch(const uint64* nums, size_t n, uint64* out) const;
+    template<bool ONE> bool selectStep(selectState& state, uint64* out) const;
+    size_t collectOnes(uint64& begin, uint64 end, uint64* out, size_t n) const;
+    std::pair<uint64, uint64> selectSample(const indexArray<sampleWord>& samples, const indexArray<sampleWord>& spill, uint64 shift, uint64 k) const;
+
+    struct helperChunk;
+    void countChunk(helperChunk& chunk);
+    void finishChunk(helperChunk& chunk);
+    void buildSelectSamples(uint8_t bitValue, const std::vector<uint64>& points);
+    std::pair<uint64, uint64> planSelectSamples(const std::vector<uint64>& points, uint64 stride, uint64 lastPos) const;
+    void chooseSampleShifts(std::vector<uint64>& onePoints, std::vector<uint64>& zeroPoints, uint64 budget);
+    void buildSparse(uint8_t bitValue);
+    void buildCompressed();
+    void releasePlain();
+    bool adoptSections(const indexArray<uint64>& scalars, indexArray<uint64>&& sparseData, indexArray<uint64>&& compressedData);
 
     // First, some overhead variables to store metadata about the bitvector.
-    // Secondly, the vector and three helper structures.
+    // Secondly, the vector and the helper structures.
 
     uint64 L0SingleBlockData;
     uint64 oneCount, zeroCount, lastOnePos, lastZeroPos;
-    std::vector<uint64> vector;
-    std::vector<uint64> superBlocks;
-    std::vector<uint32_t> selectCache_0;
-    std::vector<uint32_t> selectCache_1;
+    // Log2 of the zeros and ones per select sample.
+    uint64 selectSampleShift_0, selectSampleShift_1;
+    // The number of 64-bit words of the bitvector. In the standard layout, the vector is padded to whole blocks.
+    uint64 wordCount;
+    indexArray<uint64> vector;
+    indexArray<uint64> superBlocks;
+    indexArray<sampleWord> selectSamples_0, selectSamples_1;
+    indexArray<sampleWord> selectSpill_0, selectSpill_1;
+    // With another backend than the plain one, either the positions of the ones or the zeros, or the compressed
+    // bitvector. Everything above except the counts is empty then.
+    uint8_t backend;
+    eliasfano sparse;
+    rrrvector compressed;
+    // After map(path), the index file that all arrays point into, shared by all copies of the bitvector.
+    std::shared_ptr<const inputfile> mapping;
 };
 
+/**
+ * Calls a function with the position of every 1 in a range, in increasing order. This takes O(n/64 + ones) instead of
+ * a select for every one, and the function is inlined, as the positions are collected in batches.
+ * @param begin The first position of the range.
+ * @param end The end of the range, positions past the last bit are ignored.
+ * @param f The function, called with every position as an uint64.
+ */
+template<typename LAYOUT>
+template<typename F>
+void basic_bitvector<LAYOUT>::for_each_one(uint64 begin, uint64 end, F&& f) const {
+    uint64 positions[FOR_EACH_BATCH_SIZE];
+    while (size_t found = collectOnes(begin, end, positions, FOR_EACH_BATCH_SIZE)) {
+        for (size_t i = 0; i < found; ++i) f(positions[i]);
+    }
+}
+
+// The bitvector the program uses. The compiler flag INTERLEAVED switches it to the interleaved layout.
+#ifdef INTERLEAVED
+typedef basic_bitvector<interleavedLayout<>> bitvector;
+#else
+typedef basic_bitvector<standardLayout<>> bitvector;
+#endif
+// The variant for bitvectors shorter than SMALL_VECTOR_BITS, picked by the program instead of the standard layout.
+typedef basic_bitvector<smallLayout<>> smallBitvector;
+
 #endif
\ No newline at end of file
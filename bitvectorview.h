@@ -0,0 +1,44 @@
+#ifndef BITVECTOR_BITVECTORVIEW_H
+#define BITVECTOR_BITVECTORVIEW_H
+
+#include <string>
+#include "bitvector.h"
+
+/**
+ * A read-only bitvector that answers all queries from a memory mapped index file, see basic_bitvector::map(path).
+ * Opening it copies nothing, and any number of processes that open the same index file share a single copy of it
+ * in the page cache. The queries are the ones of the bitvector, through -> or *.
+ * @tparam LAYOUT The layout the index file was written with.
+ */
+template<typename LAYOUT>
+class basic_bitvector_view {
+
+public:
+    /**
+     * Maps an index file written by save(path) with the same layout.
+     * @param path The path of the index file.
+     * @param verify Whether to verify the checksum, which reads the whole file.
+     * @return Whether the index file was mapped. If not, the view is empty.
+     */
+    bool open(const std::string& path, bool verify = false) { return vect.map(path, verify); }
+
+    /**
+     * Unmaps the index file, unless a copy of the bitvector still uses it.
+     */
+    void close() { vect = basic_bitvector<LAYOUT>(); }
+
+    const basic_bitvector<LAYOUT>& operator*() const { return vect; }
+    const basic_bitvector<LAYOUT>* operator->() const { return &vect; }
+private:
+    basic_bitvector<LAYOUT> vect;
+};
+
+// The views for the index files the program writes, with the layouts of bitvector and smallBitvector.
+#ifdef INTERLEAVED
+typedef basic_bitvector_view<interleavedLayout<>> bitvector_view;
+#else
+typedef basic_bitvector_view<standardLayout<>> bitvector_view;
+#endif
+typedef basic_bitvector_view<smallLayout<>> smallBitvector_view;
+
+#endif
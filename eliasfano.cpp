@@ -0,0 +1,314 @@
+#include "eliasfano.h"
+#include "kernels.h"
+#include <algorithm>
+#include <bit>
+
+/**
+ * Creates an empty sequence with room for count positions, to be filled with push_back and finished with finish().
+ * @param universe All positions are less than this, at least 1.
+ * @param count The number of positions that will be pushed.
+ */
+eliasfano::eliasfano(uint64 universe, uint64 count) {
+    layout(universe, count);
+    words.assign(totalWords, 0);
+}
+
+/**
+ * Computes the number of lower bits and where the parts of the data are, from the universe and count alone.
+ * Both the lower and the upper bits are followed by one word of padding, so a read of two words never leaves its part.
+ * @param universe All positions are less than this, at least 1.
+ * @param count The number of positions.
+ */
+void eliasfano::layout(uint64 universe, uint64 count) {
+    universeSize = universe;
+    this->count = count;
+    pushed = 0;
+    lowBits = std::bit_width(universe / std::max<uint64>(count, 1)) - 1;
+    // Every bucket of 2^lowBits positions ends with a 0, including the one of the position universe itself.
+    uint64 buckets = (universe >> lowBits) + 1;
+    upperBits = count + buckets;
+    upperOffset = ((count * lowBits + 63) >> 6) + 1;
+    oneSamplesOffset = upperOffset + ((upperBits + 63) >> 6) + 1;
+    zeroSamplesOffset = oneSamplesOffset + ((count + (1ULL << SPARSE_SAMPLE_SHIFT) - 1) >> SPARSE_SAMPLE_SHIFT);
+    totalWords = zeroSamplesOffset + ((buckets + (1ULL << SPARSE_SAMPLE_SHIFT) - 1) >> SPARSE_SAMPLE_SHIFT);
+}
+
+/**
+ * Appends the next position. Positions must be pushed in increasing order, and exactly count of them.
+ * @param position The position.
+ */
+void eliasfano::push_back(uint64 position) {
+    uint64 index = pushed++;
+    uint64 low = position & ((1ULL << lowBits) - 1);
+    uint64 bit = index * lowBits;
+    words[bit >> 6] |= low << (bit & 63);
+    // The part that does not fit into the first word. The double shift avoids shifting by 64 if nothing is left.
+    words[(bit >> 6) + 1] |= (low >> 1) >> (63 - (bit & 63));
+
+    uint64 upperBit = (position >> lowBits) + index;
+    words[upperOffset + (upperBit >> 6)] |= 1ULL << (upperBit & 63);
+}
+
+/**
+ * Samples the positions of every 2^SPARSE_SAMPLE_SHIFT-th one and zero in the upper bits, after all positions were pushed.
+ */
+void eliasfano::finish() {
+    uint64* ones = words.data() + oneSamplesOffset;
+    uint64* zeros = words.data() + zeroSamplesOffset;
+    uint64 onesBefore = 0, zerosBefore = 0, nextOne = 0, nextZero = 0;
+
+    for (uint64 w = 0; w < (upperBits + 63) >> 6; ++w) {
+        uint64 oneBits = words[upperOffset + w];
+        // The bits after the last bucket are no zeros.
+        uint64 zeroBits = ~oneBits & (((w + 1) << 6) <= upperBits ? ~0ULL : (1ULL << (upperBits & 63)) - 1);
+        uint64 onesInWord = std::popcount(oneBits), zerosInWord = std::popcount(zeroBits);
+
+        for (; nextOne < onesBefore + onesInWord; nextOne += 1ULL << SPARSE_SAMPLE_SHIFT) {
+            *ones++ = (w << 6) + selectInWord(oneBits, nextOne - onesBefore);
+        }
+        for (; nextZero < zerosBefore + zerosInWord; nextZero += 1ULL << SPARSE_SAMPLE_SHIFT) {
+            *zeros++ = (w << 6) + selectInWord(zeroBits, nextZero - zerosBefore);
+        }
+        onesBefore += onesInWord;
+        zerosBefore += zerosInWord;
+    }
+}
+
+/**
+ * Replaces the sequence with data from data(), for example from an index file.
+ * @param universe All positions are less than this, at least 1.
+ * @param count The number of positions.
+ * @param data The data of a finished sequence with the same universe and count.
+ * @return Whether the counts are possible and the data has the size they require. If not, the sequence is left empty.
+ */
+bool eliasfano::assign(uint64 universe, uint64 count, indexArray<uint64>&& data) {
+    if (universe == 0 || count > universe) {
+        *this = eliasfano();
+        return false;
+    }
+    layout(universe, count);
+    if (data.size() != totalWords) {
+        *this = eliasfano();
+        return false;
+    }
+    words = std::move(data);
+    pushed = count;
+    return true;
+}
+
+/**
+ * Returns the lower bits of the index-th position.
+ * @param index The 0-based index of the position.
+ * @return Its lowest lowBits bits.
+ */
+inline uint64 eliasfano::lower(uint64 index) const {
+    uint64 bit = index * lowBits;
+    uint64 bits = (words[bit >> 6] >> (bit & 63)) | ((words[(bit >> 6) + 1] << 1) << (63 - (bit & 63)));
+    return bits & ((1ULL << lowBits) - 1);
+}
+
+/**
+ * Finds the index-th one or zero of the upper bits. The sample before it is at most 2^SPARSE_SAMPLE_SHIFT ones or zeros
+ * away, which are counted a word at a time. A long run of the other bit value in between, like the ones of a dense
+ * bucket, is skipped with the samples of that value up to the next sample: the last of them with at most index ones or
+ * zeros before it is found by a binary search.
+ * @param index The 0-based number of the one or zero.
+ * @param one Whether to find a one or a zero.
+ * @return Its position in the upper bits.
+ */
+uint64 eliasfano::selectUpper(uint64 index, bool one) const {
+    uint64 oneSamples = zeroSamplesOffset - oneSamplesOffset, zeroSamples = totalWords - zeroSamplesOffset;
+    const uint64* samples = words.data() + (one ? oneSamplesOffset : zeroSamplesOffset);
+    const uint64* otherSamples = words.data() + (one ? zeroSamplesOffset : oneSamplesOffset);
+    uint64 mask = (1ULL << SPARSE_SAMPLE_SHIFT) - 1;
+    uint64 sample = index >> SPARSE_SAMPLE_SHIFT;
+    uint64 position = samples[sample];
+    // The sampled one or zero itself is the first one counted.
+    uint64 remaining = index & mask;
+
+    // The samples of the other value after this sample and before the next one, from the other values before them.
+    uint64 afterSample = (position - (sample << SPARSE_SAMPLE_SHIFT) + mask) >> SPARSE_SAMPLE_SHIFT;
+    uint64 first = afterSample, last = one ? zeroSamples : oneSamples;
+    if (sample + 1 < (one ? oneSamples : zeroSamples)) {
+        last = (samples[sample + 1] - ((sample + 1) << SPARSE_SAMPLE_SHIFT) + mask) >> SPARSE_SAMPLE_SHIFT;
+    }
+    while (first < last) {
+        uint64 middle = first + ((last - first) >> 1);
+        if (otherSamples[middle] - (middle << SPARSE_SAMPLE_SHIFT) <= index) first = middle + 1;
+        else last = middle;
+    }
+    if (first > afterSample) {
+        // That sample is of the other value, so all ones or zeros counted from it come after it.
+        position = otherSamples[first - 1];
+        remaining = index - (position - ((first - 1) << SPARSE_SAMPLE_SHIFT));
+    }
+
+    uint64 w = position >> 6;
+    uint64 bits = (one ? words[upperOffset + w] : ~words[upperOffset + w]) & (~0ULL << (position & 63));
+    for (uint64 inWord = std::popcount(bits); remaining >= inWord; inWord = std::popcount(bits)) {
+        remaining -= inWord;
+        ++w;
+        bits = one ? words[upperOffset + w] : ~words[upperOffset + w];
+    }
+    return (w << 6) + selectInWord(bits, remaining);
+}
+
+/**
+ * Counts the positions of a bucket, which are the run of ones its upper bits start with. Most buckets end in the same
+ * word, longer ones at the 0 that select finds.
+ * @param bucket The bucket.
+ * @param upperPosition The position of the first bit of the bucket in the upper bits.
+ * @return The number of positions in the bucket.
+ */
+inline uint64 eliasfano::bucketSize(uint64 bucket, uint64 upperPosition) const {
+    uint64 zeroBits = ~words[upperOffset + (upperPosition >> 6)] & (~0ULL << (upperPosition & 63));
+    if (zeroBits != 0) [[likely]] return (upperPosition & ~63ULL) + std::countr_zero(zeroBits) - upperPosition;
+    return selectUpper(bucket, false) - upperPosition;
+}
+
+/**
+ * Finds the first of some positions of a bucket whose lower bits are not less than the given ones. The lower bits
+ * increase inside a bucket, so this is a binary search.
+ * @param index The index of the first position of the bucket.
+ * @param n The number of positions to search, all in the bucket.
+ * @param low The lower bits to look for.
+ * @return The index of the first position with lower bits of at least low, or index + n if there is none.
+ */
+inline uint64 eliasfano::lowerBound(uint64 index, uint64 n, uint64 low) const {
+    while (n > 0) {
+        uint64 half = n >> 1;
+        if (lower(index + half) < low) {
+            index += half + 1;
+            n -= half + 1;
+        } else {
+            n = half;
+        }
+    }
+    return index;
+}
+
+/**
+ * Counts the positions less than the given one. The positions before its bucket follow from the 0 that ends the
+ * bucket before, the ones in its bucket are binary searched. At most low of them can be less, as they are distinct.
+ * @param position The position, may be universe or larger.
+ * @return The number of positions before it.
+ */
+uint64 eliasfano::rank(uint64 position) const {
+    if (position >= universeSize) return count;
+    uint64 bucket = position >> lowBits;
+    uint64 upperPosition = bucket == 0 ? 0 : selectUpper(bucket - 1, false) + 1;
+    uint64 index = upperPosition - bucket;
+    uint64 low = position & ((1ULL << lowBits) - 1);
+    return lowerBound(index, std::min(bucketSize(bucket, upperPosition), low), low);
+}
+
+/**
+ * Checks whether the given position is in the sequence, with the same search as rank.
+ * @param position The position.
+ * @return Whether it is in the sequence.
+ */
+bool eliasfano::contains(uint64 position) const {
+    if (position >= universeSize) return false;
+    uint64 bucket = position >> lowBits;
+    uint64 upperPosition = bucket == 0 ? 0 : selectUpper(bucket - 1, false) + 1;
+    uint64 index = upperPosition - bucket;
+    uint64 low = position & ((1ULL << lowBits) - 1);
+    uint64 n = std::min(bucketSize(bucket, upperPosition), low + 1);
+    uint64 found = lowerBound(index, n, low);
+    return found < index + n && lower(found) == low;
+}
+
+/**
+ * Returns the index-th position of the sequence.
+ * @param index The 0-based index, less than count.
+ * @return The position.
+ */
+uint64 eliasfano::select(uint64 index) const {
+    return ((selectUpper(index, true) - index) << lowBits) | lower(index);
+}
+
+/**
+ * Returns consecutive positions of the sequence. Only the first one is selected, the upper bits of the others are the
+ * following ones of the upper bits, which are taken a word at a time by clearing the lowest one.
+ * @param index The 0-based index of the first position.
+ * @param n The number of positions, index + n at most count.
+ * @param out The array for the positions.
+ */
+void eliasfano::selectRange(uint64 index, uint64 n, uint64* out) const {
+    if (n == 0) return;
+    uint64 position = selectUpper(index, true);
+    uint64 w = position >> 6;
+    uint64 bits = words[upperOffset + w] & (~0ULL << (position & 63));
+    for (uint64 i = 0; i < n; ++i, ++index) {
+        while (bits == 0) bits = words[upperOffset + ++w];
+        out[i] = ((((w << 6) + std::countr_zero(bits)) - index) << lowBits) | lower(index);
+        bits &= bits - 1;
+    }
+}
+
+/**
+ * Returns the index-th position that is not in the sequence. Before the end of bucket b, (b + 1) * 2^lowBits minus the
+ * positions up to the 0 that ends it are missing, which never decreases. A binary search over the samples of every
+ * 2^SPARSE_SAMPLE_SHIFT-th 0 finds the last sampled bucket that ends before the missing position, the following 0s
+ * are scanned a word at a time until one ends after it, and the positions inside that bucket are binary searched.
+ * @param index The 0-based number of the missing position, less than universe - count.
+ * @return The missing position.
+ */
+uint64 eliasfano::selectMissing(uint64 index) const {
+    const uint64* zeros = words.data() + zeroSamplesOffset;
+    uint64 first = 0, last = totalWords - zeroSamplesOffset;
+    while (first < last) {
+        uint64 middle = first + ((last - first) >> 1);
+        uint64 sampled = middle << SPARSE_SAMPLE_SHIFT;
+        if (((sampled + 1) << lowBits) - (zeros[middle] - sampled) <= index) first = middle + 1;
+        else last = middle;
+    }
+
+    // The bucket after the last sampled one that ends before the missing position, and where its upper bits start.
+    uint64 bucket = first == 0 ? 0 : ((first - 1) << SPARSE_SAMPLE_SHIFT) + 1;
+    uint64 start = first == 0 ? 0 : zeros[first - 1] + 1;
+    uint64 w = start >> 6;
+    uint64 zeroBits = ~words[upperOffset + w] & (~0ULL << (start & 63));
+    for (;;) {
+        if (zeroBits != 0) {
+            // Whole words are skipped as long as the bucket of their last 0 ends before the missing position.
+            uint64 lastZero = (w << 6) + 63 - std::countl_zero(zeroBits);
+            uint64 lastBucket = bucket + std::popcount(zeroBits) - 1;
+            if (((lastBucket + 1) << lowBits) - (lastZero - lastBucket) > index) break;
+            bucket = lastBucket + 1;
+            start = lastZero + 1;
+        }
+        zeroBits = ~words[upperOffset + ++w];
+    }
+    uint64 end = (w << 6) + std::countr_zero(zeroBits);
+    for (; ((bucket + 1) << lowBits) - (end - bucket) <= index; ++bucket) {
+        start = end + 1;
+        zeroBits &= zeroBits - 1;
+        end = (w << 6) + std::countr_zero(zeroBits);
+    }
+
+    // The positions i of the bucket with lower(i) minus their number before them in the bucket at most the number of
+    // the missing position in the bucket come before it.
+    uint64 positionIndex = start - bucket;
+    uint64 inBucket = index - ((bucket << lowBits) - positionIndex);
+    uint64 before = 0, n = end - start;
+    while (n > 0) {
+        uint64 half = n >> 1;
+        if (lower(positionIndex + before + half) - (before + half) <= inBucket) {
+            before += half + 1;
+            n -= half + 1;
+        } else {
+            n = half;
+        }
+    }
+    return (bucket << lowBits) + inBucket + before;
+}
+
+/**
+ * This calculates how much bit in total the sequence is taking up, including its scalar fields.
+ * @return The space usage in bit.
+ */
+uint64 eliasfano::size() const {
+    // 9 * 64 bit through the universe, counts, lower bits, upper bits and the offsets.
+    return 576 + words.reservedBytes() * 8;
+}
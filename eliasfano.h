@@ -0,0 +1,56 @@
+#ifndef BITVECTOR_ELIASFANO_H
+#define BITVECTOR_ELIASFANO_H
+
+#include <cstddef>
+#include <vector>
+#include "indexarray.h"
+
+// The same type as in bitvector.h, which includes this header.
+typedef unsigned long long uint64;
+
+#define SPARSE_SAMPLE_SHIFT 8           // Every 2^8 = 256th one and zero of the upper bits is sampled for select.
+
+/**
+ * An increasing sequence of positions in [0, universe), stored with the Elias-Fano encoding. The lowest lowBits bits
+ * of every position are stored in a packed array, the remaining upper bits as a unary code: position i sets bit
+ * (position >> lowBits) + i of the upper bits, so every bucket of 2^lowBits positions ends with a 0. With
+ * lowBits = log2(universe / count), this takes about 2 + log2(universe / count) bit per position.<br/>
+ * Select is a sample lookup and a short scan in the upper bits, rank finds the bucket of the position the same way and
+ * then binary searches the lower bits inside it. Select of the missing positions binary searches the samples of the
+ * zeros, which end the buckets.<br/>
+ * All data is in a single vector: the lower bits, the upper bits, the samples of every 2^SPARSE_SAMPLE_SHIFT-th one
+ * and the samples of every 2^SPARSE_SAMPLE_SHIFT-th zero of the upper bits. Its layout follows from universe and count,
+ * so it can be saved and loaded as one block.
+ */
+class eliasfano {
+
+public:
+    eliasfano() = default;
+    eliasfano(uint64 universe, uint64 count);
+
+    void push_back(uint64 position);
+    void finish();
+    bool assign(uint64 universe, uint64 count, indexArray<uint64>&& data);
+
+    // All queries are read-only and can be called from many threads at once after finish.
+    bool contains(uint64 position) const;
+    uint64 rank(uint64 position) const;
+    uint64 select(uint64 index) const;
+    void selectRange(uint64 index, uint64 n, uint64* out) const;
+    uint64 selectMissing(uint64 index) const;
+    uint64 size() const;
+    const indexArray<uint64>& data() const { return words; }
+private:
+    void layout(uint64 universe, uint64 count);
+    uint64 lower(uint64 index) const;
+    uint64 bucketSize(uint64 bucket, uint64 upperPosition) const;
+    uint64 lowerBound(uint64 index, uint64 n, uint64 low) const;
+    uint64 selectUpper(uint64 index, bool one) const;
+
+    uint64 universeSize = 0, count = 0, pushed = 0, lowBits = 0;
+    // The number of bits in the upper part, and the offsets of all parts in words.
+    uint64 upperBits = 0, upperOffset = 0, oneSamplesOffset = 0, zeroSamplesOffset = 0, totalWords = 0;
+    indexArray<uint64> words;
+};
+
+#endif
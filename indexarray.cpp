@@ -0,0 +1,82 @@
+#include "indexarray.h"
+
+#include <cstdint>
+#include <new>
+
+#if __has_include(<sys/mman.h>)
+#define INDEXARRAY_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Returns the memory an allocation of the given size takes in byte. Large allocations are mappings of whole pages, or
+ * of whole huge pages with HUGETLB, small ones take their size like any other allocation on the heap.
+ * @param bytes The size of the allocation.
+ * @return The memory it takes.
+ */
+size_t reservedIndexBytes(size_t bytes) {
+#ifdef INDEXARRAY_MMAP
+    if (bytes >= HUGE_PAGE_SIZE) {
+#ifdef HUGETLB
+        size_t pageSize = HUGE_PAGE_SIZE;
+#else
+        static const auto pageSize = (size_t) sysconf(_SC_PAGESIZE);
+#endif
+        return (bytes + pageSize - 1) & ~(pageSize - 1);
+    }
+#endif
+    return bytes;
+}
+
+/**
+ * Allocates the memory of an array. On large bitvectors, random queries mostly wait for TLB misses, as every word and
+ * superblock they read is on another 4 KiB page. So allocations of at least HUGE_PAGE_SIZE are mapped starting on a
+ * huge page boundary, and the kernel is asked to back them with transparent huge pages, which it does where they are
+ * enabled. With the compiler flag HUGETLB, reserved huge pages are tried first, see the README. Smaller allocations
+ * are only aligned to INDEX_ARRAY_ALIGNMENT.
+ * @param bytes The size of the allocation.
+ * @return The memory, throws std::bad_alloc like operator new if there is none.
+ */
+void* allocateIndexMemory(size_t bytes) {
+#ifdef INDEXARRAY_MMAP
+    if (bytes >= HUGE_PAGE_SIZE) {
+        size_t length = reservedIndexBytes(bytes);
+#if defined(HUGETLB) && defined(MAP_HUGETLB)
+        int hugeFlags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef MAP_HUGE_2MB
+        hugeFlags |= MAP_HUGE_2MB;
+#endif
+        void* huge = mmap(nullptr, length, PROT_READ | PROT_WRITE, hugeFlags, -1, 0);
+        if (huge != MAP_FAILED) return huge;
+#endif
+        // Map one huge page more and unmap the parts before the first huge page boundary and after the allocation.
+        void* mapping = mmap(nullptr, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED) throw std::bad_alloc();
+        auto start = (uintptr_t) mapping;
+        auto aligned = (start + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1);
+        if (aligned > start) munmap(mapping, aligned - start);
+        munmap((void*) (aligned + length), HUGE_PAGE_SIZE - (aligned - start));
+#ifdef MADV_HUGEPAGE
+        madvise((void*) aligned, length, MADV_HUGEPAGE);
+#endif
+        return (void*) aligned;
+    }
+#endif
+    return ::operator new(bytes, std::align_val_t(INDEX_ARRAY_ALIGNMENT));
+}
+
+/**
+ * Frees the memory of an array.
+ * @param memory The memory from allocateIndexMemory(...).
+ * @param bytes The size it was allocated with.
+ */
+void freeIndexMemory(void* memory, size_t bytes) {
+#ifdef INDEXARRAY_MMAP
+    if (bytes >= HUGE_PAGE_SIZE) {
+        munmap(memory, reservedIndexBytes(bytes));
+        return;
+    }
+#endif
+    ::operator delete(memory, std::align_val_t(INDEX_ARRAY_ALIGNMENT));
+}
@@ -0,0 +1,109 @@
+#ifndef BITVECTOR_INDEXARRAY_H
+#define BITVECTOR_INDEXARRAY_H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#define INDEX_ARRAY_ALIGNMENT 64        // Arrays start on a cache line, so a 512-bit block never straddles two of them.
+#define HUGE_PAGE_SIZE (1ULL << 21)     // Arrays of at least 2 MiB are backed by huge pages where the system has them.
+
+void* allocateIndexMemory(size_t bytes);
+void freeIndexMemory(void* memory, size_t bytes);
+size_t reservedIndexBytes(size_t bytes);
+
+/**
+ * The allocator of all arrays of the bitvector, see allocateIndexMemory(...) in indexarray.cpp. It is stateless, so
+ * arrays can be moved into each other without a copy.
+ * @tparam T The element type.
+ */
+template<typename T>
+struct indexAllocator {
+    typedef T value_type;
+
+    indexAllocator() = default;
+    template<typename U> indexAllocator(const indexAllocator<U>&) {}
+
+    T* allocate(size_t n) { return (T*) allocateIndexMemory(n * sizeof(T)); }
+    void deallocate(T* memory, size_t n) { freeIndexMemory(memory, n * sizeof(T)); }
+    template<typename U> bool operator==(const indexAllocator<U>&) const { return true; }
+};
+
+/**
+ * An array with aligned memory on huge pages that can also use memory it does not own, like a section of a memory
+ * mapped index file. Building works on a std::vector inside, with the few methods of it that the bitvector needs. After
+ * map(...), all reads refer to the mapped memory instead, which must stay valid and must not be written to, so a mapped
+ * array is read-only until it is replaced. The vector is not exposed, so no read can reach it instead of the mapping.
+ * Methods that grow the array copy the mapped memory into the vector first, assign, clear and swap replace it.
+ * @tparam T The element type.
+ */
+template<typename T>
+class indexArray {
+    typedef std::vector<T, indexAllocator<T>> storage;
+
+public:
+    typedef T value_type;
+
+    indexArray() = default;
+    explicit indexArray(size_t size) : owned(size) {}
+    indexArray(size_t size, const T& value) : owned(size, value) {}
+    template<typename It> indexArray(It first, It last) : owned(first, last) {}
+
+    /**
+     * Uses the given memory instead of the vector, whose memory is released.
+     * @param data The first element, aligned for T.
+     * @param size The number of elements.
+     */
+    void map(const T* data, size_t size) {
+        storage().swap(owned);
+        mapped = data;
+        mappedSize = size;
+    }
+
+    bool isMapped() const { return mapped != nullptr; }
+    // Writing through a mapped array is not allowed, the mapping is read-only.
+    T* data() { return mapped ? const_cast<T*>(mapped) : owned.data(); }
+    const T* data() const { return mapped ? mapped : owned.data(); }
+    T& operator[](size_t index) { return data()[index]; }
+    const T& operator[](size_t index) const { return data()[index]; }
+    T* begin() { return data(); }
+    T* end() { return data() + size(); }
+    const T* begin() const { return data(); }
+    const T* end() const { return data() + size(); }
+    T& back() { return data()[size() - 1]; }
+    const T& back() const { return data()[size() - 1]; }
+    size_t size() const { return mapped ? mappedSize : owned.size(); }
+    bool empty() const { return size() == 0; }
+    size_t capacity() const { return mapped ? mappedSize : owned.capacity(); }
+    // The memory the array takes in byte, including what the allocator rounds up to whole pages.
+    size_t reservedBytes() const { return mapped ? mappedSize * sizeof(T) : reservedIndexBytes(owned.capacity() * sizeof(T)); }
+
+    void resize(size_t size) { own(); owned.resize(size); }
+    void resize(size_t size, const T& value) { own(); owned.resize(size, value); }
+    void reserve(size_t size) { own(); owned.reserve(size); }
+    void push_back(const T& value) { own(); owned.push_back(value); }
+    void shrink_to_fit() { owned.shrink_to_fit(); }
+    void assign(size_t size, const T& value) { unmap(); owned.assign(size, value); }
+    void clear() { unmap(); owned.clear(); }
+    void swap(indexArray& other) noexcept {
+        owned.swap(other.owned);
+        std::swap(mapped, other.mapped);
+        std::swap(mappedSize, other.mappedSize);
+    }
+private:
+    // The vector takes over the mapped elements, so it can be changed.
+    void own() {
+        if (mapped) owned.assign(mapped, mapped + mappedSize);
+        unmap();
+    }
+    void unmap() {
+        mapped = nullptr;
+        mappedSize = 0;
+    }
+
+    storage owned;
+    const T* mapped = nullptr;
+    size_t mappedSize = 0;
+};
+
+#endif
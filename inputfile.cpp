@@ -0,0 +1,172 @@
+#include "inputfile.h"
+
+#include <fstream>
+
+#if __has_include(<sys/mman.h>)
+#define INPUTFILE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+inputfile::~inputfile() {
+    close();
+}
+
+/**
+ * Opens the file at the given path. If it is a non-empty regular file, it is memory mapped read-only and the
+ * kernel is told that it will be read sequentially. Otherwise, or if mapping fails, the file is read into memory instead.
+ * @param path The path of the file.
+ * @param fallback Whether to read files that cannot be mapped into memory. If not, opening them fails.
+ * @return Whether the file could be opened.
+ */
+bool inputfile::open(const char* path, bool fallback) {
+    close();
+    return mapFile(path, false) || (fallback && readFallback(path));
+}
+
+/**
+ * Opens a file that is read at random positions by many processes at once, like an index file. It is mapped read-only
+ * and shared, so every process uses the same pages of the page cache, and nothing is read ahead. There is no fallback.
+ * @param path The path of the file.
+ * @return Whether the file could be mapped.
+ */
+bool inputfile::openShared(const char* path) {
+    close();
+    return mapFile(path, true);
+}
+
+/**
+ * Maps the file at the given path read-only, if it is a non-empty regular file.
+ * @param path The path of the file.
+ * @param shared Whether to map it shared for random reads, or private for a single sequential read.
+ * @return Whether the file was mapped.
+ */
+bool inputfile::mapFile(const char* path, bool shared) {
+#ifdef INPUTFILE_MMAP
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat info {};
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void* mapping = mmap(nullptr, (size_t) info.st_size, PROT_READ, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            // The file descriptor is no longer needed once the mapping exists.
+            ::close(fd);
+            madvise(mapping, (size_t) info.st_size, shared ? MADV_RANDOM : MADV_SEQUENTIAL);
+            data = (const char*) mapping;
+            length = (size_t) info.st_size;
+            mapped = true;
+            return true;
+        }
+    }
+    ::close(fd);
+#else
+    (void) path;
+    (void) shared;
+#endif
+    return false;
+}
+
+/**
+ * Reads the whole file into the internal buffer using a std::ifstream. This works for pipes as well, since
+ * the file is read in chunks until the end is reached instead of asking for its size.
+ * @param path The path of the file.
+ * @return Whether the file could be opened.
+ */
+bool inputfile::readFallback(const char* path) {
+    std::ifstream inFile(path, std::ios::in | std::ios::binary);
+    if (!inFile.is_open()) return false;
+
+    constexpr size_t chunkSize = 1 << 20;
+    size_t used = 0;
+    do {
+        buffer.resize(used + chunkSize);
+        inFile.read(buffer.data() + used, chunkSize);
+        used += (size_t) inFile.gcount();
+    } while (inFile);
+    buffer.resize(used);
+
+    data = buffer.data();
+    length = buffer.size();
+    mapped = false;
+    return true;
+}
+
+/**
+ * Tells the kernel that a part of the file will not be read again, so the memory of all pages fully inside
+ * the range can be released right away. This is a no-op for files that are not memory mapped.
+ * @param range A range inside the file contents.
+ */
+void inputfile::discard(std::string_view range) {
+#ifdef INPUTFILE_MMAP
+    if (!mapped || range.empty()) return;
+    auto pageSize = (uintptr_t) sysconf(_SC_PAGESIZE);
+    // Round the start up and the end down to page boundaries, partial pages may still be in use.
+    auto from = ((uintptr_t) range.data() + pageSize - 1) & ~(pageSize - 1);
+    auto to = ((uintptr_t) range.data() + range.size()) & ~(pageSize - 1);
+    if (to > from) madvise((void*) from, to - from, MADV_DONTNEED);
+#else
+    (void) range;
+#endif
+}
+
+/**
+ * Unmaps the file or frees the buffer. Views handed out by contents() become invalid.
+ */
+void inputfile::close() {
+#ifdef INPUTFILE_MMAP
+    if (mapped) munmap((void*) data, length);
+#endif
+    std::string().swap(buffer);
+    data = nullptr;
+    length = 0;
+    mapped = false;
+}
+
+/**
+ * Returns whether the bitvector line at the start of the text is at least the given length long, without searching for
+ * its line break. The line only has '0' and '1' until its end, while the queries after it have a space or a line break
+ * at least every 21 characters. So if the LINE_CHECK_CHARACTERS characters before the length are all '0' and '1', they
+ * are still part of the line.
+ * @param text The text, starting with the bitvector line.
+ * @param length The length to compare with.
+ * @return Whether the line has at least length characters '0' and '1'.
+ */
+static bool lineReaches(std::string_view text, size_t length) {
+    if (text.size() < length) return false;
+    for (size_t i = length > LINE_CHECK_CHARACTERS ? length - LINE_CHECK_CHARACTERS : 0; i < length; ++i) {
+        if (text[i] != '0' && text[i] != '1') return false;
+    }
+    return true;
+}
+
+/**
+ * Returns whether the bitvector line at the start of the text is shorter than the given length, so the layout can be
+ * chosen before the line is packed, see lineReaches(...).
+ * @param text The text, starting with the bitvector line.
+ * @param length The length to compare with.
+ * @return Whether the line is shorter than length.
+ */
+bool lineShorterThan(std::string_view text, size_t length) {
+    return !lineReaches(text, length);
+}
+
+/**
+ * Estimates the length of the bitvector line at the start of the text without reading all of it. The line reaches
+ * every length up to its own and none after it, so a binary search finds it with a few dozen checks of
+ * LINE_CHECK_CHARACTERS characters. A trailing \\r is not counted. The estimate is exact for valid input files, but
+ * is only a hint: the constructor still ends the line at its line break.
+ * @param text The text, starting with the bitvector line.
+ * @return The estimated number of '0' and '1' of the line.
+ */
+size_t estimateLineLength(std::string_view text) {
+    size_t low = 0, high = text.size();
+    while (low < high) {
+        size_t middle = low + (high - low + 1) / 2;
+        if (lineReaches(text, middle)) low = middle;
+        else high = middle - 1;
+    }
+    return low;
+}
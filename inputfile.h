@@ -0,0 +1,43 @@
+#ifndef BITVECTOR_INPUTFILE_H
+#define BITVECTOR_INPUTFILE_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#define LINE_CHECK_CHARACTERS 64        // A run of this many '0' and '1' is longer than any number in a query.
+
+bool lineShorterThan(std::string_view text, size_t length);
+size_t estimateLineLength(std::string_view text);
+
+/**
+ * A read-only view of an entire input file. Regular files are memory mapped, so their contents are never
+ * copied into the process. Pipes, character devices and systems without mmap fall back to reading the
+ * file into a buffer with a plain std::ifstream, unless the caller streams such files itself.<br/>
+ * Index files are mapped shared instead, so all processes that map them use the same pages.
+ */
+class inputfile {
+
+public:
+    inputfile() = default;
+    ~inputfile();
+    inputfile(const inputfile&) = delete;
+    inputfile& operator=(const inputfile&) = delete;
+
+    bool open(const char* path, bool fallback = true);
+    bool openShared(const char* path);
+    void close();
+    void discard(std::string_view range);
+    std::string_view contents() const { return { data, length }; }
+    bool isMapped() const { return mapped; }
+private:
+    bool mapFile(const char* path, bool shared);
+    bool readFallback(const char* path);
+
+    const char* data = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    std::string buffer;
+};
+
+#endif
@@ -0,0 +1,131 @@
+#include "instrumentation.h"
+
+#ifdef INSTRUMENT
+#include <bit>
+#include <mutex>
+
+// The names of the events in the JSON line:
+// - select_zero_num, select_past_last: selects answered right away, for num 0 and for num at or past the last one or zero.
+// - select_backend, rank_backend, access_backend: queries answered by the sparse or compressed backend.
+// - select_sampled, select_spilled: sample lookups that found 16-bit offsets or, in sparse regions, the spill list.
+// - select_window_superblocks: the superblocks between both samples of every select, summed up.
+// - select_search_probes: the steps of the binary search between two distant samples.
+// - select_linear_steps: the superblocks walked after the binary search, or between close samples.
+// - select_word_scans: the words counted inside the block of the one or zero.
+static const char* EVENT_NAMES[INSTRUMENT_EVENT_COUNT] = {
+    "select_zero_num", "select_past_last", "select_backend", "select_sampled", "select_spilled",
+    "select_window_superblocks", "select_search_probes", "select_linear_steps", "select_word_scans",
+    "rank_backend", "access_backend"
+};
+static const char* PHASE_NAMES[INSTRUMENT_PHASE_COUNT] = { "parse", "construct", "build", "query", "output" };
+
+static uint64_t phases[INSTRUMENT_PHASE_COUNT];
+static uint64_t events[INSTRUMENT_EVENT_COUNT];
+static latencyHistogram accessLatencies, rankLatencies, selectLatencies;
+static std::mutex mergeMutex;
+
+/**
+ * Adds a latency. Below 8 ns, every nanosecond has its own bucket, above, every power of two is split into 8 buckets.
+ * @param nanoseconds The latency.
+ */
+void latencyHistogram::add(uint64_t nanoseconds) {
+    uint64_t bucket = nanoseconds;
+    if (nanoseconds >= LATENCY_SUB_BUCKETS) {
+        uint64_t exponent = std::bit_width(nanoseconds) - 4;
+        bucket = (exponent + 1) * LATENCY_SUB_BUCKETS + ((nanoseconds >> exponent) & (LATENCY_SUB_BUCKETS - 1));
+    }
+    ++buckets[bucket];
+    ++total;
+    if (nanoseconds > largest) largest = nanoseconds;
+}
+
+/**
+ * Adds all latencies of another histogram.
+ * @param other The other histogram.
+ */
+void latencyHistogram::merge(const latencyHistogram& other) {
+    for (size_t i = 0; i < buckets.size(); ++i) buckets[i] += other.buckets[i];
+    total += other.total;
+    if (other.largest > largest) largest = other.largest;
+}
+
+/**
+ * Returns the latency that the given fraction of all latencies is at most, rounded up to the end of its bucket.
+ * @param fraction The fraction, for example 0.99 for the 99th percentile.
+ * @return The latency in nanoseconds, 0 if the histogram is empty.
+ */
+uint64_t latencyHistogram::percentile(double fraction) const {
+    if (total == 0) return 0;
+    auto wanted = (uint64_t) ((double) total * fraction);
+    if (wanted >= total) wanted = total - 1;
+    uint64_t seen = 0;
+    for (uint64_t bucket = 0; bucket < buckets.size(); ++bucket) {
+        seen += buckets[bucket];
+        if (seen <= wanted) continue;
+        if (bucket < LATENCY_SUB_BUCKETS) return bucket;
+        uint64_t exponent = bucket / LATENCY_SUB_BUCKETS - 1;
+        uint64_t end = ((LATENCY_SUB_BUCKETS + (bucket & (LATENCY_SUB_BUCKETS - 1)) + 1) << exponent) - 1;
+        return end < largest ? end : largest;
+    }
+    return largest;
+}
+
+/**
+ * Records the time of a phase.
+ * @param phase The phase.
+ * @param nanoseconds Its time.
+ */
+void instrumentation::recordPhase(instrumentPhase phase, uint64_t nanoseconds) {
+    phases[phase] = nanoseconds;
+}
+
+/**
+ * Merges the latencies of one thread into the global histograms.
+ * @param access The latencies of access queries.
+ * @param rank The latencies of rank queries.
+ * @param select The latencies of select queries.
+ */
+void instrumentation::mergeLatencies(const latencyHistogram& access, const latencyHistogram& rank, const latencyHistogram& select) {
+    std::lock_guard<std::mutex> lock(mergeMutex);
+    accessLatencies.merge(access);
+    rankLatencies.merge(rank);
+    selectLatencies.merge(select);
+}
+
+/**
+ * Adds the events of the calling thread to the global counts and starts counting its events from 0 again.
+ */
+void instrumentation::mergeEvents() {
+    std::lock_guard<std::mutex> lock(mergeMutex);
+    for (int event = 0; event < INSTRUMENT_EVENT_COUNT; ++event) {
+        events[event] += threadEvents[event];
+        threadEvents[event] = 0;
+    }
+}
+
+/**
+ * Writes all phase times, latency percentiles and event counts as a single line of JSON. The events of the calling
+ * thread are merged first, the other threads must have merged theirs.
+ * @param out The stream to write to.
+ */
+void instrumentation::writeJson(std::ostream& out) {
+    mergeEvents();
+    out << "{\"phases_ns\":{";
+    for (int phase = 0; phase < INSTRUMENT_PHASE_COUNT; ++phase) {
+        out << (phase ? "," : "") << '"' << PHASE_NAMES[phase] << "\":" << phases[phase];
+    }
+    out << "},\"latency_ns\":{";
+    const char* names[] = { "access", "rank", "select" };
+    const latencyHistogram* histograms[] = { &accessLatencies, &rankLatencies, &selectLatencies };
+    for (int i = 0; i < 3; ++i) {
+        const latencyHistogram& h = *histograms[i];
+        out << (i ? "," : "") << '"' << names[i] << "\":{\"count\":" << h.count() << ",\"p50\":" << h.percentile(0.5)
+            << ",\"p99\":" << h.percentile(0.99) << ",\"p999\":" << h.percentile(0.999) << ",\"max\":" << h.max() << '}';
+    }
+    out << "},\"events\":{";
+    for (int event = 0; event < INSTRUMENT_EVENT_COUNT; ++event) {
+        out << (event ? "," : "") << '"' << EVENT_NAMES[event] << "\":" << events[event];
+    }
+    out << "}}" << std::endl;
+}
+#endif
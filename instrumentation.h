@@ -0,0 +1,70 @@
+#ifndef BITVECTOR_INSTRUMENTATION_H
+#define BITVECTOR_INSTRUMENTATION_H
+
+// Instrumented builds, compiled with -DINSTRUMENT, record the latency of every query and count internal events of the
+// select search. They also take all the time measurements of EVAL builds. Without the flag, all of this compiles to nothing.
+#ifdef INSTRUMENT
+#ifndef EVAL
+#define EVAL
+#endif
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+#define LATENCY_SUB_BUCKETS 8           // Buckets per power of two, so every bucket is at most 12.5% wide.
+
+/**
+ * The internal events that are counted, see instrumentation.cpp for what each of them is.
+ */
+enum instrumentEvent {
+    SELECT_ZERO_NUM, SELECT_PAST_LAST, SELECT_BACKEND, SELECT_SAMPLED, SELECT_SPILLED,
+    SELECT_WINDOW_SUPERBLOCKS, SELECT_SEARCH_PROBES, SELECT_LINEAR_STEPS, SELECT_WORD_SCANS,
+    RANK_BACKEND, ACCESS_BACKEND, INSTRUMENT_EVENT_COUNT
+};
+
+/**
+ * The phases of a run whose time is reported.
+ */
+enum instrumentPhase { PHASE_PARSE, PHASE_CONSTRUCT, PHASE_BUILD, PHASE_QUERY, PHASE_OUTPUT, INSTRUMENT_PHASE_COUNT };
+
+/**
+ * A histogram of latencies in nanoseconds with logarithmic buckets, LATENCY_SUB_BUCKETS per power of two.
+ * Every thread fills its own and merges it into the global one at the end.
+ */
+class latencyHistogram {
+
+public:
+    void add(uint64_t nanoseconds);
+    void merge(const latencyHistogram& other);
+    uint64_t percentile(double fraction) const;
+    uint64_t count() const { return total; }
+    uint64_t max() const { return largest; }
+private:
+    std::array<uint64_t, 64 * LATENCY_SUB_BUCKETS> buckets {};
+    uint64_t total = 0, largest = 0;
+};
+
+namespace instrumentation {
+    // The events of the calling thread. Query threads count without sharing a cache line and merge them at the end.
+    inline thread_local uint64_t threadEvents[INSTRUMENT_EVENT_COUNT] = {};
+
+    void recordPhase(instrumentPhase phase, uint64_t nanoseconds);
+    void mergeLatencies(const latencyHistogram& access, const latencyHistogram& rank, const latencyHistogram& select);
+    void mergeEvents();
+    void writeJson(std::ostream& out);
+}
+
+#define INSTRUMENT_COUNT(event) ++instrumentation::threadEvents[event]
+#define INSTRUMENT_ADD(event, value) instrumentation::threadEvents[event] += (value)
+#define INSTRUMENT_PHASE_START(timer) auto timer = std::chrono::steady_clock::now()
+#define INSTRUMENT_PHASE_END(timer, phase) instrumentation::recordPhase(phase, (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - timer).count())
+#else
+#define INSTRUMENT_COUNT(event) ((void) 0)
+#define INSTRUMENT_ADD(event, value) ((void) 0)
+#define INSTRUMENT_PHASE_START(timer) ((void) 0)
+#define INSTRUMENT_PHASE_END(timer, phase) ((void) 0)
+#endif
+
+#endif
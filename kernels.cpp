@@ -0,0 +1,413 @@
+#include "kernels.h"
+
+#include <array>
+#include <bit>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define KERNELS_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define KERNELS_NEON
+#endif
+
+// ------------------------------------------------------------------------------------------------------------------
+// ASCII to packed bits
+//
+// Every kernel turns 64 characters into one 64-bit word, the first character ending up in the lowest bit.
+// Only the lowest bit of each character is used, which is 0 for '0' and 1 for '1'. This way, no comparison
+// and no branch is needed per character. Stray characters like \r must be removed by the caller.
+// ------------------------------------------------------------------------------------------------------------------
+
+typedef void (*packKernel)(const char*, size_t, uint64*);
+
+/**
+ * Packs 8 characters into 8 bit without any branch. Masking keeps only the lowest bit of every byte,
+ * the multiplication then moves the lowest bit of byte i to bit 56 + i, as every byte of the multiplier is a
+ * different power of two and no two products overlap.
+ * @param src The 8 characters.
+ * @return The 8 bit, first character in the lowest bit.
+ */
+static inline uint64 packEightScalar(const char* src) {
+    uint64 chars;
+    std::memcpy(&chars, src, 8);
+    return ((chars & 0x0101010101010101ULL) * 0x0102040810204080ULL) >> 56;
+}
+
+/**
+ * Packs the last up to 63 characters that do not fill an entire word.
+ * @param src The characters.
+ * @param length The number of characters, less than 64.
+ * @return The partial word.
+ */
+static inline uint64 packTail(const char* src, size_t length) {
+    uint64 word = 0;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) word |= packEightScalar(src + i) << i;
+    for (; i < length; ++i) word |= ((uint64) (src[i] & 1)) << i;
+    return word;
+}
+
+/**
+ * Portable fallback, 8 characters per multiplication.
+ */
+[[maybe_unused]] static void packScalar(const char* src, size_t length, uint64* dst) {
+    size_t words = length >> 6;
+    for (size_t w = 0; w < words; ++w, src += 64) {
+        uint64 word = 0;
+        for (int i = 0; i < 8; ++i) word |= packEightScalar(src + (i << 3)) << (i << 3);
+        dst[w] = word;
+    }
+    if (length & 63) dst[words] = packTail(src, length & 63);
+}
+
+#ifdef KERNELS_X86
+/**
+ * SSE2 is part of every x86-64 CPU. Shifting every 64-bit lane left by 7 moves the lowest bit of every byte into
+ * its highest bit, which is exactly what movemask collects. The bits shifted over from the byte below land in the lower
+ * bits and are ignored. 16 characters per movemask.
+ */
+static void packSSE2(const char* src, size_t length, uint64* dst) {
+    size_t words = length >> 6;
+    for (size_t w = 0; w < words; ++w, src += 64) {
+        auto m0 = (uint64) (uint16_t) _mm_movemask_epi8(_mm_slli_epi64(_mm_loadu_si128((const __m128i*) src), 7));
+        auto m1 = (uint64) (uint16_t) _mm_movemask_epi8(_mm_slli_epi64(_mm_loadu_si128((const __m128i*) (src + 16)), 7));
+        auto m2 = (uint64) (uint16_t) _mm_movemask_epi8(_mm_slli_epi64(_mm_loadu_si128((const __m128i*) (src + 32)), 7));
+        auto m3 = (uint64) (uint16_t) _mm_movemask_epi8(_mm_slli_epi64(_mm_loadu_si128((const __m128i*) (src + 48)), 7));
+        dst[w] = m0 | (m1 << 16) | (m2 << 32) | (m3 << 48);
+    }
+    if (length & 63) dst[words] = packTail(src, length & 63);
+}
+
+/**
+ * Same as the SSE2 kernel, but 32 characters per movemask.
+ */
+__attribute__((target("avx2")))
+static void packAVX2(const char* src, size_t length, uint64* dst) {
+    size_t words = length >> 6;
+    for (size_t w = 0; w < words; ++w, src += 64) {
+        auto low = (uint64) (uint32_t) _mm256_movemask_epi8(_mm256_slli_epi64(_mm256_loadu_si256((const __m256i*) src), 7));
+        auto high = (uint64) (uint32_t) _mm256_movemask_epi8(_mm256_slli_epi64(_mm256_loadu_si256((const __m256i*) (src + 32)), 7));
+        dst[w] = low | (high << 32);
+    }
+    if (length & 63) dst[words] = packTail(src, length & 63);
+}
+#endif
+
+#ifdef KERNELS_NEON
+/**
+ * NEON has no movemask. Instead, the lowest bit of every byte is shifted to its position inside its group of 8 bytes,
+ * and three rounds of pairwise additions sum every group of 8 bytes into a single byte, 16 characters per register.
+ */
+static void packNEON(const char* src, size_t length, uint64* dst) {
+    const int8_t shiftValues[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7 };
+    const int8x16_t shifts = vld1q_s8(shiftValues);
+    const uint8x16_t one = vdupq_n_u8(1);
+    size_t words = length >> 6;
+    for (size_t w = 0; w < words; ++w, src += 64) {
+        uint8x16_t m0 = vshlq_u8(vandq_u8(vld1q_u8((const uint8_t*) src), one), shifts);
+        uint8x16_t m1 = vshlq_u8(vandq_u8(vld1q_u8((const uint8_t*) (src + 16)), one), shifts);
+        uint8x16_t m2 = vshlq_u8(vandq_u8(vld1q_u8((const uint8_t*) (src + 32)), one), shifts);
+        uint8x16_t m3 = vshlq_u8(vandq_u8(vld1q_u8((const uint8_t*) (src + 48)), one), shifts);
+        uint8x16_t sums = vpaddq_u8(vpaddq_u8(m0, m1), vpaddq_u8(m2, m3));
+        sums = vpaddq_u8(sums, sums);
+        dst[w] = vgetq_lane_u64(vreinterpretq_u64_u8(sums), 0);
+    }
+    if (length & 63) dst[words] = packTail(src, length & 63);
+}
+#endif
+
+/**
+ * Picks the fastest packing kernel for the current CPU.
+ */
+static packKernel selectPackKernel() {
+#if defined(KERNELS_X86)
+    if (__builtin_cpu_supports("avx2")) return packAVX2;
+    return packSSE2;
+#elif defined(KERNELS_NEON)
+    return packNEON;
+#else
+    return packScalar;
+#endif
+}
+
+/**
+ * Packs ASCII '0' and '1' characters into 64-bit words, the first character in the lowest bit of the first word.
+ * Writes exactly length / 64 rounded up words. The last word is filled with zeros if the length is not a multiple of 64.
+ * @param src The characters, which must all be '0' or '1'.
+ * @param length The number of characters.
+ * @param dst The words to write to.
+ */
+void packAsciiBits(const char* src, size_t length, uint64* dst) {
+    static const packKernel kernel = selectPackKernel();
+    kernel(src, length, dst);
+}
+
+// ------------------------------------------------------------------------------------------------------------------
+// Select inside a 64-bit word
+// ------------------------------------------------------------------------------------------------------------------
+
+/**
+ * For every byte value and every rank, the position of the (rank + 1)-th set bit in that byte, or 8 if there
+ * is none. Indexed with byte | (rank << 8).
+ */
+static constexpr auto selectInByte = [] {
+    std::array<uint8_t, 256 * 8> table {};
+    for (int byte = 0; byte < 256; ++byte) {
+        for (int rank = 0; rank < 8; ++rank) {
+            int seen = 0, position = 8;
+            for (int bit = 0; bit < 8; ++bit) {
+                if (((byte >> bit) & 1) && seen++ == rank) {
+                    position = bit;
+                    break;
+                }
+            }
+            table[byte | (rank << 8)] = (uint8_t) position;
+        }
+    }
+    return table;
+}();
+
+/**
+ * Broadword select by Sebastiano Vigna, without any branch or loop. First, the ones per byte are counted in parallel
+ * and summed up into every byte with one multiplication, so byte i contains the ones in bytes 0 to i. Comparing all
+ * sums against the rank at once, again in parallel, gives the number of bytes before the byte with the wanted one.
+ * Inside that byte, a lookup table finishes the job. Runs on every CPU.
+ */
+uint64 selectInWordBroadword(uint64 word, uint64 rank) {
+    constexpr uint64 onesStep4 = 0x1111111111111111ULL;
+    constexpr uint64 onesStep8 = 0x0101010101010101ULL;
+    constexpr uint64 highStep8 = 0x80ULL * onesStep8;
+
+    uint64 sums = word - ((word & (0xA * onesStep4)) >> 1);
+    sums = (sums & (0x3 * onesStep4)) + ((sums >> 2) & (0x3 * onesStep4));
+    sums = (sums + (sums >> 4)) & (0xF * onesStep8);
+    uint64 byteSums = sums * onesStep8;
+
+    // The highest bit of every byte is set if the ones up to that byte are at most rank.
+    uint64 lessOrEqual = ((rank * onesStep8) | highStep8) - byteSums;
+    lessOrEqual &= highStep8;
+    // Count those bytes with a multiplication instead of a popcount, and turn the count into a bit offset.
+    uint64 place = (((lessOrEqual >> 7) * onesStep8) >> 53) & ~7ULL;
+    uint64 byteRank = rank - (((byteSums << 8) >> place) & 0xFF);
+    return place + selectInByte[((word >> place) & 0xFF) | (byteRank << 8)];
+}
+
+#ifdef KERNELS_X86
+/**
+ * With BMI2, pdep deposits a single one at the position of the (rank + 1)-th set bit of word, and counting the
+ * trailing zeros returns its position.
+ */
+__attribute__((target("bmi,bmi2")))
+static uint64 selectInWordBMI2(uint64 word, uint64 rank) {
+    return _tzcnt_u64(_pdep_u64(1ULL << rank, word));
+}
+#endif
+
+/**
+ * Picks the in-word select for the current CPU. AMD CPUs before Zen 3 support pdep, but implement it in microcode
+ * with a latency depending on the number of set bits, so they are better off with the broadword version.
+ */
+static uint64 (*selectSelectInWord())(uint64, uint64) {
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("bmi2") && !__builtin_cpu_is("znver1") && !__builtin_cpu_is("znver2")) {
+        return selectInWordBMI2;
+    }
+#endif
+    return selectInWordBroadword;
+}
+
+uint64 (*const selectInWord)(uint64 word, uint64 rank) = selectSelectInWord();
+
+// ------------------------------------------------------------------------------------------------------------------
+// Popcount of 512-bit blocks
+//
+// A 512-bit block is 8 words, which is two AVX2 registers, a single AVX-512 register, or four NEON registers. The prefix
+// of a block used by rank is counted by masking the words after the position to zero, not with a loop, so there is no
+// branch that depends on the position.
+// ------------------------------------------------------------------------------------------------------------------
+
+typedef uint64 (*blockPrefixKernel)(const uint64*, uint64);
+typedef void (*blocksKernel)(const uint64*, size_t, uint16_t*);
+
+/**
+ * Portable fallback, one std::popcount per word.
+ */
+[[maybe_unused]] static uint64 popcountBlockPrefixScalar(const uint64* block, uint64 bits) {
+    uint64 fullWords = bits >> 6, sum = 0;
+    for (uint64 i = 0; i < fullWords; ++i) sum += std::popcount(block[i]);
+    return sum + std::popcount(block[fullWords] & ((1ULL << (bits & 63)) - 1));
+}
+
+[[maybe_unused]] static void popcountBlocksScalar(const uint64* blocks, size_t count, uint16_t* ones) {
+    for (size_t b = 0; b < count; ++b, blocks += 8) {
+        uint16_t sum = 0;
+        for (int i = 0; i < 8; ++i) sum += std::popcount(blocks[i]);
+        ones[b] = sum;
+    }
+}
+
+#ifdef KERNELS_X86
+/**
+ * Without -mpopcnt, std::popcount is a library call. Every x86-64 CPU of the last 15 years has the popcnt instruction,
+ * so these are the scalar kernels actually used on CPUs without AVX2.
+ */
+__attribute__((target("popcnt")))
+static uint64 popcountBlockPrefixPopcnt(const uint64* block, uint64 bits) {
+    uint64 fullWords = bits >> 6, sum = 0;
+    for (uint64 i = 0; i < fullWords; ++i) sum += _mm_popcnt_u64(block[i]);
+    return sum + _mm_popcnt_u64(block[fullWords] & ((1ULL << (bits & 63)) - 1));
+}
+
+__attribute__((target("popcnt")))
+static void popcountBlocksPopcnt(const uint64* blocks, size_t count, uint16_t* ones) {
+    for (size_t b = 0; b < count; ++b, blocks += 8) {
+        uint64 sum = 0;
+        for (int i = 0; i < 8; ++i) sum += _mm_popcnt_u64(blocks[i]);
+        ones[b] = (uint16_t) sum;
+    }
+}
+
+/**
+ * Counts the ones of every byte with two table lookups, one per nibble, using pshufb as a 16-entry table (Mula).
+ */
+__attribute__((target("avx2")))
+static inline __m256i popcountBytesAVX2(__m256i v) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowNibbles = _mm256_set1_epi8(0x0F);
+    __m256i low = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, lowNibbles));
+    __m256i high = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), lowNibbles));
+    return _mm256_add_epi8(low, high);
+}
+
+/**
+ * Sums the bytes of both halves of a block. sad against zero adds up 8 bytes each into 4 64-bit lanes.
+ */
+__attribute__((target("avx2")))
+static inline uint64 sumBlockAVX2(__m256i first, __m256i second) {
+    __m256i sums = _mm256_sad_epu8(_mm256_add_epi8(popcountBytesAVX2(first), popcountBytesAVX2(second)), _mm256_setzero_si256());
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+    return (uint64) _mm_cvtsi128_si64(half) + (uint64) _mm_extract_epi64(half, 1);
+}
+
+/**
+ * Mask for 4 words starting at firstWord, keeping the first bits bits of the block. Words before the word of the position
+ * are kept entirely, the word of the position partially, and all words after it are cleared.
+ */
+__attribute__((target("avx2")))
+static inline __m256i prefixMaskAVX2(uint64 bits, long long firstWord) {
+    const __m256i index = _mm256_setr_epi64x(firstWord, firstWord + 1, firstWord + 2, firstWord + 3);
+    const __m256i positionWord = _mm256_set1_epi64x((long long) (bits >> 6));
+    __m256i before = _mm256_cmpgt_epi64(positionWord, index);
+    __m256i partial = _mm256_and_si256(_mm256_cmpeq_epi64(positionWord, index), _mm256_set1_epi64x((long long) ((1ULL << (bits & 63)) - 1)));
+    return _mm256_or_si256(before, partial);
+}
+
+__attribute__((target("avx2")))
+static uint64 popcountBlockPrefixAVX2(const uint64* block, uint64 bits) {
+    __m256i first = _mm256_and_si256(_mm256_loadu_si256((const __m256i*) block), prefixMaskAVX2(bits, 0));
+    __m256i second = _mm256_and_si256(_mm256_loadu_si256((const __m256i*) (block + 4)), prefixMaskAVX2(bits, 4));
+    return sumBlockAVX2(first, second);
+}
+
+__attribute__((target("avx2")))
+static void popcountBlocksAVX2(const uint64* blocks, size_t count, uint16_t* ones) {
+    for (size_t b = 0; b < count; ++b, blocks += 8) {
+        ones[b] = (uint16_t) sumBlockAVX2(_mm256_loadu_si256((const __m256i*) blocks), _mm256_loadu_si256((const __m256i*) (blocks + 4)));
+    }
+}
+
+// GCC 12 fills the unused operands of the AVX-512 reductions with deliberately uninitialized registers in its own headers.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+/**
+ * With VPOPCNTDQ, a block is a single register and a single popcount. The words after the word of the position are
+ * masked away with a mask register, and the word of the position itself with a masked and.
+ */
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static uint64 popcountBlockPrefixAVX512(const uint64* block, uint64 bits) {
+    __m512i words = _mm512_loadu_si512(block);
+    auto positionWord = (unsigned int) (bits >> 6);
+    __m512i masked = _mm512_maskz_mov_epi64((__mmask8) ((1U << positionWord) - 1), words);
+    masked = _mm512_mask_and_epi64(masked, (__mmask8) (1U << positionWord), words, _mm512_set1_epi64((long long) ((1ULL << (bits & 63)) - 1)));
+    return (uint64) _mm512_reduce_add_epi64(_mm512_popcnt_epi64(masked));
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static void popcountBlocksAVX512(const uint64* blocks, size_t count, uint16_t* ones) {
+    for (size_t b = 0; b < count; ++b, blocks += 8) {
+        ones[b] = (uint16_t) _mm512_reduce_add_epi64(_mm512_popcnt_epi64(_mm512_loadu_si512(blocks)));
+    }
+}
+#pragma GCC diagnostic pop
+#endif
+
+#ifdef KERNELS_NEON
+/**
+ * vcnt counts the ones of every byte. The four registers of a block are masked like in the AVX2 kernel, and one
+ * horizontal add sums up all bytes at the end.
+ */
+static uint64 popcountBlockPrefixNEON(const uint64* block, uint64 bits) {
+    const uint64x2_t positionWord = vdupq_n_u64(bits >> 6);
+    const uint64x2_t partialMask = vdupq_n_u64((1ULL << (bits & 63)) - 1);
+    const uint64 firstIndices[2] = { 0, 1 };
+    uint64x2_t index = vld1q_u64(firstIndices);
+    uint8x16_t bytes = vdupq_n_u8(0);
+    for (int i = 0; i < 4; ++i, index = vaddq_u64(index, vdupq_n_u64(2))) {
+        uint64x2_t mask = vorrq_u64(vcltq_u64(index, positionWord), vandq_u64(vceqq_u64(index, positionWord), partialMask));
+        uint64x2_t words = vandq_u64(vld1q_u64(block + 2 * i), mask);
+        bytes = vaddq_u8(bytes, vcntq_u8(vreinterpretq_u8_u64(words)));
+    }
+    return vaddlvq_u8(bytes);
+}
+
+static void popcountBlocksNEON(const uint64* blocks, size_t count, uint16_t* ones) {
+    for (size_t b = 0; b < count; ++b, blocks += 8) {
+        uint8x16_t bytes = vcntq_u8(vld1q_u8((const uint8_t*) blocks));
+        for (int i = 1; i < 4; ++i) bytes = vaddq_u8(bytes, vcntq_u8(vld1q_u8((const uint8_t*) (blocks + 2 * i))));
+        ones[b] = vaddlvq_u8(bytes);
+    }
+}
+#endif
+
+/**
+ * Picks the block prefix popcount for the current CPU, VPOPCNTDQ before AVX2 before the popcnt instruction. Early
+ * x86-64 CPUs have none of them and use the portable kernel.
+ */
+static blockPrefixKernel selectPopcountBlockPrefix() {
+#if defined(KERNELS_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) return popcountBlockPrefixAVX512;
+    if (__builtin_cpu_supports("avx2")) return popcountBlockPrefixAVX2;
+    if (__builtin_cpu_supports("popcnt")) return popcountBlockPrefixPopcnt;
+    return popcountBlockPrefixScalar;
+#elif defined(KERNELS_NEON)
+    return popcountBlockPrefixNEON;
+#else
+    return popcountBlockPrefixScalar;
+#endif
+}
+
+/**
+ * Picks the bulk block popcount for the current CPU, in the same order.
+ */
+static blocksKernel selectPopcountBlocks() {
+#if defined(KERNELS_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) return popcountBlocksAVX512;
+    if (__builtin_cpu_supports("avx2")) return popcountBlocksAVX2;
+    if (__builtin_cpu_supports("popcnt")) return popcountBlocksPopcnt;
+    return popcountBlocksScalar;
+#elif defined(KERNELS_NEON)
+    return popcountBlocksNEON;
+#else
+    return popcountBlocksScalar;
+#endif
+}
+
+uint64 (*const popcountBlockPrefix)(const uint64* block, uint64 bits) = selectPopcountBlockPrefix();
+void (*const popcountBlocks)(const uint64* blocks, size_t count, uint16_t* ones) = selectPopcountBlocks();
@@ -0,0 +1,22 @@
+#ifndef BITVECTOR_KERNELS_H
+#define BITVECTOR_KERNELS_H
+
+#include <cstddef>
+#include "bitvector.h"
+
+// Hardware specific implementations of hot loops. Every kernel has a portable scalar fallback, the fastest
+// implementation supported by the CPU the program runs on is chosen at runtime, so one binary runs everywhere.
+
+void packAsciiBits(const char* src, size_t length, uint64* dst);
+
+// Position of the (rank + 1)-th set bit in word, rank is 0-based and must be less than the number of set bits.
+// Selected once at startup, so calling it costs one indirect call and no feature check.
+extern uint64 (*const selectInWord)(uint64 word, uint64 rank);
+uint64 selectInWordBroadword(uint64 word, uint64 rank);
+
+// Number of ones in the first bits bits of a 512-bit block, bits less than 512. All 8 words of the block must be readable.
+extern uint64 (*const popcountBlockPrefix)(const uint64* block, uint64 bits);
+// Number of ones in each of count consecutive 512-bit blocks.
+extern void (*const popcountBlocks)(const uint64* blocks, size_t count, uint16_t* ones);
+
+#endif
@@ -1,20 +1,49 @@
+#include <charconv>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
-#include <regex>
+#include <limits>
+#include <sstream>
 #include <chrono>
+#include <string_view>
 #include "bitvector.h"
+#include "inputfile.h"
+#include "instrumentation.h"
+#include "numa.h"
+#include "queryparser.h"
+#include "queryprocessor.h"
+#include "queryserver.h"
+#include "resultwriter.h"
 
 using std::string;
 
-struct command {
-    char cmd;
-    uint8_t bitValue;
-    uint64 position, reply;
+/**
+ * Command line options that are not positional. All options start with two dashes and may appear anywhere.
+ */
+struct options {
+    bool strict = false;
+    buildOptions build;
+    unsigned int queryThreads = 1;
+    numaMode numa = NUMA_OFF;
+    bool reorder = false;
+    const char* loadIndex = nullptr;
+    const char* saveIndex = nullptr;
+    bool serve = false;
+    const char* socketPath = nullptr;
 };
 
-command getCommand(string&);
-void processCommand(command&, bitvector&);
+int parseOptions(int argc, char** argv, options& opts, std::vector<char*>& positional);
+int serve(const options& opts, const std::vector<char*>& args);
+bool readCount(int argc, char** argv, int& i, unsigned int& value);
+std::string_view nextLine(std::string_view& rest);
+std::string_view nextLine(std::string_view& rest, inputfile& file);
+template<typename BV>
+int runMapped(const options& opts, const std::vector<char*>& args, inputfile& inFile, std::string_view rest, uint64 cmdCount);
+template<typename BV>
+int runStream(const options& opts, const std::vector<char*>& args, std::istream& in, uint64 cmdCount);
+template<typename BV>
+int run(const options& opts, const std::vector<char*>& args, BV& vect, std::vector<command>& commands);
 
 /**
  * This is the main entry point of the bitvector. Please provide the relative filepath for the input file as the first
@@ -22,78 +51,207 @@ void processCommand(command&, bitvector&);
  * <p/>
  * If the file is not a proper input file, the program will run into errors and undefined behavior, so, don't do that.
  * <p/>
- * First, the file is opened and read. A bitvector skeleton is created
- * (no helper structures), and the commands are read and parsed into command structs. This provides faster access later.
+ * First, the file is opened and memory mapped. A bitvector skeleton is created (no helper structures), and the commands
+ * are read and parsed into command structs. This provides faster access later. Files that cannot be mapped, like pipes,
+ * are streamed instead: the bitvector is packed while its line is read, and only the query section is read into memory.
  * <p/>
  * Then, the timer starts and helpers are created. In evaluation builds, a second timer is started to measure only query
  * time. All commands are processed and answered, writing their result in the command's reply property. After the timer
  * is stopped, all replies are printed and the RESULT and EVAL, if set, are printed after.
+ * <p/>
+ * Bitvectors shorter than SMALL_VECTOR_BITS use the small layout, which needs no L0 level and only half of the metadata.
+ * The layout of a prebuilt index is taken from the file. Streamed bitvectors always use the standard layout, their
+ * length is only known once they are read.
  * @param argc The number of arguments.
  * @param argv The command line arguments.
  * @return
  */
 int main(int argc, char** argv) {
-    if (argc < 2) {
+    options opts;
+    std::vector<char*> args;
+    if (int code = parseOptions(argc, argv, opts, args)) return code;
+    if (opts.serve) return serve(opts, args);
+
+    if (args.empty()) {
         std::cerr << "Please input a file to open in the first command line argument." << std::endl;
         return 1;
     }
 #ifndef CONSOLE
-    if (argc < 3) {
+    if (args.size() < 2) {
         std::cerr << "Please define an output file in the second command line argument or compile with the -DCONSOLE flag." << std::endl;
         return 2;
     }
 #endif
 
-    std::ifstream inFile(argv[1]);
-    if (!inFile.is_open()) {
-        std::cerr << "Could not open file " << argv[1] << std::endl;
-        return 3;
+    uint64 cmdCount = 0;
+    inputfile inFile;
+    if (!inFile.open(args[0], false)) {
+        std::ifstream in(args[0], std::ios::in | std::ios::binary);
+        if (!in.is_open()) {
+            std::cerr << "Could not open file " << args[0] << std::endl;
+            return 3;
+        }
+        std::string line;
+        std::getline(in, line);
+        std::from_chars(line.data(), line.data() + line.size(), cmdCount);
+#ifdef INTERLEAVED
+        return runStream<bitvector>(opts, args, in, cmdCount);
+#else
+        bool small = opts.loadIndex != nullptr && smallBitvector::indexMatches(opts.loadIndex);
+        return small ? runStream<smallBitvector>(opts, args, in, cmdCount)
+                     : runStream<bitvector>(opts, args, in, cmdCount);
+#endif
     }
 
-    uint64 cmdCount;
-    string line, vectorStr;
-    std::vector<command> commands;
-
-    // We assume that there is definitely a command count and a bitvector.
-    std::getline(inFile, line);
-    std::getline(inFile, vectorStr);
+    // We assume that there is definitely a command count and a bitvector. Both are views into the file,
+    // nothing is copied. The bitvector line is only searched while it is packed, see runMapped.
+    std::string_view rest = inFile.contents();
+    std::string_view line = nextLine(rest);
     // line should contain command count
-    cmdCount = std::stoll(line);
-    // Read all commands:
-    commands.reserve(cmdCount);
-    for (int i = 0; i < cmdCount; ++i) {
-        std::getline(inFile, line);
-        commands.emplace_back(getCommand(line));
+    std::from_chars(line.data(), line.data() + line.size(), cmdCount);
+
+#ifdef INTERLEAVED
+    return runMapped<bitvector>(opts, args, inFile, rest, cmdCount);
+#else
+    bool small = opts.loadIndex == nullptr ? lineShorterThan(rest, SMALL_VECTOR_BITS) : smallBitvector::indexMatches(opts.loadIndex);
+    return small ? runMapped<smallBitvector>(opts, args, inFile, rest, cmdCount)
+                 : runMapped<bitvector>(opts, args, inFile, rest, cmdCount);
+#endif
+}
+
+/**
+ * Constructs the bitvector with the given layout from the mapped input file, then parses the query section after it
+ * and runs the commands on it.
+ * @param opts The command line options.
+ * @param args The positional arguments.
+ * @param inFile The input file, which is closed after the queries are parsed.
+ * @param rest The input file from the bitvector line on.
+ * @param cmdCount The command count from the first line.
+ * @return The exit code.
+ */
+template<typename BV>
+int runMapped(const options& opts, const std::vector<char*>& args, inputfile& inFile, std::string_view rest, uint64 cmdCount) {
+    // Create Basic Bitvector without helper structures. It ends at the line break, which the constructor finds
+    // while packing. Every packed slice of the vector line is released right away, so the ASCII line and the packed
+    // words are never in memory in full at the same time, and the line is read only once.
+    // With a prebuilt index, the vector line is only skipped and everything is loaded inside the measured time instead.
+    INSTRUMENT_PHASE_START(constructStart);
+    BV vect;
+    if (opts.loadIndex == nullptr) {
+        size_t lineLength = 0;
+        vect = BV(rest, [&inFile, &lineLength](std::string_view slice) {
+            inFile.discard(slice);
+            lineLength += slice.size();
+        });
+        rest.remove_prefix(lineLength < rest.size() ? lineLength + 1 : lineLength);
+    } else {
+        nextLine(rest, inFile);
     }
+    INSTRUMENT_PHASE_END(constructStart, PHASE_CONSTRUCT);
+
+    // The rest of the file is the query section, which is parsed in place. Afterwards, the input is not needed
+    // anymore, so release the mapping before the helper structures are allocated.
+    INSTRUMENT_PHASE_START(parseStart);
+    std::vector<command> commands;
+    parseResult parsed = parseCommands(rest.data(), rest.data() + rest.size(), cmdCount, commands, opts.strict);
     inFile.close();
+    if (!parsed.ok) {
+        std::cerr << "Malformed query in line " << parsed.line << ": " << parsed.message << std::endl;
+        return 6;
+    }
+    INSTRUMENT_PHASE_END(parseStart, PHASE_PARSE);
+    return run(opts, args, vect, commands);
+}
+
+/**
+ * Constructs the bitvector with the given layout from a stream positioned at the bitvector line, then reads and parses
+ * the query section and runs the commands on it. The bitvector line is never in memory as text.
+ * @param opts The command line options.
+ * @param args The positional arguments.
+ * @param in The stream.
+ * @param cmdCount The command count from the first line.
+ * @return The exit code.
+ */
+template<typename BV>
+int runStream(const options& opts, const std::vector<char*>& args, std::istream& in, uint64 cmdCount) {
+    INSTRUMENT_PHASE_START(constructStart);
+    BV vect;
+    if (opts.loadIndex == nullptr) vect = BV(in);
+    else in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    INSTRUMENT_PHASE_END(constructStart, PHASE_CONSTRUCT);
 
-    // Create Basic Bitvector without helper structures
-    bitvector bitvector(vectorStr);
+    INSTRUMENT_PHASE_START(parseStart);
+    std::string rest;
+    {
+        std::ostringstream queries;
+        if (in.peek() != std::char_traits<char>::eof()) queries << in.rdbuf();
+        rest = std::move(queries).str();
+    }
+    std::vector<command> commands;
+    parseResult parsed = parseCommands(rest.data(), rest.data() + rest.size(), cmdCount, commands, opts.strict);
+    if (!parsed.ok) {
+        std::cerr << "Malformed query in line " << parsed.line << ": " << parsed.message << std::endl;
+        return 6;
+    }
+    std::string().swap(rest);
+    INSTRUMENT_PHASE_END(parseStart, PHASE_PARSE);
+    return run(opts, args, vect, commands);
+}
 
+/**
+ * Everything after constructing the bitvector: builds its helpers or loads it, answers the commands and writes the
+ * replies and the result line.
+ * @param opts The command line options.
+ * @param args The positional arguments.
+ * @param vect The bitvector without helper structures.
+ * @param commands The parsed commands.
+ * @return The exit code.
+ */
+template<typename BV>
+int run(const options& opts, [[maybe_unused]] const std::vector<char*>& args, BV& vect, std::vector<command>& commands) {
     // Start the timer
     auto start = std::chrono::high_resolution_clock::now();
-    bitvector.buildHelpers();
+    if (opts.loadIndex == nullptr) {
+        vect.buildHelpers(opts.build);
+    } else if (!vect.load(opts.loadIndex)) {
+        std::cerr << "Could not load the index file " << opts.loadIndex << ", it is missing, corrupt or from another version." << std::endl;
+        return 8;
+    }
+    numaReplicas<BV> replicas;
+    replicas.build(vect, opts.numa);
     auto querystart = std::chrono::high_resolution_clock::now();
 
-    for (auto& cmd : commands) {
-        processCommand(cmd, bitvector);
-    }
+    if (opts.reorder) processReordered(commands, replicas, opts.queryThreads);
+    else processCommands(commands, replicas, opts.queryThreads);
 
     auto stop = std::chrono::high_resolution_clock::now();
     auto time = duration_cast<std::chrono::milliseconds>(stop - start);
 #ifdef EVAL
     auto querytime = duration_cast<std::chrono::nanoseconds>(stop - querystart);
 #endif
-    auto space = bitvector.size();
+#ifdef INSTRUMENT
+    instrumentation::recordPhase(PHASE_BUILD, duration_cast<std::chrono::nanoseconds>(querystart - start).count());
+    instrumentation::recordPhase(PHASE_QUERY, querytime.count());
+#endif
+    auto space = vect.size();
+
+    if (opts.saveIndex != nullptr && !vect.save(opts.saveIndex)) {
+        std::cerr << "Could not write the index file " << opts.saveIndex << "." << std::endl;
+        return 9;
+    }
 
+    INSTRUMENT_PHASE_START(outputStart);
 #ifdef CONSOLE
-    for (auto cmd : commands) {
-        std::cout << cmd.reply << std::endl;
+    {
+        resultwriter writer(stdout);
+        for (const auto& cmd : commands) {
+            writer.write(cmd.reply);
+        }
     }
 #else
     // We definitely have an argument here, create the file, write all outputs, flush, save and close it.
     // This is asserted above.
-    std::string filename = argv[2];
+    std::string filename = args[1];
 
     // Create the directory if it does not exist
     std::filesystem::path filePath(filename);
@@ -106,84 +264,205 @@ int main(int argc, char** argv) {
     }
 
     // (Create and) Open the file
-    std::ofstream outFile(filename, std::ios::out | std::ios::trunc);
+    std::FILE* outFile = std::fopen(filename.c_str(), "wb");
 
     // See if the file was opened
-    if (outFile.is_open()) {
+    if (outFile != nullptr) {
+        resultwriter writer(outFile);
         for (const auto& cmd : commands) {
-            outFile << cmd.reply << std::endl;
+            writer.write(cmd.reply);
+        }
+        bool written = writer.flush();
+        if (std::fclose(outFile) != 0 || !written) {
+            std::cerr << "Could not write the output file " << filename << "." << std::endl;
+            return 4;
         }
-        outFile.flush();
-        outFile.close();
     } else {
         std::cerr << "Could not open the output file " << filename << "." << std::endl;
         return 4;
     }
 #endif
 
+    INSTRUMENT_PHASE_END(outputStart, PHASE_OUTPUT);
     std::cout << "RESULT name=just1developer time=" << time.count() << " space=" << space << std::endl;
 #ifdef EVAL
     std::cout << "EVAL query-only-time=" << querytime.count() << std::endl;
+#endif
+#ifdef INSTRUMENT
+    instrumentation::writeJson(std::cout);
 #endif
     return 0;
 }
 
 /**
- * Creates a new command struct from a string. Valid Commands are \<access | rank | select> \<first number> [second number],
- * In the format provided by Florian Kurpicz:<br/>
- * - access <index><br/>
- * - rank <0/1> <position><br/>
- * - select <0/1> <number><br/>
- * If an invalid command string is provided returns the default command of access 0 [0].
- * @param cmd The command as read from the file. If on windows, may contain trailing \\r.
- * @return A command struct representing the given command.
+ * Runs the query server instead of a single input file, see queryserver. Every positional argument NAME=PATH builds
+ * the bitvector of the input file at PATH under NAME before the first session, a plain PATH uses the path as its name.
+ * Sessions run on stdin and stdout, or on the connections of the socket given with --socket.
+ * @param opts The command line options.
+ * @param args The positional arguments.
+ * @return The exit code.
  */
-command getCommand(string& cmd) {
-    // \r? is to allow the \r which windows has in addition to \n in the line breaks
-    // This regex parses all valid / allowed commands. If access theoretically has two arguments, it would be allowed but ignored.
-    std::regex pattern(R"(^(\baccess\b|\brank\b|\bselect\b) (\d+)(?: (\d+))?\r?$)");
-    std::smatch matches;
-
-    // Even though it should be a valid query, place an if to be safe
-    if (std::regex_search(cmd, matches, pattern)) {
-        char commandChar = matches[1].str()[0];
-        uint8_t bitValue;
-        uint64 position;
-
-        // Single argument command
-        if (commandChar == 'a') {
-            position = (uint64) std::stoll(matches[2].str());
-            return command { commandChar, 0, position };
-        } else {
-            // Two arguments, where first one is only 0 or 1.
-            bitValue = (char) std::stoi(matches[2].str());
-            position = (int) (matches.size() > 3 && matches[3].matched ? std::stoll(matches[3].str()) : 0 /* :) */);
+int serve(const options& opts, const std::vector<char*>& args) {
+    queryserver server(opts.build, opts.queryThreads, opts.strict);
+    for (const char* arg : args) {
+        std::string_view spec = arg;
+        size_t separator = spec.find('=');
+        std::string name(spec.substr(0, separator));
+        const char* path = separator == std::string_view::npos ? arg : arg + separator + 1;
+        std::string error;
+        if (!server.build(name, path, error)) {
+            std::cerr << "Could not build " << name << " from " << path << ": " << error << std::endl;
+            return 3;
+        }
+    }
+    if (opts.socketPath != nullptr) return server.listen(opts.socketPath) ? 0 : 10;
+    server.serve(stdin, stdout);
+    return 0;
+}
 
-            return command { commandChar, bitValue, position };
+/**
+ * Splits the command line arguments into options and positional arguments. Options start with two dashes,
+ * everything else is kept in order as a positional argument.
+ * @param argc The number of arguments.
+ * @param argv The command line arguments.
+ * @param opts The options to fill.
+ * @param positional The positional arguments, without the program name.
+ * @return 0 on success, otherwise the exit code to terminate with.
+ */
+int parseOptions(int argc, char** argv, options& opts, std::vector<char*>& positional) {
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (!arg.starts_with("--")) {
+            positional.push_back(argv[i]);
+        } else if (arg == "--strict") {
+            opts.strict = true;
+        } else if (arg == "--no-sparse") {
+            opts.build.sparse = false;
+        } else if (arg == "--compressed") {
+            opts.build.compressed = true;
+        } else if (arg == "--build-threads") {
+            if (!readCount(argc, argv, i, opts.build.threads)) return 7;
+        } else if (arg == "--select-sample-shift") {
+            unsigned int shift;
+            if (!readCount(argc, argv, i, shift)) return 7;
+            if (shift < MIN_SELECT_SAMPLE_SHIFT || shift > MAX_SELECT_SAMPLE_SHIFT) {
+                std::cerr << "The select sample shift must be between " << MIN_SELECT_SAMPLE_SHIFT << " and " << MAX_SELECT_SAMPLE_SHIFT << std::endl;
+                return 7;
+            }
+            opts.build.selectSampleShift = (uint8_t) shift;
+        } else if (arg == "--select-budget") {
+            std::string_view value = i + 1 < argc ? argv[++i] : "";
+            double budget = 0;
+            auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), budget);
+            if (error != std::errc() || end != value.data() + value.size() || !(budget > 0)) {
+                std::cerr << "The select budget must be a fraction of the vector greater than 0, like 0.02" << std::endl;
+                return 7;
+            }
+            opts.build.selectBudget = budget;
+        } else if (arg == "--select-samples") {
+            std::string_view value = i + 1 < argc ? argv[++i] : "";
+            if (value == "both") opts.build.helpers = HELPERS_ALL;
+            else if (value == "0") opts.build.helpers = HELPERS_SELECT_0;
+            else if (value == "1") opts.build.helpers = HELPERS_SELECT_1;
+            else if (value == "none") opts.build.helpers = 0;
+            else {
+                std::cerr << "The select samples must be both, 0, 1 or none" << std::endl;
+                return 7;
+            }
+        } else if (arg == "--threads") {
+            if (!readCount(argc, argv, i, opts.queryThreads)) return 7;
+        } else if (arg == "--reorder") {
+            opts.reorder = true;
+        } else if (arg == "--numa") {
+            std::string_view value = i + 1 < argc ? argv[++i] : "";
+            if (value == "replicate") opts.numa = NUMA_REPLICATE;
+            else if (value == "helpers") opts.numa = NUMA_HELPERS;
+            else if (value == "off") opts.numa = NUMA_OFF;
+            else {
+                std::cerr << "The NUMA placement must be replicate, helpers or off" << std::endl;
+                return 7;
+            }
+        } else if (arg == "--serve") {
+            opts.serve = true;
+        } else if (arg == "--socket") {
+            if (i + 1 >= argc) {
+                std::cerr << "Missing path for option " << arg << std::endl;
+                return 7;
+            }
+            opts.serve = true;
+            opts.socketPath = argv[++i];
+        } else if (arg == "--load-index" || arg == "--save-index") {
+            if (i + 1 >= argc) {
+                std::cerr << "Missing path for option " << arg << std::endl;
+                return 7;
+            }
+            (arg == "--load-index" ? opts.loadIndex : opts.saveIndex) = argv[++i];
+        } else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return 7;
         }
     }
-    // Return a default command. It will work, but it will be really obvious if something
-    // went wrong at this stage.
-    return command {'a', 0, 0};
+    return 0;
 }
 
 /**
- * Processes a given command on the provided bitvector. To save time, the result is stored in
- * the reply property of the given command struct and not sent to IO immediately.
- * This allows to have the console IO outside of measured time.
- * @param cmd The command.
- * @param vect The bitvector.
+ * Reads the numeric value of an option from the next command line argument.
+ * @param argc The number of arguments.
+ * @param argv The command line arguments.
+ * @param i The index of the option, which is advanced to its value.
+ * @param value The value to fill.
+ * @return Whether there was a valid number.
  */
-void processCommand(command& cmd, bitvector& vect) {
-    switch (cmd.cmd) {
-        case 'a':
-            cmd.reply = vect.access(cmd.position);
-            return;
-        case 'r':
-            cmd.reply = vect.rank(cmd.position, cmd.bitValue);
-            return;
-        case 's':
-            cmd.reply = vect.select(cmd.position, cmd.bitValue);
-            return;
+bool readCount(int argc, char** argv, int& i, unsigned int& value) {
+    std::string_view option = argv[i];
+    if (i + 1 >= argc) {
+        std::cerr << "Missing value for option " << option << std::endl;
+        return false;
+    }
+    std::string_view arg = argv[++i];
+    auto [end, error] = std::from_chars(arg.data(), arg.data() + arg.size(), value);
+    if (error != std::errc() || end != arg.data() + arg.size()) {
+        std::cerr << "Invalid value " << arg << " for option " << option << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Returns the next line of the given text without its \\n and removes it from the text. If there is no
+ * line break left, the entire remaining text is returned.
+ * @param rest The remaining text, which is advanced past the line.
+ * @return The line.
+ */
+std::string_view nextLine(std::string_view& rest) {
+    auto lineBreak = (const char*) std::memchr(rest.data(), '\n', rest.size());
+    size_t length = lineBreak ? lineBreak - rest.data() : rest.size();
+    std::string_view line = rest.substr(0, length);
+    rest.remove_prefix(lineBreak ? length + 1 : length);
+    return line;
+}
+
+/**
+ * Same as nextLine(rest), but searches the line break in slices and releases every slice of the mapping after
+ * it has been searched. This skips the bitvector line when a prebuilt index is loaded instead, the line can be
+ * gigabytes long.
+ * @param rest The remaining text, which is advanced past the line.
+ * @param file The file the text belongs to.
+ * @return The line.
+ */
+std::string_view nextLine(std::string_view& rest, inputfile& file) {
+    size_t length = 0;
+    while (length < rest.size()) {
+        std::string_view slice = rest.substr(length, CONSTRUCTION_SLICE_SIZE);
+        auto lineBreak = (const char*) std::memchr(slice.data(), '\n', slice.size());
+        if (lineBreak) {
+            length += lineBreak - slice.data();
+            break;
+        }
+        file.discard(slice);
+        length += slice.size();
     }
+    std::string_view line = rest.substr(0, length);
+    rest.remove_prefix(length < rest.size() ? length + 1 : length);
+    return line;
 }
@@ -0,0 +1,166 @@
+#include "numa.h"
+#include "bitvector.h"
+
+#include <charconv>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#if defined(__linux__) && __has_include(<linux/mempolicy.h>)
+#define NUMA_LINUX
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Parses a list of numbers and ranges as the kernel prints them, like 0-3,8,10-11.
+ * @param list The list.
+ * @return The numbers in increasing order.
+ */
+static std::vector<unsigned int> parseList(std::string_view list) {
+    std::vector<unsigned int> numbers;
+    const char* pos = list.data();
+    const char* end = list.data() + list.size();
+    while (pos < end) {
+        unsigned int first = 0, last = 0;
+        auto [firstEnd, error] = std::from_chars(pos, end, first);
+        if (error != std::errc()) break;
+        last = first;
+        pos = firstEnd;
+        if (pos < end && *pos == '-') {
+            auto [lastEnd, rangeError] = std::from_chars(pos + 1, end, last);
+            if (rangeError != std::errc()) break;
+            pos = lastEnd;
+        }
+        for (unsigned int number = first; number <= last; ++number) numbers.push_back(number);
+        if (pos < end && *pos == ',') ++pos;
+    }
+    return numbers;
+}
+
+/**
+ * Reads the first line of a file in /sys.
+ * @param path The path of the file.
+ * @return The line, empty if the file does not exist.
+ */
+static std::string readLine(const std::string& path) {
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    return line;
+}
+
+/**
+ * Returns the online NUMA nodes that have CPUs. Nodes with memory only are left out, no query thread can run there.
+ * @return The nodes in increasing order, empty if the system does not list them.
+ */
+std::vector<numaNode> numaNodes() {
+    std::vector<numaNode> nodes;
+#ifdef NUMA_LINUX
+    for (unsigned int id : parseList(readLine("/sys/devices/system/node/online"))) {
+        std::vector<unsigned int> cpus = parseList(readLine("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist"));
+        if (!cpus.empty()) nodes.push_back({ id, std::move(cpus) });
+    }
+#endif
+    return nodes;
+}
+
+/**
+ * Returns the CPUs the calling thread may currently run on, to restore them after pinThread(...).
+ * @return The CPUs, empty if they are unknown.
+ */
+std::vector<unsigned int> threadCpus() {
+    std::vector<unsigned int> cpus;
+#ifdef NUMA_LINUX
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) return cpus;
+    for (unsigned int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+    }
+#endif
+    return cpus;
+}
+
+/**
+ * Restricts the calling thread to the given CPUs, usually all CPUs of a node.
+ * @param cpus The CPUs.
+ * @return Whether the thread was pinned.
+ */
+bool pinThread(const std::vector<unsigned int>& cpus) {
+#ifdef NUMA_LINUX
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (unsigned int cpu : cpus) {
+        if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+    return !cpus.empty() && sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Moves memory to the given nodes and keeps it there, with the mbind system call, so libnuma is not needed. The memory
+ * is bound to a single node, or interleaved page by page over several. Only whole pages are moved, so this is only
+ * used for the arrays large enough to have mappings of their own, see allocateIndexMemory(...).
+ * @param memory The memory, aligned to a page.
+ * @param bytes Its size.
+ * @param nodes The ids of the nodes.
+ * @return Whether the memory was moved.
+ */
+bool moveToNodes(const void* memory, size_t bytes, const std::vector<unsigned int>& nodes) {
+#if defined(NUMA_LINUX) && defined(SYS_mbind)
+    if (nodes.empty() || bytes == 0) return false;
+    std::vector<unsigned long> mask;
+    for (unsigned int id : nodes) {
+        if (id / 64 >= mask.size()) mask.resize(id / 64 + 1);
+        mask[id / 64] |= 1UL << (id % 64);
+    }
+    // The kernel reads one bit less than the given maximum.
+    return syscall(SYS_mbind, memory, bytes, nodes.size() > 1 ? MPOL_INTERLEAVE : MPOL_BIND,
+                   mask.data(), mask.size() * 64 + 1, MPOL_MF_MOVE) == 0;
+#else
+    (void) memory;
+    (void) bytes;
+    (void) nodes;
+    return false;
+#endif
+}
+
+/**
+ * Places the bitvector on all nodes. Its own pages are moved to the first node, or with NUMA_HELPERS, the vector is
+ * interleaved over all nodes. Then one thread per other node, pinned to it, writes the copy for its node. With fewer
+ * than two nodes or NUMA_OFF, nothing is copied or moved, and count() is 0.
+ * @param vect The bitvector, which must have its helper structures built and must outlive the copies.
+ * @param mode How to place it.
+ * @param nodes The nodes, all nodes of the machine by default.
+ */
+template<typename BV>
+void numaReplicas<BV>::build(const BV& vect, numaMode mode, std::vector<numaNode> nodes) {
+    copies.clear();
+    this->nodes.clear();
+    primary = &vect;
+    if (mode == NUMA_OFF || nodes.size() < 2) return;
+
+    std::vector<unsigned int> first { nodes[0].id }, all;
+    for (const numaNode& node : nodes) all.push_back(node.id);
+    vect.moveToNodes(mode == NUMA_HELPERS ? all : first, first);
+
+    copies.resize(nodes.size() - 1);
+    std::vector<std::thread> workers;
+    for (size_t index = 1; index < nodes.size(); ++index) {
+        workers.emplace_back([this, &vect, &nodes, mode, index] {
+            pinThread(nodes[index].cpus);
+            copies[index - 1] = vect.replicate(mode == NUMA_HELPERS);
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    this->nodes = std::move(nodes);
+}
+
+template class numaReplicas<bitvector>;
+template class numaReplicas<smallBitvector>;
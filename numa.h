@@ -0,0 +1,53 @@
+#ifndef BITVECTOR_NUMA_H
+#define BITVECTOR_NUMA_H
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * A NUMA node with at least one CPU, as listed in /sys/devices/system/node.
+ */
+struct numaNode {
+    unsigned int id;
+    std::vector<unsigned int> cpus;
+};
+
+/**
+ * How the index is placed on the NUMA nodes before the queries, see numaReplicas.
+ */
+enum numaMode {
+    NUMA_OFF,                           // Wherever the build put it.
+    NUMA_REPLICATE,                     // One full copy of the index on every node.
+    NUMA_HELPERS                        // The vector interleaved over all nodes, a copy of the helper structures on every node.
+};
+
+std::vector<numaNode> numaNodes();
+std::vector<unsigned int> threadCpus();
+bool pinThread(const std::vector<unsigned int>& cpus);
+bool moveToNodes(const void* memory, size_t bytes, const std::vector<unsigned int>& nodes);
+
+/**
+ * The copies of a bitvector for the NUMA nodes of the machine. On a machine with two or more nodes, a query on another
+ * node than the memory it reads takes about 1.6 times as long, so every query thread is pinned to a node and reads
+ * the copy on it, see processCommands(...). Copies are written by a thread pinned to their node, so the kernel puts
+ * their pages there on first touch, no libnuma is needed.<br/>
+ * The first node keeps the built bitvector itself, whose pages are moved there, so the copies only take memory on the
+ * other nodes. With NUMA_HELPERS, the copies map the vector of the built bitvector instead of copying it, see
+ * basic_bitvector::replicate(...), and its pages are interleaved over all nodes.
+ * @tparam BV The bitvector type.
+ */
+template<typename BV>
+class numaReplicas {
+
+public:
+    void build(const BV& vect, numaMode mode, std::vector<numaNode> nodes = numaNodes());
+    size_t count() const { return nodes.size(); }
+    const numaNode& node(size_t index) const { return nodes[index]; }
+    const BV& replica(size_t index) const { return index == 0 ? *primary : copies[index - 1]; }
+private:
+    const BV* primary = nullptr;
+    std::vector<BV> copies;
+    std::vector<numaNode> nodes;
+};
+
+#endif
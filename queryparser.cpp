@@ -0,0 +1,186 @@
+#include "queryparser.h"
+
+#include <cstring>
+
+/**
+ * Reads an unsigned decimal number starting at p and advances p past its last digit.
+ * The loop body is a single subtract-and-compare, as any character outside of '0' to '9' wraps around
+ * to a value larger than 9 when interpreted as unsigned.<br/>
+ * In strict mode, numbers that do not fit into 64 bit are rejected. In lenient mode, they silently wrap.
+ * @param p The current read position, which is advanced.
+ * @param end The end of the buffer.
+ * @param value The parsed number.
+ * @return Whether at least one digit was read (and, in strict mode, no overflow occurred).
+ */
+template<bool STRICT>
+static inline bool readNumber(const char*& p, const char* end, uint64& value) {
+    const char* start = p;
+    uint64 result = 0;
+    unsigned digit;
+    while (p < end && (digit = (unsigned char) *p - '0') < 10) {
+        if constexpr (STRICT) {
+            if (__builtin_mul_overflow(result, 10ULL, &result) || __builtin_add_overflow(result, digit, &result)) return false;
+        } else {
+            result = result * 10 + digit;
+        }
+        ++p;
+    }
+    value = result;
+    return p != start;
+}
+
+/**
+ * Checks whether the buffer at p starts with the given keyword, followed by a single space, and advances p past it.
+ * @param p The current read position, which is advanced on success.
+ * @param end The end of the buffer.
+ * @param keyword The keyword including the trailing space.
+ * @param length The length of the keyword including the trailing space.
+ * @return Whether the keyword matched.
+ */
+static inline bool readKeyword(const char*& p, const char* end, const char* keyword, size_t length) {
+    if ((size_t) (end - p) < length || std::memcmp(p, keyword, length) != 0) return false;
+    p += length;
+    return true;
+}
+
+/**
+ * Parses the two arguments of a rank or select query, the bit value and the position or number.
+ * In lenient mode, a missing second number means 0, and the bit value is not checked.
+ * @param p The current read position, which is advanced past the arguments.
+ * @param end The end of the buffer.
+ * @param cmd The command to fill.
+ * @param message Set to a description of the error if parsing fails.
+ * @return Whether the arguments were valid.
+ */
+template<bool STRICT>
+static inline bool readTwoArguments(const char*& p, const char* end, command& cmd, const char*& message) {
+    uint64 bitValue, second = 0;
+    if (!readNumber<STRICT>(p, end, bitValue)) {
+        message = "expected a bit value";
+        return false;
+    }
+    if (STRICT && bitValue > 1) {
+        message = "bit value must be 0 or 1";
+        return false;
+    }
+    if (p < end && *p == ' ') {
+        ++p;
+        if (!readNumber<STRICT>(p, end, second)) {
+            message = "expected a number after the bit value";
+            return false;
+        }
+    } else if (STRICT) {
+        message = "expected a number after the bit value";
+        return false;
+    }
+    cmd.bitValue = (uint8_t) bitValue;
+    cmd.position = second;
+    return true;
+}
+
+/**
+ * Parses a single query. The command type is dispatched on the first character only, the rest
+ * of the keyword is verified afterwards.<br/>
+ * In lenient mode, this accepts exactly what the former regular expression accepted: access with one or two numbers
+ * (the second is ignored) and rank / select with one or two numbers.
+ * In strict mode, access takes exactly one number, rank and select take exactly two, and the bit value must be 0 or 1.
+ * @param p The current read position, which is advanced past the arguments, but not past the line break.
+ * @param end The end of the buffer.
+ * @param cmd The command to fill.
+ * @param message Set to a description of the error if parsing fails.
+ * @return Whether the query was valid.
+ */
+template<bool STRICT>
+static inline bool readQuery(const char*& p, const char* end, command& cmd, const char*& message) {
+    switch (*p) {
+        case 'a':
+            if (!readKeyword(p, end, "access ", 7)) break;
+            if (!readNumber<STRICT>(p, end, cmd.position)) {
+                message = "expected a position after access";
+                return false;
+            }
+            if (!STRICT && p < end && *p == ' ') {
+                uint64 ignored;
+                ++p;
+                if (!readNumber<STRICT>(p, end, ignored)) break;
+            }
+            cmd.cmd = 'a';
+            return true;
+        case 'r':
+            if (!readKeyword(p, end, "rank ", 5)) break;
+            cmd.cmd = 'r';
+            return readTwoArguments<STRICT>(p, end, cmd, message);
+        case 's':
+            if (!readKeyword(p, end, "select ", 7)) break;
+            cmd.cmd = 's';
+            return readTwoArguments<STRICT>(p, end, cmd, message);
+    }
+    message = "unknown query, expected access, rank or select";
+    return false;
+}
+
+/**
+ * The actual parser loop, instantiated once for strict and once for lenient mode so the mode check
+ * does not end up in the hot loop.
+ */
+template<bool STRICT>
+static parseResult parse(const char* p, const char* end, uint64 count, std::vector<command>& commands, uint64 line) {
+    commands.reserve(commands.size() + count);
+
+    for (uint64 i = 0; i < count; ++i, ++line) {
+        const char* message = nullptr;
+        command cmd { 'a', 0, 0, 0 };
+
+        if (p >= end) {
+            // The file ended before all announced queries were read.
+            if constexpr (STRICT) return parseResult { false, line, "missing query, the file ended early" };
+            commands.push_back(cmd);
+            continue;
+        }
+
+        bool valid = readQuery<STRICT>(p, end, cmd, message);
+        // Allow the \r which windows has in addition to \n in the line breaks.
+        if (valid && p < end && *p == '\r') ++p;
+        if (valid && p < end && *p != '\n') {
+            valid = false;
+            message = "unexpected characters at the end of the query";
+        }
+
+        if (valid) {
+            // p now points to the line break or the end of the buffer, so no need to search for it.
+            p += p < end;
+        } else {
+            if constexpr (STRICT) return parseResult { false, line, message };
+            // Return a default command. It will work, but it will be really obvious if something
+            // went wrong at this stage.
+            cmd = command { 'a', 0, 0, 0 };
+            auto lineBreak = (const char*) std::memchr(p, '\n', end - p);
+            p = lineBreak ? lineBreak + 1 : end;
+        }
+        commands.push_back(cmd);
+    }
+    return parseResult { true, 0, nullptr };
+}
+
+/**
+ * Parses count queries from the given buffer into the command vector. Valid queries are \<access | rank | select> \<first number> [second number],
+ * In the format provided by Florian Kurpicz:<br/>
+ * - access <index><br/>
+ * - rank <0/1> <position><br/>
+ * - select <0/1> <number><br/>
+ * Lines may end with \\n or \\r\\n. The buffer is read in place, no per-line strings are created.<br/>
+ * In lenient mode, an invalid query is replaced by the default command of access 0, and missing lines count as invalid queries.
+ * In strict mode, parsing stops at the first invalid query and its line number is reported.
+ * @param begin The start of the query section.
+ * @param end The end of the buffer.
+ * @param count The number of queries to read.
+ * @param commands The vector to append the parsed commands to.
+ * @param strict Whether to use strict mode.
+ * @param firstLine The line number of the first query in the input file, used for error messages.
+ * @return Whether parsing succeeded and, if not, where and why it failed.
+ */
+parseResult parseCommands(const char* begin, const char* end, uint64 count, std::vector<command>& commands,
+                          bool strict, uint64 firstLine) {
+    return strict ? parse<true>(begin, end, count, commands, firstLine)
+                  : parse<false>(begin, end, count, commands, firstLine);
+}
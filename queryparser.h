@@ -0,0 +1,30 @@
+#ifndef BITVECTOR_QUERYPARSER_H
+#define BITVECTOR_QUERYPARSER_H
+
+#include <cstdint>
+#include <vector>
+#include "bitvector.h"
+
+/**
+ * A single parsed query. The answer is written into reply when the query is processed.
+ */
+struct command {
+    char cmd;
+    uint8_t bitValue;
+    uint64 position, reply;
+};
+
+/**
+ * The outcome of parsing the query section. If ok is false, line contains the 1-based line number in the
+ * input file of the first malformed query and message a short description of what went wrong.
+ */
+struct parseResult {
+    bool ok;
+    uint64 line;
+    const char* message;
+};
+
+parseResult parseCommands(const char* begin, const char* end, uint64 count, std::vector<command>& commands,
+                          bool strict, uint64 firstLine = 3);
+
+#endif
@@ -0,0 +1,272 @@
+#include "queryprocessor.h"
+#include "instrumentation.h"
+
+#include <algorithm>
+#include <bit>
+#include <memory>
+#include <thread>
+#include <utility>
+#ifdef INSTRUMENT
+#include <chrono>
+#endif
+
+#ifdef INSTRUMENT
+template<typename BV>
+static void processTimed(command* begin, command* end, const BV& vect);
+#else
+template<typename BV>
+static void processBatch(command* begin, command* end, const BV& vect);
+#endif
+
+/**
+ * Processes the commands of one range, in batches of consecutive commands of the same type, which lets their memory
+ * accesses overlap.
+ * @param begin The first command.
+ * @param end The end of the commands.
+ * @param vect The bitvector.
+ */
+template<typename BV>
+static void processRange(command* begin, command* end, const BV& vect) {
+#ifdef INSTRUMENT
+    processTimed(begin, end, vect);
+#else
+    for (command* batch = begin; batch < end;) {
+        command* batchEnd = batch + 1;
+        while (batchEnd < end && batchEnd - batch < QUERY_BATCH_SIZE && batchEnd->cmd == batch->cmd) ++batchEnd;
+        processBatch(batch, batchEnd, vect);
+        batch = batchEnd;
+    }
+#endif
+}
+
+/**
+ * Splits the commands into one continuous range per thread and processes them on the bitvector of every range.
+ * Every command has its own reply slot, so the threads never write to the same command and the replies stay
+ * in input order. The calling thread processes the first range itself.
+ * @param commands The commands.
+ * @param threads The number of threads, 0 for one per hardware thread.
+ * @param rangeVector Called on the thread of every range with its number and the number of threads, returns the bitvector.
+ */
+template<typename BV, typename F>
+static void processRanges(std::vector<command>& commands, unsigned int threads, F&& rangeVector) {
+    if (threads == 0) threads = std::max(1U, std::thread::hardware_concurrency());
+    threads = (unsigned int) std::clamp<size_t>(commands.size() / MIN_COMMANDS_PER_THREAD, 1, threads);
+
+    auto process = [&commands, &rangeVector, threads](unsigned int range) {
+        const BV& vect = rangeVector(range, threads);
+        processRange(commands.data() + commands.size() * range / threads, commands.data() + commands.size() * (range + 1) / threads, vect);
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (unsigned int t = 1; t < threads; ++t) workers.emplace_back(process, t);
+    process(0);
+    for (auto& worker : workers) worker.join();
+}
+
+/**
+ * Processes all commands on multiple threads, see processRanges(...). Every result is stored in the reply property of
+ * its command.
+ * @param commands The commands.
+ * @param vect The bitvector, which must have its helper structures built.
+ * @param threads The number of threads, 0 for one per hardware thread.
+ */
+template<typename BV>
+void processCommands(std::vector<command>& commands, const BV& vect, unsigned int threads) {
+    processRanges<BV>(commands, threads, [&vect](unsigned int, unsigned int) -> const BV& { return vect; });
+}
+
+/**
+ * Processes all commands like processCommands(commands, vect, threads), but spreads the threads evenly over the
+ * NUMA nodes of the replicas. Every thread is pinned to its node and reads the copy on it. The calling thread may run
+ * on all of its CPUs again afterwards. Without replicas, this is the same as on a single bitvector.
+ * @param commands The commands.
+ * @param replicas The copies of the bitvector, see numaReplicas.
+ * @param threads The number of threads, 0 for one per hardware thread.
+ */
+template<typename BV>
+void processCommands(std::vector<command>& commands, const numaReplicas<BV>& replicas, unsigned int threads) {
+    if (replicas.count() < 2) {
+        processCommands(commands, replicas.replica(0), threads);
+        return;
+    }
+    std::vector<unsigned int> callerCpus = threadCpus();
+    processRanges<BV>(commands, threads, [&replicas](unsigned int range, unsigned int ranges) -> const BV& {
+        size_t node = (size_t) range * replicas.count() / ranges;
+        pinThread(replicas.node(node).cpus);
+        return replicas.replica(node);
+    });
+    pinThread(callerCpus);
+}
+
+// ------------------------------------------------------------------------------------------------------------------
+// Reordering
+//
+// In file order, the positions of consecutive queries on a large bitvector are unrelated, so nearly every query misses
+// the cache and the TLB. processReordered(...) answers them sorted by type and bit value, and by the word their position
+// falls into instead. Queries on the same block then share its cache line, and a large batch sweeps the vector from
+// front to back, which the hardware prefetcher can follow. Select queries are sorted by their number, which sorts them
+// by their result and by their select sample as well.
+// ------------------------------------------------------------------------------------------------------------------
+
+/**
+ * A value of a command, first its position or number and after processing its reply, and its index in the file order.
+ */
+struct orderedCommand {
+    uint64 value;
+    uint64 index;
+};
+
+// The type and bit value of every class of commands, see commandClass(...).
+static const char CLASS_TYPES[5] = { 'a', 'r', 'r', 's', 's' };
+static const uint8_t CLASS_BIT_VALUES[5] = { 0, 0, 1, 0, 1 };
+
+/**
+ * Returns the class of a command in the order of processReordered(...): access, rank of zeros and ones, and select of
+ * zeros and ones. Like in rank(...) and select(...), every bit value other than 1 counts zeros.
+ * @param cmd The command.
+ * @return The class, from 0 to 4.
+ */
+static unsigned int commandClass(const command& cmd) {
+    if (cmd.cmd == 'a') return 0;
+    return (cmd.cmd == 'r' ? 1 : 3) + (cmd.bitValue == 1);
+}
+
+/**
+ * Counts the digits of REORDER_DIGIT_BITS bits of the entries and turns the counts into the first position of every digit
+ * in the sorted order.
+ * @param begin The first entry.
+ * @param end The end of the entries.
+ * @param counts A counter for every digit.
+ * @param digit Returns the digit of an entry.
+ */
+template<typename F>
+static void countDigits(const orderedCommand* begin, const orderedCommand* end, std::vector<size_t>& counts, F&& digit) {
+    std::fill(counts.begin(), counts.end(), 0);
+    for (const orderedCommand* entry = begin; entry != end; ++entry) ++counts[digit(*entry)];
+    size_t offset = 0;
+    for (size_t& count : counts) offset += std::exchange(count, offset);
+}
+
+/**
+ * Processes all commands like processCommands(commands, replicas, threads), but sorted by class and by the block of
+ * 2^REORDER_KEY_SHIFT bits their position or number falls into, see above. The positions are sorted with their command
+ * index: a counting sort by class, and then a least significant digit radix sort in every class. Both are stable, so
+ * commands on the same block stay in file order. The radix sort takes at most REORDER_MAX_PASSES passes, for the
+ * largest bitvectors the blocks are larger instead, which are still much smaller than a page.<br/>
+ * The commands are answered in this order, and their replies go back to the original commands, so the output order
+ * does not change. To not miss the cache for every reply, the replies are sorted by the highest digit of their index
+ * first, then every digit only writes to a small part of the commands.
+ * @param commands The commands.
+ * @param replicas The copies of the bitvector, see numaReplicas.
+ * @param threads The number of threads, 0 for one per hardware thread.
+ */
+template<typename BV>
+void processReordered(std::vector<command>& commands, const numaReplicas<BV>& replicas, unsigned int threads) {
+    constexpr uint64 DIGIT_MASK = (1 << REORDER_DIGIT_BITS) - 1;
+    // All entries are written before they are read, so they are not initialized.
+    auto order = std::make_unique_for_overwrite<orderedCommand[]>(commands.size());
+    auto buffer = std::make_unique_for_overwrite<orderedCommand[]>(commands.size());
+    std::vector<size_t> counts(1 << REORDER_DIGIT_BITS);
+    size_t starts[6] {};
+    uint64 largest[5] {};
+    for (const command& cmd : commands) ++starts[commandClass(cmd) + 1];
+    for (unsigned int c = 0; c < 5; ++c) starts[c + 1] += starts[c];
+    size_t fill[5];
+    std::copy(starts, starts + 5, fill);
+    for (size_t i = 0; i < commands.size(); ++i) {
+        unsigned int c = commandClass(commands[i]);
+        order[fill[c]++] = { commands[i].position, i };
+        largest[c] = std::max(largest[c], commands[i].position);
+    }
+
+    std::vector<command> sorted;
+    sorted.reserve(commands.size());
+    for (unsigned int c = 0; c < 5; ++c) {
+        orderedCommand* begin = order.get() + starts[c];
+        orderedCommand* to = buffer.get() + starts[c];
+        size_t n = starts[c + 1] - starts[c];
+        auto width = (uint64) std::bit_width(largest[c]);
+        uint64 shift = std::max<uint64>(REORDER_KEY_SHIFT, width > REORDER_MAX_PASSES * REORDER_DIGIT_BITS ? width - REORDER_MAX_PASSES * REORDER_DIGIT_BITS : 0);
+        for (; shift < width; shift += REORDER_DIGIT_BITS) {
+            auto digit = [shift](const orderedCommand& entry) { return (entry.value >> shift) & DIGIT_MASK; };
+            countDigits(begin, begin + n, counts, digit);
+            for (const orderedCommand* entry = begin; entry != begin + n; ++entry) to[counts[digit(*entry)]++] = *entry;
+            std::swap(begin, to);
+        }
+        for (size_t i = 0; i < n; ++i) sorted.push_back({ CLASS_TYPES[c], CLASS_BIT_VALUES[c], begin[i].value, 0 });
+        // The indices go to order, the replies are written next to them.
+        if (begin != order.get() + starts[c]) std::copy(begin, begin + n, order.get() + starts[c]);
+    }
+
+    processCommands(sorted, replicas, threads);
+
+    auto indexShift = (uint64) std::max(0, (int) std::bit_width(commands.size()) - REORDER_DIGIT_BITS);
+    auto digit = [indexShift](const orderedCommand& entry) { return entry.index >> indexShift; };
+    countDigits(order.get(), order.get() + commands.size(), counts, digit);
+    for (size_t i = 0; i < commands.size(); ++i) buffer[counts[digit(order[i])]++] = { sorted[i].reply, order[i].index };
+    for (size_t i = 0; i < commands.size(); ++i) commands[buffer[i].index].reply = buffer[i].value;
+}
+
+/**
+ * Processes up to QUERY_BATCH_SIZE consecutive commands of the same type. Rank and select commands are answered
+ * in one batch per bit value. To save time, every result is stored in the reply property of its command and not sent
+ * to IO immediately. This allows to have the console IO outside of measured time.
+ * @param begin The first command.
+ * @param end The end of the commands.
+ * @param vect The bitvector.
+ */
+template<typename BV>
+static void processBatch(command* begin, command* end, const BV& vect) {
+    uint64 positions[QUERY_BATCH_SIZE], replies[QUERY_BATCH_SIZE];
+    command* batch[QUERY_BATCH_SIZE];
+    char type = begin->cmd;
+    bool perBitValue = type != 'a';
+
+    // Access has no bit value, so it takes a single pass. Like in rank(...) and select(...), every bit value other than 1
+    // counts zeros.
+    for (uint8_t bitValue = 0; bitValue < (perBitValue ? 2 : 1); ++bitValue) {
+        size_t n = 0;
+        for (command* cmd = begin; cmd != end; ++cmd) {
+            if (perBitValue && (cmd->bitValue == 1) != (bitValue == 1)) continue;
+            batch[n] = cmd;
+            positions[n++] = cmd->position;
+        }
+        if (n == 0) continue;
+        if (type == 'r') vect.rank_batch(positions, n, bitValue, replies);
+        else if (type == 's') vect.select_batch(positions, n, bitValue, replies);
+        else vect.access_batch(positions, n, replies);
+        for (size_t i = 0; i < n; ++i) batch[i]->reply = replies[i];
+    }
+}
+
+#ifdef INSTRUMENT
+/**
+ * Instrumented builds answer every command on its own instead of in batches, so every query has a latency of its own.
+ * The latencies and events are collected per thread and merged into the global histograms and counts at the end.
+ * @param begin The first command.
+ * @param end The end of the commands.
+ * @param vect The bitvector.
+ */
+template<typename BV>
+static void processTimed(command* begin, command* end, const BV& vect) {
+    latencyHistogram access, rank, select;
+    for (command* cmd = begin; cmd != end; ++cmd) {
+        auto start = std::chrono::steady_clock::now();
+        if (cmd->cmd == 'r') cmd->reply = vect.rank(cmd->position, cmd->bitValue);
+        else if (cmd->cmd == 's') cmd->reply = vect.select(cmd->position, cmd->bitValue);
+        else cmd->reply = vect.access(cmd->position);
+        auto time = (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        (cmd->cmd == 'r' ? rank : cmd->cmd == 's' ? select : access).add(time);
+    }
+    instrumentation::mergeLatencies(access, rank, select);
+    instrumentation::mergeEvents();
+}
+#endif
+
+template void processCommands(std::vector<command>&, const bitvector&, unsigned int);
+template void processCommands(std::vector<command>&, const smallBitvector&, unsigned int);
+template void processCommands(std::vector<command>&, const numaReplicas<bitvector>&, unsigned int);
+template void processCommands(std::vector<command>&, const numaReplicas<smallBitvector>&, unsigned int);
+template void processReordered(std::vector<command>&, const numaReplicas<bitvector>&, unsigned int);
+template void processReordered(std::vector<command>&, const numaReplicas<smallBitvector>&, unsigned int);
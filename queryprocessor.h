@@ -0,0 +1,23 @@
+#ifndef BITVECTOR_QUERYPROCESSOR_H
+#define BITVECTOR_QUERYPROCESSOR_H
+
+#include <vector>
+#include "bitvector.h"
+#include "numa.h"
+#include "queryparser.h"
+
+#define MIN_COMMANDS_PER_THREAD 4096    // Fewer commands per thread are answered faster than a thread is started.
+#define QUERY_BATCH_SIZE 256            // Consecutive commands of the same type answered together.
+#define REORDER_DIGIT_BITS 11           // Bits per pass of the radix sort of processReordered, 2^11 counters fit into the L1 cache.
+#define REORDER_KEY_SHIFT 9             // Reordered commands are sorted by the 512-bit block their position or number falls into.
+#define REORDER_MAX_PASSES 2            // Passes of the radix sort per type, beyond 2^22 blocks the blocks get larger instead.
+
+// Instantiated for bitvector and smallBitvector.
+template<typename BV>
+void processCommands(std::vector<command>& commands, const BV& vect, unsigned int threads);
+template<typename BV>
+void processCommands(std::vector<command>& commands, const numaReplicas<BV>& replicas, unsigned int threads);
+template<typename BV>
+void processReordered(std::vector<command>& commands, const numaReplicas<BV>& replicas, unsigned int threads);
+
+#endif
@@ -0,0 +1,320 @@
+#include "queryserver.h"
+#include "inputfile.h"
+#include "queryprocessor.h"
+#include "resultwriter.h"
+
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <iostream>
+
+#if __has_include(<sys/socket.h>) && __has_include(<sys/un.h>)
+#define QUERYSERVER_SOCKET
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#define REQUEST_CHUNK_SIZE 4096         // Bytes read at once while looking for the end of a line.
+
+/**
+ * Creates a server without any bitvectors.
+ * @param build The options to build the helper structures of every bitvector with.
+ * @param threads The number of threads to answer each query batch with, 0 for one per hardware thread.
+ * @param strict Whether to reject query batches with malformed queries instead of answering access 0 for them.
+ */
+queryserver::queryserver(const buildOptions& build, unsigned int threads, bool strict)
+        : options(build), threads(threads), strict(strict) {}
+
+/**
+ * Reads the next line from a file, without its line break and the \\r of a windows line break.
+ * @param in The file.
+ * @param line The line to fill.
+ * @return Whether there was a line, false at the end of the file.
+ */
+static bool readLine(std::FILE* in, std::string& line) {
+    line.clear();
+    char chunk[REQUEST_CHUNK_SIZE];
+    while (std::fgets(chunk, sizeof(chunk), in) != nullptr) {
+        line += chunk;
+        if (line.back() == '\n') {
+            line.pop_back();
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            return true;
+        }
+    }
+    return !line.empty();
+}
+
+/**
+ * Splits the next word off a request. Words are separated by single spaces, the last argument, a path,
+ * is taken as the entire rest of the line so it may contain spaces itself.
+ * @param rest The remaining request, which is advanced past the word and the space after it.
+ * @return The word.
+ */
+static std::string_view nextWord(std::string_view& rest) {
+    size_t space = rest.find(' ');
+    std::string_view word = rest.substr(0, space);
+    rest.remove_prefix(space == std::string_view::npos ? rest.size() : space + 1);
+    return word;
+}
+
+/**
+ * Builds a bitvector from the bitvector line of an input file, the second line, and keeps it under the given name.
+ * An existing bitvector of that name is replaced. Like for a single input file, short bitvectors use the small layout.
+ * @param name The name.
+ * @param path The path of the input file.
+ * @param error The reason if building failed.
+ * @return Whether the bitvector was built.
+ */
+bool queryserver::build(const std::string& name, const char* path, std::string& error) {
+    inputfile file;
+    if (!file.open(path)) {
+        error = "could not open the input file";
+        return false;
+    }
+    std::string_view rest = file.contents();
+    auto lineBreak = (const char*) std::memchr(rest.data(), '\n', rest.size());
+    rest.remove_prefix(lineBreak ? lineBreak + 1 - rest.data() : rest.size());
+    // The constructor stops at the end of the bitvector line, which it finds while packing.
+    auto discard = [&file](std::string_view slice) { file.discard(slice); };
+
+#ifndef INTERLEAVED
+    if (lineShorterThan(rest, SMALL_VECTOR_BITS)) {
+        smallBitvector vect(rest, discard);
+        file.close();
+        vect.buildHelpers(options);
+        vectors.insert_or_assign(name, anyBitvector(std::move(vect)));
+        return true;
+    }
+#endif
+    bitvector vect(rest, discard);
+    file.close();
+    vect.buildHelpers(options);
+    vectors.insert_or_assign(name, anyBitvector(std::move(vect)));
+    return true;
+}
+
+/**
+ * Loads a prebuilt index file and keeps it under the given name. An existing bitvector of that name is replaced.
+ * A mapped index file is used in place instead of being copied, so servers that map the same file share its memory.
+ * @param name The name.
+ * @param path The path of the index file.
+ * @param mapped Whether to map the index file instead of loading it.
+ * @param error The reason if loading failed.
+ * @return Whether the bitvector was loaded.
+ */
+bool queryserver::load(const std::string& name, const char* path, bool mapped, std::string& error) {
+    auto open = [path, mapped](auto& vect) { return mapped ? vect.map(path) : vect.load(path); };
+    bool loaded;
+#ifdef INTERLEAVED
+    bitvector vect;
+    loaded = open(vect);
+    if (loaded) vectors.insert_or_assign(name, anyBitvector(std::move(vect)));
+#else
+    if (smallBitvector::indexMatches(path)) {
+        smallBitvector vect;
+        loaded = open(vect);
+        if (loaded) vectors.insert_or_assign(name, anyBitvector(std::move(vect)));
+    } else {
+        bitvector vect;
+        loaded = open(vect);
+        if (loaded) vectors.insert_or_assign(name, anyBitvector(std::move(vect)));
+    }
+#endif
+    if (!loaded) error = "could not load the index file, it is missing, corrupt or from another version";
+    return loaded;
+}
+
+/**
+ * Writes a bitvector to an index file.
+ * @param name The name of the bitvector.
+ * @param path The path of the index file.
+ * @param error The reason if saving failed.
+ * @return Whether the index file was written.
+ */
+bool queryserver::save(const std::string& name, const char* path, std::string& error) {
+    auto vect = vectors.find(name);
+    if (vect == vectors.end()) {
+        error = "unknown bitvector";
+        return false;
+    }
+    if (!std::visit([path](const auto& v) { return v.save(path); }, vect->second)) {
+        error = "could not write the index file";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Reads a batch of queries, answers them and writes the answers. The queries are always read, even if the bitvector
+ * does not exist, so the session stays in sync with the client.
+ * @param name The name of the bitvector.
+ * @param count The number of query lines that follow.
+ * @param in The file to read the queries from.
+ * @param writer The writer for the answers, which is flushed afterwards.
+ * @param error The reason if the batch could not be answered.
+ * @return Whether the batch was answered.
+ */
+bool queryserver::query(const std::string& name, uint64 count, std::FILE* in, resultwriter& writer, std::string& error) {
+    // The batch is collected into one buffer, so it can be parsed in place like the query section of an input file.
+    // The buffers are kept between batches, small batches do not allocate anything.
+    queries.clear();
+    uint64 firstLine = line + 1, read = 0;
+    for (; read < count && readLine(in, queryLine); ++read) {
+        queries += queryLine;
+        queries += '\n';
+    }
+    line += read;
+    if (read < count) {
+        error = "the session ended before all queries were read";
+        return false;
+    }
+
+    auto vect = vectors.find(name);
+    if (vect == vectors.end()) {
+        error = "unknown bitvector";
+        return false;
+    }
+    commands.clear();
+    parseResult parsed = parseCommands(queries.data(), queries.data() + queries.size(), count, commands, strict, firstLine);
+    if (!parsed.ok) {
+        error = "malformed query in line " + std::to_string(parsed.line) + ": " + parsed.message;
+        return false;
+    }
+    // A select without its samples would terminate the server with all of its bitvectors, see missingSelectSamples.
+    bool hasSamples[2];
+    std::visit([&hasSamples](const auto& v) { hasSamples[0] = v.hasSelectSamples(0), hasSamples[1] = v.hasSelectSamples(1); }, vect->second);
+    for (const command& cmd : commands) {
+        if (cmd.cmd == 's' && !hasSamples[cmd.bitValue == 1]) {
+            error = "select " + std::to_string(cmd.bitValue) + " needs the select samples for " + (cmd.bitValue == 1 ? "ones" : "zeros")
+                    + ", which were not built";
+            return false;
+        }
+    }
+    std::visit([this](const auto& v) { processCommands(commands, v, threads); }, vect->second);
+
+    for (const auto& cmd : commands) {
+        writer.write(cmd.reply);
+    }
+    writer.flush();
+    return true;
+}
+
+/**
+ * Runs a session: reads and answers requests until the end of the input, quit or shutdown.
+ * Every reply is flushed before the next request is read.
+ * @param in The file to read the requests from.
+ * @param out The file to write the replies to.
+ * @return Whether the server should keep running, false after shutdown.
+ */
+bool queryserver::serve(std::FILE* in, std::FILE* out) {
+    line = 0;
+    std::string request;
+    resultwriter writer(out);
+    while (readLine(in, request)) {
+        ++line;
+        std::string_view rest = request;
+        std::string_view type = nextWord(rest);
+        if (type.empty()) continue;
+        if (type == "quit") return true;
+        if (type == "shutdown") return false;
+
+        std::string name(nextWord(rest));
+        std::string error;
+        bool ok;
+        if (type != "build" && type != "load" && type != "map" && type != "save" && type != "drop" && type != "query") {
+            error = "unknown request, expected build, load, map, save, drop, query, quit or shutdown";
+            ok = false;
+        } else if (name.empty() && type != "query") {
+            // A batch for a missing name still has its queries read, see query(...).
+            error = "missing bitvector name";
+            ok = false;
+        } else if (type == "build" || type == "load" || type == "map" || type == "save") {
+            std::string path(rest);
+            if (path.empty()) {
+                error = "missing path";
+                ok = false;
+            } else if (type == "build") {
+                ok = build(name, path.c_str(), error);
+            } else if (type == "load" || type == "map") {
+                ok = load(name, path.c_str(), type == "map", error);
+            } else {
+                ok = save(name, path.c_str(), error);
+            }
+        } else if (type == "drop") {
+            ok = vectors.erase(name) == 1;
+            if (!ok) error = "unknown bitvector";
+        } else {
+            uint64 count = 0;
+            auto [end, parseError] = std::from_chars(rest.data(), rest.data() + rest.size(), count);
+            if (parseError != std::errc() || end != rest.data() + rest.size()) {
+                error = "invalid query count";
+                ok = false;
+            } else if ((ok = query(name, count, in, writer, error))) {
+                // The answers are the reply, there is no ok line after them.
+                continue;
+            }
+        }
+
+        if (ok) std::fputs("ok\n", out);
+        else std::fprintf(out, "error %s\n", error.c_str());
+        std::fflush(out);
+    }
+    return true;
+}
+
+/**
+ * Listens on a Unix socket and runs one session per connection, one connection after another, until a client sends
+ * shutdown. A socket file left over from an earlier server at the path is replaced, any other file is not.
+ * @param socketPath The path of the socket.
+ * @return Whether the socket could be created. If not, the reason is printed to stderr.
+ */
+bool queryserver::listen(const char* socketPath) {
+#ifdef QUERYSERVER_SOCKET
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    if (std::strlen(socketPath) >= sizeof(address.sun_path)) {
+        std::cerr << "The socket path " << socketPath << " is too long." << std::endl;
+        return false;
+    }
+    std::strcpy(address.sun_path, socketPath);
+
+    struct stat info {};
+    if (stat(socketPath, &info) == 0 && S_ISSOCK(info.st_mode)) unlink(socketPath);
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 || bind(server, (const sockaddr*) &address, sizeof(address)) != 0 || ::listen(server, SOMAXCONN) != 0) {
+        std::cerr << "Could not listen on the socket " << socketPath << ": " << std::strerror(errno) << std::endl;
+        if (server >= 0) close(server);
+        return false;
+    }
+    // A client that disconnects early must not terminate the server while its answers are written.
+    std::signal(SIGPIPE, SIG_IGN);
+
+    bool running = true;
+    while (running) {
+        int client = accept(server, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        // Separate streams for both directions, a single stream cannot switch between reading and writing on a socket.
+        int writeClient = dup(client);
+        std::FILE* in = fdopen(client, "rb");
+        std::FILE* out = writeClient < 0 ? nullptr : fdopen(writeClient, "wb");
+        if (in != nullptr && out != nullptr) running = serve(in, out);
+        if (in != nullptr) std::fclose(in);
+        else close(client);
+        if (out != nullptr) std::fclose(out);
+        else if (writeClient >= 0) close(writeClient);
+    }
+    close(server);
+    unlink(socketPath);
+    return true;
+#else
+    std::cerr << "Unix sockets are not supported on this system, " << socketPath << " cannot be used." << std::endl;
+    return false;
+#endif
+}
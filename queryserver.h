@@ -0,0 +1,59 @@
+#ifndef BITVECTOR_QUERYSERVER_H
+#define BITVECTOR_QUERYSERVER_H
+
+#include <cstdio>
+#include <map>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+#include "bitvector.h"
+#include "queryparser.h"
+#include "resultwriter.h"
+
+/**
+ * A long-running server that keeps any number of named bitvectors with their helper structures in memory and answers
+ * query batches on them, so the bitvectors are only built once instead of for every input file.<br/>
+ * Clients send one request per line, every request is answered before the next one is read:<br/>
+ * - build NAME PATH: builds a bitvector from the bitvector line of an input file, replies ok or an error.<br/>
+ * - load NAME PATH: loads a prebuilt index file, replies ok or an error.<br/>
+ * - map NAME PATH: like load, but maps the index file and answers from it in place, shared with other processes.<br/>
+ * - save NAME PATH: writes a bitvector to an index file, replies ok or an error.<br/>
+ * - drop NAME: frees a bitvector, replies ok or an error.<br/>
+ * - query NAME N: followed by exactly N queries in the format of the input files, replies with the N answers, one per
+ * line, or with a single error line.<br/>
+ * - quit: ends the session. shutdown: ends the session and stops the server.<br/>
+ * Errors are a single line starting with "error ", the server keeps running.<br/>
+ * Sessions run on stdin and stdout, or on the connections of a Unix socket one after another. The bitvectors are kept
+ * across sessions.
+ */
+class queryserver {
+
+public:
+    queryserver(const buildOptions& build, unsigned int threads, bool strict);
+
+    bool build(const std::string& name, const char* path, std::string& error);
+    bool serve(std::FILE* in, std::FILE* out);
+    bool listen(const char* socketPath);
+private:
+#ifdef INTERLEAVED
+    typedef std::variant<bitvector> anyBitvector;
+#else
+    typedef std::variant<bitvector, smallBitvector> anyBitvector;
+#endif
+
+    bool load(const std::string& name, const char* path, bool mapped, std::string& error);
+    bool save(const std::string& name, const char* path, std::string& error);
+    bool query(const std::string& name, uint64 count, std::FILE* in, resultwriter& writer, std::string& error);
+
+    buildOptions options;
+    unsigned int threads;
+    bool strict;
+    // The number of the last line read in the current session, for the error messages of malformed queries.
+    uint64 line = 0;
+    std::map<std::string, anyBitvector, std::less<>> vectors;
+    std::string queries, queryLine;
+    std::vector<command> commands;
+};
+
+#endif
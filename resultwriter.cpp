@@ -0,0 +1,33 @@
+#include "resultwriter.h"
+
+/**
+ * Creates a writer for the given file, which must be opened for writing. Binary mode is recommended,
+ * so the line breaks are not translated.
+ * @param file The file to write to.
+ */
+resultwriter::resultwriter(std::FILE* file) : file(file), buffer(RESULT_BUFFER_SIZE) {}
+
+/**
+ * Writes everything that is still buffered. Errors are lost here, call flush() to get them.
+ */
+resultwriter::~resultwriter() {
+    flush();
+}
+
+/**
+ * Writes the buffer to the file in one call and empties it.
+ */
+void resultwriter::writeBuffer() {
+    if (used > 0 && std::fwrite(buffer.data(), 1, used, file) != used) failed = true;
+    used = 0;
+}
+
+/**
+ * Writes everything that is still buffered and flushes the file.
+ * @return Whether all writes so far succeeded.
+ */
+bool resultwriter::flush() {
+    writeBuffer();
+    if (std::fflush(file) != 0) failed = true;
+    return !failed;
+}
@@ -0,0 +1,46 @@
+#ifndef BITVECTOR_RESULTWRITER_H
+#define BITVECTOR_RESULTWRITER_H
+
+#include <charconv>
+#include <cstdio>
+#include <vector>
+#include "bitvector.h"
+
+#define RESULT_BUFFER_SIZE (1 << 20)    // Bytes collected before a single write to the file.
+
+/**
+ * Writes query answers as one decimal number per line. The numbers are formatted into a large buffer,
+ * which is written to the file in big chunks instead of flushing after every line.<br/>
+ * The file is not owned by the writer and must stay open until flush() was called.
+ */
+class resultwriter {
+
+public:
+    explicit resultwriter(std::FILE* file);
+    ~resultwriter();
+    resultwriter(const resultwriter&) = delete;
+    resultwriter& operator=(const resultwriter&) = delete;
+
+    /**
+     * Appends a number and a line break. A 64-bit number has at most 20 digits, so if 21 bytes are left,
+     * it always fits without checking again.
+     * @param value The number.
+     */
+    inline void write(uint64 value) {
+        if (RESULT_BUFFER_SIZE - used < 21) writeBuffer();
+        char* end = std::to_chars(buffer.data() + used, buffer.data() + used + 20, value).ptr;
+        *end = '\n';
+        used = end + 1 - buffer.data();
+    }
+
+    bool flush();
+private:
+    void writeBuffer();
+
+    std::FILE* file;
+    std::vector<char> buffer;
+    size_t used = 0;
+    bool failed = false;
+};
+
+#endif
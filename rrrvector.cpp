@@ -0,0 +1,295 @@
+#include "rrrvector.h"
+#include "kernels.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+
+// BINOMIAL[n][k] is n choose k, 0 for k > n. 64 choose 32 is the largest and still fits into 64 bit.
+static constexpr auto BINOMIAL = [] {
+    std::array<std::array<uint64, 65>, 65> binomial {};
+    for (uint64 n = 0; n <= 64; ++n) {
+        binomial[n][0] = 1;
+        for (uint64 k = 1; k <= n; ++k) binomial[n][k] = binomial[n - 1][k - 1] + binomial[n - 1][k];
+    }
+    return binomial;
+}();
+
+// The width of the offset of every class, enough for all 64 choose class offsets.
+static constexpr auto OFFSET_WIDTH = [] {
+    std::array<uint8_t, 65> widths {};
+    for (uint64 c = 0; c <= 64; ++c) widths[c] = std::bit_width(BINOMIAL[64][c] - 1);
+    return widths;
+}();
+
+/**
+ * Returns the offset of a word among all words with the same number of ones. With the ones at positions
+ * p_1 < ... < p_c, this is the sum of p_j choose j, which numbers all such words from 0 to 64 choose c - 1.
+ * @param word The word.
+ * @return Its offset.
+ */
+static uint64 encodeWord(uint64 word) {
+    uint64 offset = 0;
+    for (uint64 j = 1; word != 0; word &= word - 1, ++j) offset += BINOMIAL[std::countr_zero(word)][j];
+    return offset;
+}
+
+/**
+ * Decodes the bits of a word from its class and offset, from the highest one down to the lowest position that
+ * is needed. Stopping early saves most of the work for rank and access in the upper half of a word.
+ * @param ones The class of the word.
+ * @param offset The offset of the word.
+ * @param lowest The lowest position that is needed.
+ * @return The bits of the word at lowest and above, the bits below are 0.
+ */
+static uint64 decodeWord(uint64 ones, uint64 offset, uint64 lowest) {
+    if (ones == 64) return ~0ULL << lowest;
+    uint64 word = 0;
+    for (uint64 position = 63; ones > 0 && position + 1 > lowest; --position) {
+        // If there are as many ones left as positions, all of them are ones.
+        if (ones == position + 1) return word | (((2ULL << position) - 1) & (~0ULL << lowest));
+        if (offset >= BINOMIAL[position][ones]) {
+            offset -= BINOMIAL[position][ones];
+            word |= 1ULL << position;
+            --ones;
+        }
+    }
+    return word;
+}
+
+/**
+ * Creates an empty compressed bitvector with room for the classes of wordCount words, to be filled with push_back
+ * and finished with finish().
+ * @param wordCount The number of words, at least 1.
+ */
+rrrvector::rrrvector(uint64 wordCount) : wordCount(wordCount) {
+    layout(0, 0);
+    words.assign(offsetOffset, 0);
+}
+
+/**
+ * Computes where the parts of the data are. The superblock metadata and the classes only depend on the number of words,
+ * the offsets and samples on the total number of ones and offset bits, which are the metadata of the last superblock.
+ * The classes and the offsets are followed by one word of padding, so a read of two words never leaves its part.
+ * @param ones The number of ones.
+ * @param offsetBits The total width of all offsets.
+ */
+void rrrvector::layout(uint64 ones, uint64 offsetBits) {
+    uint64 superblocks = (wordCount + RRR_SUPERBLOCK_WORDS - 1) / RRR_SUPERBLOCK_WORDS + 1;
+    uint64 zeros = (wordCount << 6) - ones;
+    classOffset = superblocks << 1;
+    offsetOffset = classOffset + ((wordCount * RRR_CLASS_BITS + 63) >> 6) + 1;
+    oneSamplesOffset = offsetOffset + ((offsetBits + 63) >> 6) + 1;
+    zeroSamplesOffset = oneSamplesOffset + ((ones + (1ULL << RRR_SAMPLE_SHIFT) - 1) >> RRR_SAMPLE_SHIFT) + 1;
+    totalWords = zeroSamplesOffset + ((zeros + (1ULL << RRR_SAMPLE_SHIFT) - 1) >> RRR_SAMPLE_SHIFT) + 1;
+}
+
+/**
+ * Appends the next word of the bitvector. Exactly wordCount words must be pushed.
+ * @param word The word.
+ */
+void rrrvector::push_back(uint64 word) {
+    uint64 index = pushed++;
+    if (index % RRR_SUPERBLOCK_WORDS == 0) {
+        words[(index / RRR_SUPERBLOCK_WORDS) << 1] = onesPushed;
+        words[((index / RRR_SUPERBLOCK_WORDS) << 1) + 1] = offsetBitsPushed;
+    }
+    uint64 ones = std::popcount(word);
+    uint64 bit = index * RRR_CLASS_BITS;
+    words[classOffset + (bit >> 6)] |= ones << (bit & 63);
+    words[classOffset + (bit >> 6) + 1] |= (ones >> 1) >> (63 - (bit & 63));
+
+    uint64 width = OFFSET_WIDTH[ones];
+    if (width > 0) {
+        uint64 offset = encodeWord(word);
+        if ((offsetBitsPushed >> 6) + 1 >= pendingOffsets.size()) pendingOffsets.resize((offsetBitsPushed >> 6) + 2, 0);
+        pendingOffsets[offsetBitsPushed >> 6] |= offset << (offsetBitsPushed & 63);
+        pendingOffsets[(offsetBitsPushed >> 6) + 1] |= (offset >> 1) >> (63 - (offsetBitsPushed & 63));
+    }
+    onesPushed += ones;
+    offsetBitsPushed += width;
+}
+
+/**
+ * Writes the metadata of the last superblock, moves the offsets into place and samples the superblocks of every
+ * 2^RRR_SAMPLE_SHIFT-th one and zero, after all words were pushed. The samples end with the last superblock.
+ */
+void rrrvector::finish() {
+    uint64 superblocks = (wordCount + RRR_SUPERBLOCK_WORDS - 1) / RRR_SUPERBLOCK_WORDS;
+    words[superblocks << 1] = onesPushed;
+    words[(superblocks << 1) + 1] = offsetBitsPushed;
+    layout(onesPushed, offsetBitsPushed);
+    words.resize(totalWords, 0);
+    std::copy(pendingOffsets.begin(), pendingOffsets.begin() + (long) std::min<uint64>(pendingOffsets.size(), oneSamplesOffset - offsetOffset),
+              words.begin() + (long) offsetOffset);
+    std::vector<uint64>().swap(pendingOffsets);
+
+    auto samples = [&](uint64 sampleOffset, uint64 count, auto before) {
+        uint64 superblock = 0, next = 0;
+        for (; next < count; next += 1ULL << RRR_SAMPLE_SHIFT) {
+            while (before(superblock + 1) <= next) ++superblock;
+            words[sampleOffset++] = superblock;
+        }
+        words[sampleOffset] = superblocks - 1;
+    };
+    samples(oneSamplesOffset, onesPushed, [this](uint64 superblock) { return words[superblock << 1]; });
+    samples(zeroSamplesOffset, (wordCount << 6) - onesPushed, [this](uint64 superblock) {
+        return (std::min(superblock * RRR_SUPERBLOCK_WORDS, wordCount) << 6) - words[superblock << 1];
+    });
+}
+
+/**
+ * Replaces the compressed bitvector with data from data(), for example from an index file.
+ * @param wordCount The number of words.
+ * @param data The data of a finished compressed bitvector with the same number of words.
+ * @return Whether the data has the size that the number of words and its last superblock require.
+ * If not, the compressed bitvector is left empty.
+ */
+bool rrrvector::assign(uint64 wordCount, indexArray<uint64>&& data) {
+    this->wordCount = wordCount;
+    layout(0, 0);
+    uint64 last = ((wordCount + RRR_SUPERBLOCK_WORDS - 1) / RRR_SUPERBLOCK_WORDS) << 1;
+    if (wordCount == 0 || data.size() < offsetOffset || data[last] > wordCount << 6 || data[last + 1] > wordCount << 6) {
+        *this = rrrvector();
+        return false;
+    }
+    layout(data[last], data[last + 1]);
+    if (data.size() != totalWords) {
+        *this = rrrvector();
+        return false;
+    }
+    words = std::move(data);
+    pushed = wordCount;
+    onesPushed = words[last];
+    offsetBitsPushed = words[last + 1];
+    return true;
+}
+
+/**
+ * Returns the class of a word, the number of ones in it.
+ * @param index The word index.
+ * @return The class.
+ */
+inline uint64 rrrvector::wordClass(uint64 index) const {
+    uint64 bit = index * RRR_CLASS_BITS;
+    const uint64* classes = words.data() + classOffset;
+    uint64 bits = (classes[bit >> 6] >> (bit & 63)) | ((classes[(bit >> 6) + 1] << 1) << (63 - (bit & 63)));
+    return bits & ((1ULL << RRR_CLASS_BITS) - 1);
+}
+
+/**
+ * Reads an offset.
+ * @param bit The bit position of the offset.
+ * @param width Its width.
+ * @return The offset.
+ */
+inline uint64 rrrvector::offset(uint64 bit, uint64 width) const {
+    const uint64* offsets = words.data() + offsetOffset;
+    uint64 bits = (offsets[bit >> 6] >> (bit & 63)) | ((offsets[(bit >> 6) + 1] << 1) << (63 - (bit & 63)));
+    return bits & ((1ULL << width) - 1);
+}
+
+/**
+ * Finds the ones before a word and the position of its offset. Both start at the metadata of the superblock, and
+ * the classes of the words before it in the superblock are added.
+ * @param index The word index.
+ * @param bit Set to the bit position of the offset of the word.
+ * @return The number of ones before the word.
+ */
+uint64 rrrvector::seek(uint64 index, uint64& bit) const {
+    uint64 superblock = index / RRR_SUPERBLOCK_WORDS;
+    uint64 ones = words[superblock << 1];
+    bit = words[(superblock << 1) + 1];
+    for (uint64 w = superblock * RRR_SUPERBLOCK_WORDS; w < index; ++w) {
+        uint64 c = wordClass(w);
+        ones += c;
+        bit += OFFSET_WIDTH[c];
+    }
+    return ones;
+}
+
+/**
+ * Returns the bit value at the given position.
+ * @param position The position.
+ * @return Whether the bit is 1.
+ */
+bool rrrvector::access(uint64 position) const {
+    uint64 bit;
+    seek(position >> 6, bit);
+    uint64 c = wordClass(position >> 6);
+    return (decodeWord(c, offset(bit, OFFSET_WIDTH[c]), position & 63) >> (position & 63)) & 1;
+}
+
+/**
+ * Counts the ones before the given position. From the ones before its word, the ones in the word at and after
+ * the position are subtracted, which only needs the upper part of the word decoded.
+ * @param position The position, less than 64 times the number of words.
+ * @return The number of ones before it.
+ */
+uint64 rrrvector::rank(uint64 position) const {
+    uint64 bit;
+    uint64 ones = seek(position >> 6, bit);
+    uint64 c = wordClass(position >> 6);
+    return ones + c - std::popcount(decodeWord(c, offset(bit, OFFSET_WIDTH[c]), position & 63));
+}
+
+/**
+ * Calculates the position of the num-th 1.
+ * @param num The number of the 1, at least 1 and at most the number of ones.
+ * @return Its position.
+ */
+uint64 rrrvector::select_1(uint64 num) const {
+    return select<true>(num);
+}
+
+/**
+ * Calculates the position of the num-th 0.
+ * @param num The number of the 0, at least 1 and at most the number of zeros.
+ * @return Its position.
+ */
+uint64 rrrvector::select_0(uint64 num) const {
+    return select<false>(num);
+}
+
+/**
+ * Finds the superblock of the num-th one or zero by a binary search between the samples before and after it,
+ * then walks the classes of its words and decodes the word that contains it.
+ * @tparam ONE Whether to select ones or zeros.
+ * @param num The number of the one or zero.
+ * @return Its position.
+ */
+template<bool ONE>
+uint64 rrrvector::select(uint64 num) const {
+    const uint64* samples = words.data() + (ONE ? oneSamplesOffset : zeroSamplesOffset) + ((num - 1) >> RRR_SAMPLE_SHIFT);
+    auto before = [this](uint64 superblock) {
+        uint64 ones = words[superblock << 1];
+        return ONE ? ones : ((superblock * RRR_SUPERBLOCK_WORDS) << 6) - ones;
+    };
+    // The last superblock with fewer ones or zeros before it than num.
+    uint64 first = samples[0], last = samples[1];
+    while (first < last) {
+        uint64 middle = first + ((last - first + 1) >> 1);
+        if (before(middle) < num) first = middle;
+        else last = middle - 1;
+    }
+
+    uint64 count = before(first), bit = words[(first << 1) + 1];
+    for (uint64 w = first * RRR_SUPERBLOCK_WORDS;; ++w) {
+        uint64 c = wordClass(w);
+        uint64 inWord = ONE ? c : 64 - c;
+        if (count + inWord >= num) {
+            uint64 word = decodeWord(c, offset(bit, OFFSET_WIDTH[c]), 0);
+            return (w << 6) + selectInWord(ONE ? word : ~word, num - count - 1);
+        }
+        count += inWord;
+        bit += OFFSET_WIDTH[c];
+    }
+}
+
+/**
+ * This calculates how much bit in total the compressed bitvector is taking up, including its scalar fields.
+ * @return The space usage in bit.
+ */
+uint64 rrrvector::size() const {
+    // 10 * 64 bit through the word count, the offsets of the parts and the build counters.
+    return 640 + words.reservedBytes() * 8;
+}
@@ -0,0 +1,61 @@
+#ifndef BITVECTOR_RRRVECTOR_H
+#define BITVECTOR_RRRVECTOR_H
+
+#include <cstddef>
+#include <vector>
+#include "indexarray.h"
+
+// The same type as in bitvector.h, which includes this header.
+typedef unsigned long long uint64;
+
+#define RRR_SUPERBLOCK_WORDS 32         // 2048 bit per superblock of rank metadata.
+#define RRR_CLASS_BITS 7                // A class is the number of ones in a word, 0 to 64.
+#define RRR_SAMPLE_SHIFT 13             // The superblock of every 2^13 = 8192th one and zero is sampled for select.
+
+/**
+ * A bitvector compressed with the RRR encoding on 64-bit words. Every word is stored as its class, the number of
+ * ones in it, and its offset, the number of the word among all words of its class in the combinatorial number system.
+ * The offset takes log2(64 choose class) bit, which is little for words with few or many ones, so medium-entropy
+ * vectors shrink while random ones grow by about 7%.<br/>
+ * Like the superblocks of the plain layout, every 2048 bit have 128 bit of metadata: the ones before the superblock
+ * and the bit position of its first offset. Rank and access add up the classes before the word inside its superblock
+ * and then decode only the upper bits of the word, select finds the superblock between two sampled ones or zeros.<br/>
+ * All data is in a single vector: the superblock metadata including one superblock after the last word, the packed
+ * classes, the offsets, and the samples for ones and zeros. The sizes of the parts follow from the number of words and
+ * the last superblock, so the data can be saved and loaded as one block.
+ */
+class rrrvector {
+
+public:
+    rrrvector() = default;
+    explicit rrrvector(uint64 wordCount);
+
+    void push_back(uint64 word);
+    void finish();
+    bool assign(uint64 wordCount, indexArray<uint64>&& data);
+
+    // All queries are read-only and can be called from many threads at once after finish.
+    bool access(uint64 position) const;
+    uint64 rank(uint64 position) const;
+    uint64 select_1(uint64 num) const;
+    uint64 select_0(uint64 num) const;
+    uint64 size() const;
+    const indexArray<uint64>& data() const { return words; }
+private:
+    void layout(uint64 ones, uint64 offsetBits);
+    uint64 wordClass(uint64 index) const;
+    uint64 offset(uint64 bit, uint64 width) const;
+    uint64 seek(uint64 index, uint64& bit) const;
+    uint64 decode(uint64 index) const;
+    template<bool ONE> uint64 select(uint64 num) const;
+
+    uint64 wordCount = 0, pushed = 0;
+    // The offsets in words of the classes, offsets and samples, and how many bits the offsets take.
+    uint64 classOffset = 0, offsetOffset = 0, oneSamplesOffset = 0, zeroSamplesOffset = 0, totalWords = 0;
+    uint64 onesPushed = 0, offsetBitsPushed = 0;
+    indexArray<uint64> words;
+    // While building, the offsets are collected separately, their total size is only known at the end.
+    std::vector<uint64> pendingOffsets;
+};
+
+#endif
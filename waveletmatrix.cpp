@@ -0,0 +1,138 @@
+#include "waveletmatrix.h"
+
+#include <algorithm>
+#include <bit>
+#include <utility>
+
+/**
+ * Builds the wavelet matrix of a sequence. Every level is packed into words directly and handed to its bitvector
+ * without a copy, then the symbols are stably sorted by the bit of the level for the next one.<br/>
+ * The options apply to the bitvectors of all levels. Select queries need both kinds of select samples.
+ * @param values The sequence.
+ * @param options The options for building the helper structures of the levels.
+ */
+waveletmatrix::waveletmatrix(const std::vector<uint64>& values, const buildOptions& options) : count(values.size()) {
+    uint64 largest = 0;
+    for (uint64 value : values) largest |= value;
+    auto height = (uint64) std::bit_width(largest);
+
+    std::vector<uint64> current = values, next(values.size());
+    levels.reserve(height);
+    zeros.reserve(height);
+    for (uint64 level = 0; level < height; ++level) {
+        uint64 bit = height - 1 - level;
+        indexArray<uint64> words((count + 63) >> 6);
+        uint64 levelZeros = 0;
+        for (uint64 i = 0; i < count; ++i) {
+            uint64 set = (current[i] >> bit) & 1;
+            words[i >> 6] |= set << (i & 63);
+            levelZeros += set ^ 1;
+        }
+
+        // Stable partition, the symbols with a 0 first.
+        uint64 zeroIndex = 0, oneIndex = levelZeros;
+        for (uint64 value : current) next[(value >> bit) & 1 ? oneIndex++ : zeroIndex++] = value;
+        std::swap(current, next);
+
+        levels.emplace_back(std::move(words), count);
+        levels.back().buildHelpers(options);
+        zeros.push_back(levelZeros);
+    }
+}
+
+/**
+ * Returns the symbol at a position. On every level, the bit of the symbol decides whether it moves into the zeros or the
+ * ones of the next level, its rank among them is its position there.
+ * @param position The position, less than length().
+ * @return The symbol.
+ */
+uint64 waveletmatrix::access(uint64 position) const {
+    uint64 symbol = 0;
+    for (uint64 level = 0; level < levels.size(); ++level) {
+        uint64 bit = levels[level].access(position);
+        symbol = (symbol << 1) | bit;
+        position = bit ? zeros[level] + levels[level].rank(position, 1) : levels[level].rank(position, 0);
+    }
+    return symbol;
+}
+
+/**
+ * Counts the occurrences of a symbol before a position. All occurrences of the symbol before any position stay together
+ * on every level, so the range between the start of the symbol's occurrences and the position is followed down.
+ * @param symbol The symbol.
+ * @param position The position, may be length() or larger.
+ * @return The number of occurrences before the position.
+ */
+uint64 waveletmatrix::rank(uint64 symbol, uint64 position) const {
+    if (std::bit_width(symbol) > levels.size()) return 0;
+    uint64 begin = 0, end = std::min(position, count);
+    for (uint64 level = 0; level < levels.size(); ++level) {
+        uint8_t bit = (symbol >> (levels.size() - 1 - level)) & 1;
+        auto [beginRank, endRank] = levels[level].rank_pair(begin, end, bit);
+        begin = (bit ? zeros[level] : 0) + beginRank;
+        end = (bit ? zeros[level] : 0) + endRank;
+    }
+    return end - begin;
+}
+
+/**
+ * Finds the position of the num-th occurrence of a symbol. The start of the symbol's occurrences on the last level is
+ * found like in rank(...), then the occurrence is followed back up with one select per level.
+ * @param symbol The symbol.
+ * @param num The 1-based number of the occurrence.
+ * @return Its position, or length() if the symbol occurs fewer than num times or num is 0.
+ */
+uint64 waveletmatrix::select(uint64 symbol, uint64 num) const {
+    if (num == 0 || rank(symbol, count) < num) return count;
+    uint64 begin = 0;
+    for (uint64 level = 0; level < levels.size(); ++level) {
+        uint8_t bit = (symbol >> (levels.size() - 1 - level)) & 1;
+        begin = (bit ? zeros[level] : 0) + levels[level].rank(begin, bit);
+    }
+
+    uint64 position = begin + num - 1;
+    for (uint64 level = levels.size(); level-- > 0;) {
+        uint8_t bit = (symbol >> (levels.size() - 1 - level)) & 1;
+        // The position among the zeros or ones of the level, 1-based for select.
+        uint64 index = bit ? position - zeros[level] + 1 : position + 1;
+        position = levels[level].select(index, bit);
+    }
+    return position;
+}
+
+/**
+ * Returns the k-th smallest symbol in a range. On every level, the zeros of the range hold its smaller symbols, so the
+ * range moves into the zeros if there are more than k of them, and into the ones otherwise.
+ * @param begin The first position of the range.
+ * @param end The end of the range, at most length().
+ * @param k The 0-based rank of the symbol in sorted order, less than end - begin.
+ * @return The symbol.
+ */
+uint64 waveletmatrix::quantile(uint64 begin, uint64 end, uint64 k) const {
+    uint64 symbol = 0;
+    for (uint64 level = 0; level < levels.size(); ++level) {
+        auto [beginOnes, endOnes] = levels[level].rank_pair(begin, end, 1);
+        uint64 rangeZeros = (end - begin) - (endOnes - beginOnes);
+        if (k < rangeZeros) {
+            symbol <<= 1;
+            begin -= beginOnes;
+            end -= endOnes;
+        } else {
+            symbol = (symbol << 1) | 1;
+            k -= rangeZeros;
+            begin = zeros[level] + beginOnes;
+            end = zeros[level] + endOnes;
+        }
+    }
+    return symbol;
+}
+
+/**
+ * This calculates how much bit in total the wavelet matrix is taking up, including the bitvectors of all levels.
+ * @return The space usage in bit.
+ */
+uint64 waveletmatrix::size() const {
+    uint64 total = 64 + zeros.capacity() * 64;
+    for (const auto& level : levels) total += level.size();
+    return total;
+}
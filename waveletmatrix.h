@@ -0,0 +1,36 @@
+#ifndef BITVECTOR_WAVELETMATRIX_H
+#define BITVECTOR_WAVELETMATRIX_H
+
+#include <cstddef>
+#include <vector>
+#include "bitvector.h"
+
+/**
+ * A wavelet matrix over a sequence of integers, for rank and select over sequences with large alphabets. Instead of one
+ * bitvector per symbol, there is one bitvector per bit of the largest symbol, so an alphabet of size sigma takes
+ * log2(sigma) bitvectors of the length of the sequence.<br/>
+ * Level l holds bit l, counted from the highest one, of every symbol. Before the next level, the symbols are stably
+ * sorted by this bit, all symbols with a 0 first. Every query follows one symbol or range through the levels with one
+ * rank or select per level, ranges use rank_pair(...) for both ends at once.
+ */
+class waveletmatrix {
+
+public:
+    waveletmatrix() = default;
+    explicit waveletmatrix(const std::vector<uint64>& values, const buildOptions& options = {});
+
+    // All queries are read-only and can be called from many threads at once.
+    uint64 access(uint64 position) const;
+    uint64 rank(uint64 symbol, uint64 position) const;
+    uint64 select(uint64 symbol, uint64 num) const;
+    uint64 quantile(uint64 begin, uint64 end, uint64 k) const;
+    uint64 length() const { return count; }
+    uint64 size() const;
+private:
+    uint64 count = 0;
+    std::vector<bitvector> levels;
+    // The number of zeros on every level, where the symbols with a 1 start on the next level.
+    std::vector<uint64> zeros;
+};
+
+#endif